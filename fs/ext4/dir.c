@@ -450,12 +450,134 @@ static void ext4_htree_init_dir_info(struct file *filp, loff_t pos)
 	}
 }
 
+/*
+ * Readers of a large htree directory each rebuild the hash ordered view
+ * of it one leaf at a time.  When many processes scan the same directory
+ * (e.g. backup or indexing jobs), that is the dominating cost, so a
+ * reader that walks the directory from offset 0 to EOF records every
+ * entry it returns into a flat array, already in hash order, and hangs
+ * it off the inode for the readers after it.  The first reader is not
+ * delayed: it streams entries from the rb-tree exactly as before.
+ *
+ * The cache is tagged with the i_version it was built under, and any
+ * change of the directory drops it.  A reader that finds its cache stale
+ * hands over to the rb-tree path at the hash it has reached.  The arrays
+ * are charged to the memcg of the reader that built them, and all caches
+ * of a file system sit on an LRU list that a shrinker trims under memory
+ * pressure.
+ */
+struct ext4_dc_entry {
+	__u32		hash;
+	__u32		minor_hash;
+	__u32		inode;
+	__u32		name_off;
+	__u8		name_len;
+	__u8		file_type;
+};
+
+struct ext4_dir_cache {
+	refcount_t		dc_ref;
+	u64			dc_cookie;	/* i_version it was built at */
+	struct list_head	dc_lru;		/* on s_dir_cache_lru */
+	struct inode		*dc_inode;
+	unsigned long		dc_pages;	/* accounted in s_dir_cache_pages */
+	unsigned int		dc_nr;
+	unsigned int		dc_size;
+	struct ext4_dc_entry	*dc_ents;
+	char			*dc_names;
+	size_t			dc_names_len;
+	size_t			dc_names_size;
+};
+
+static void ext4_dir_cache_put(struct ext4_dir_cache *dc)
+{
+	if (dc && refcount_dec_and_test(&dc->dc_ref)) {
+		kvfree(dc->dc_ents);
+		kvfree(dc->dc_names);
+		kfree(dc);
+	}
+}
+
+/* Detach the cache of @dir from the inode and the LRU; needs dir->i_lock */
+static struct ext4_dir_cache *__ext4_dir_cache_detach(struct inode *dir)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(dir->i_sb);
+	struct ext4_dir_cache *dc = EXT4_I(dir)->i_dir_cache;
+
+	if (dc) {
+		EXT4_I(dir)->i_dir_cache = NULL;
+		spin_lock(&sbi->s_dir_cache_lock);
+		list_del(&dc->dc_lru);
+		sbi->s_dir_cache_pages -= dc->dc_pages;
+		spin_unlock(&sbi->s_dir_cache_lock);
+	}
+	return dc;
+}
+
+void ext4_dir_cache_invalidate(struct inode *dir)
+{
+	struct ext4_dir_cache *dc;
+
+	if (!READ_ONCE(EXT4_I(dir)->i_dir_cache))
+		return;
+	spin_lock(&dir->i_lock);
+	dc = __ext4_dir_cache_detach(dir);
+	spin_unlock(&dir->i_lock);
+	ext4_dir_cache_put(dc);
+}
+
 void ext4_htree_free_dir_info(struct dir_private_info *p)
 {
 	free_rb_tree_fname(&p->root);
+	ext4_dir_cache_put(p->dc);
+	ext4_dir_cache_put(p->dc_build);
 	kfree(p);
 }
 
+static int ext4_dir_cache_add(struct ext4_dir_cache *dc, struct fname *fname)
+{
+	struct ext4_dc_entry *ent;
+
+	if (dc->dc_nr == dc->dc_size) {
+		unsigned int size = max(dc->dc_size * 2, 256U);
+
+		ent = kvrealloc(dc->dc_ents, size * sizeof(*ent),
+				GFP_KERNEL_ACCOUNT);
+		if (!ent)
+			return -ENOMEM;
+		dc->dc_ents = ent;
+		dc->dc_size = size;
+	}
+	if (dc->dc_names_len + fname->name_len > dc->dc_names_size) {
+		size_t size = max3(dc->dc_names_size * 2,
+				   dc->dc_names_len + fname->name_len,
+				   (size_t)PAGE_SIZE);
+		char *names = kvrealloc(dc->dc_names, size, GFP_KERNEL_ACCOUNT);
+
+		if (!names)
+			return -ENOMEM;
+		dc->dc_names = names;
+		dc->dc_names_size = size;
+	}
+
+	ent = &dc->dc_ents[dc->dc_nr++];
+	ent->hash = fname->hash;
+	ent->minor_hash = fname->minor_hash;
+	ent->inode = fname->inode;
+	ent->name_off = dc->dc_names_len;
+	ent->name_len = fname->name_len;
+	ent->file_type = fname->file_type;
+	memcpy(dc->dc_names + dc->dc_names_len, fname->name, fname->name_len);
+	dc->dc_names_len += fname->name_len;
+	return 0;
+}
+
+static void ext4_dir_cache_abandon(struct dir_private_info *info)
+{
+	ext4_dir_cache_put(info->dc_build);
+	info->dc_build = NULL;
+}
+
 /*
  * Given a directory entry, enter it into the fname rb tree.
  *
@@ -546,11 +668,229 @@ static int call_filldir(struct file *file, struct dir_context *ctx,
 			info->extra_fname = fname;
 			return 1;
 		}
+		if (info->dc_build && ext4_dir_cache_add(info->dc_build, fname))
+			ext4_dir_cache_abandon(info);
 		fname = fname->next;
 	}
 	return 0;
 }
 
+static int ext4_dc_entry_cmp(const void *a, const void *b)
+{
+	const struct ext4_dc_entry *e1 = a, *e2 = b;
+
+	if (e1->hash != e2->hash)
+		return e1->hash < e2->hash ? -1 : 1;
+	if (e1->minor_hash != e2->minor_hash)
+		return e1->minor_hash < e2->minor_hash ? -1 : 1;
+	return 0;
+}
+
+static bool ext4_dir_cache_wanted(struct inode *inode)
+{
+	loff_t max = (loff_t)EXT4_SB(inode->i_sb)->s_dir_cache_max_kb << 10;
+
+	return ext4_test_inode_flag(inode, EXT4_INODE_INDEX) &&
+	       !IS_ENCRYPTED(inode) && inode->i_size <= max;
+}
+
+static struct ext4_dir_cache *ext4_dir_cache_alloc(struct inode *inode)
+{
+	struct ext4_dir_cache *dc;
+
+	dc = kzalloc(sizeof(*dc), GFP_KERNEL_ACCOUNT);
+	if (!dc)
+		return NULL;
+	refcount_set(&dc->dc_ref, 1);
+	INIT_LIST_HEAD(&dc->dc_lru);
+	dc->dc_cookie = inode_query_iversion(inode);
+	return dc;
+}
+
+/*
+ * The reader that was recording the directory has reached EOF.  Hang its
+ * array off the inode unless the directory changed while it was reading.
+ */
+static void ext4_dir_cache_install(struct file *file)
+{
+	struct dir_private_info *info = file->private_data;
+	struct inode *inode = file_inode(file);
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct ext4_dir_cache *dc = info->dc_build, *old;
+
+	info->dc_build = NULL;
+	if (!inode_eq_iversion(inode, dc->dc_cookie)) {
+		ext4_dir_cache_put(dc);
+		return;
+	}
+	dc->dc_inode = inode;
+	dc->dc_pages = DIV_ROUND_UP(dc->dc_size * sizeof(*dc->dc_ents) +
+				    dc->dc_names_size, PAGE_SIZE);
+
+	spin_lock(&inode->i_lock);
+	old = __ext4_dir_cache_detach(inode);
+	EXT4_I(inode)->i_dir_cache = dc;
+	spin_lock(&sbi->s_dir_cache_lock);
+	list_add_tail(&dc->dc_lru, &sbi->s_dir_cache_lru);
+	sbi->s_dir_cache_pages += dc->dc_pages;
+	spin_unlock(&sbi->s_dir_cache_lock);
+	spin_unlock(&inode->i_lock);
+	ext4_dir_cache_put(old);
+}
+
+static struct ext4_dir_cache *ext4_dir_cache_get(struct inode *inode)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct ext4_dir_cache *dc;
+
+	spin_lock(&inode->i_lock);
+	dc = EXT4_I(inode)->i_dir_cache;
+	if (dc && inode_eq_iversion(inode, dc->dc_cookie)) {
+		refcount_inc(&dc->dc_ref);
+		spin_lock(&sbi->s_dir_cache_lock);
+		list_move_tail(&dc->dc_lru, &sbi->s_dir_cache_lru);
+		spin_unlock(&sbi->s_dir_cache_lock);
+	} else {
+		dc = NULL;
+	}
+	spin_unlock(&inode->i_lock);
+	return dc;
+}
+
+static unsigned long ext4_dir_cache_count(struct shrinker *shrink,
+					  struct shrink_control *sc)
+{
+	struct ext4_sb_info *sbi = shrink->private_data;
+
+	return READ_ONCE(sbi->s_dir_cache_pages);
+}
+
+static unsigned long ext4_dir_cache_scan(struct shrinker *shrink,
+					 struct shrink_control *sc)
+{
+	struct ext4_sb_info *sbi = shrink->private_data;
+	struct ext4_dir_cache *dc, *tmp;
+	unsigned long freed = 0;
+	LIST_HEAD(dispose);
+
+	spin_lock(&sbi->s_dir_cache_lock);
+	list_for_each_entry_safe(dc, tmp, &sbi->s_dir_cache_lru, dc_lru) {
+		struct inode *inode = dc->dc_inode;
+
+		if (freed >= sc->nr_to_scan)
+			break;
+		/* i_lock nests outside s_dir_cache_lock */
+		if (!spin_trylock(&inode->i_lock))
+			continue;
+		EXT4_I(inode)->i_dir_cache = NULL;
+		list_move(&dc->dc_lru, &dispose);
+		sbi->s_dir_cache_pages -= dc->dc_pages;
+		freed += dc->dc_pages;
+		spin_unlock(&inode->i_lock);
+	}
+	spin_unlock(&sbi->s_dir_cache_lock);
+
+	list_for_each_entry_safe(dc, tmp, &dispose, dc_lru)
+		ext4_dir_cache_put(dc);
+	return freed;
+}
+
+int ext4_dir_cache_register_shrinker(struct ext4_sb_info *sbi)
+{
+	INIT_LIST_HEAD(&sbi->s_dir_cache_lru);
+	spin_lock_init(&sbi->s_dir_cache_lock);
+	sbi->s_dir_cache_pages = 0;
+
+	sbi->s_dir_cache_shrinker = shrinker_alloc(0, "ext4-dir:%s",
+						   sbi->s_sb->s_id);
+	if (!sbi->s_dir_cache_shrinker)
+		return -ENOMEM;
+	sbi->s_dir_cache_shrinker->scan_objects = ext4_dir_cache_scan;
+	sbi->s_dir_cache_shrinker->count_objects = ext4_dir_cache_count;
+	sbi->s_dir_cache_shrinker->private_data = sbi;
+	shrinker_register(sbi->s_dir_cache_shrinker);
+	return 0;
+}
+
+void ext4_dir_cache_unregister_shrinker(struct ext4_sb_info *sbi)
+{
+	shrinker_free(sbi->s_dir_cache_shrinker);
+}
+
+/*
+ * Serve readdir from the shared cache.  Returns -EAGAIN when the caller
+ * should use the rb-tree path instead; a reader starting at offset 0 then
+ * records what it returns so that it can leave a cache behind at EOF.
+ */
+static int ext4_dir_cache_readdir(struct file *file, struct dir_context *ctx)
+{
+	struct dir_private_info *info = file->private_data;
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct ext4_dir_cache *dc = info->dc;
+	struct ext4_dc_entry *ent;
+
+	if (!dc) {
+		if (ctx->pos != 0 || !ext4_dir_cache_wanted(inode))
+			return -EAGAIN;
+		dc = ext4_dir_cache_get(inode);
+		if (!dc) {
+			if (!info->dc_build)
+				info->dc_build = ext4_dir_cache_alloc(inode);
+			return -EAGAIN;
+		}
+		ext4_dir_cache_abandon(info);
+		info->dc = dc;
+		info->dc_index = 0;
+		info->last_pos = ctx->pos;
+	}
+
+	if (!inode_eq_iversion(inode, dc->dc_cookie)) {
+		/* Continue from where we are on the rb-tree path */
+		ext4_dir_cache_put(dc);
+		info->dc = NULL;
+		free_rb_tree_fname(&info->root);
+		info->curr_node = NULL;
+		info->extra_fname = NULL;
+		info->curr_hash = pos2maj_hash(file, ctx->pos);
+		info->curr_minor_hash = pos2min_hash(file, ctx->pos);
+		info->last_pos = ctx->pos;
+		return -EAGAIN;
+	}
+
+	/* Some one has messed with f_pos; find the first entry at or past it */
+	if (info->last_pos != ctx->pos) {
+		struct ext4_dc_entry key = {
+			.hash = pos2maj_hash(file, ctx->pos),
+			.minor_hash = pos2min_hash(file, ctx->pos),
+		};
+		unsigned int lo = 0, hi = dc->dc_nr;
+
+		while (lo < hi) {
+			unsigned int mid = lo + (hi - lo) / 2;
+
+			if (ext4_dc_entry_cmp(&dc->dc_ents[mid], &key) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		info->dc_index = lo;
+	}
+
+	for (; info->dc_index < dc->dc_nr; info->dc_index++) {
+		ent = &dc->dc_ents[info->dc_index];
+		ctx->pos = hash2pos(file, ent->hash, ent->minor_hash);
+		if (!dir_emit(ctx, dc->dc_names + ent->name_off,
+			      ent->name_len, ent->inode,
+			      get_dtype(sb, ent->file_type)))
+			goto out;
+	}
+	ctx->pos = ext4_get_htree_eof(file);
+out:
+	info->last_pos = ctx->pos;
+	return 0;
+}
+
 static int ext4_dx_readdir(struct file *file, struct dir_context *ctx)
 {
 	struct dir_private_info *info = file->private_data;
@@ -563,6 +903,15 @@ static int ext4_dx_readdir(struct file *file, struct dir_context *ctx)
 	if (ctx->pos == ext4_get_htree_eof(file))
 		return 0;	/* EOF */
 
+	/* A recording reader that seeks no longer sees the whole directory */
+	if (info->dc_build && info->last_pos != ctx->pos)
+		ext4_dir_cache_abandon(info);
+
+	ret = ext4_dir_cache_readdir(file, ctx);
+	if (ret != -EAGAIN)
+		return ret;
+	ret = 0;
+
 	/* Some one has messed with f_pos; reset the world */
 	if (info->last_pos != ctx->pos) {
 		free_rb_tree_fname(&info->root);
@@ -595,6 +944,9 @@ static int ext4_dx_readdir(struct file *file, struct dir_context *ctx)
 			info->curr_node = NULL;
 			free_rb_tree_fname(&info->root);
 			info->cookie = inode_query_iversion(inode);
+			if (info->dc_build &&
+			    !inode_eq_iversion(inode, info->dc_build->dc_cookie))
+				ext4_dir_cache_abandon(info);
 			ret = ext4_htree_fill_tree(file, info->curr_hash,
 						   info->curr_minor_hash,
 						   &info->next_hash);
@@ -629,6 +981,9 @@ static int ext4_dx_readdir(struct file *file, struct dir_context *ctx)
 		}
 	}
 finished:
+	if (info->dc_build && ret >= 0 &&
+	    ctx->pos == ext4_get_htree_eof(file))
+		ext4_dir_cache_install(file);
 	info->last_pos = ctx->pos;
 	return ret < 0 ? ret : 0;
 }
@@ -300,6 +300,7 @@ typedef struct ext4_io_end {
 	unsigned int		flag;		/* unwritten or not */
 	refcount_t		count;		/* reference counter */
 	struct list_head	list_vec;	/* list of ext4_io_end_vec */
+	ktime_t			queued;		/* queued for conversion */
 } ext4_io_end_t;
 
 struct ext4_io_submit {
@@ -307,6 +308,7 @@ struct ext4_io_submit {
 	struct bio		*io_bio;
 	ext4_io_end_t		*io_end;
 	sector_t		io_next_block;
+	bool			io_keep_in_use;	/* of the active snapshot */
 };
 
 /*
@@ -439,6 +441,7 @@ struct flex_groups {
 #define EXT4_BG_INODE_UNINIT	0x0001 /* Inode table/bitmap not in use */
 #define EXT4_BG_BLOCK_UNINIT	0x0002 /* Block bitmap not in use */
 #define EXT4_BG_INODE_ZEROED	0x0004 /* On-disk itable initialized to zero */
+#define EXT4_BG_TRIMMED		0x0008 /* Free space discarded (trimmed_bg) */
 
 /*
  * Macro-instructions used to manage group descriptors
@@ -498,6 +501,7 @@ struct flex_groups {
 #define EXT4_EA_INODE_FL	        0x00200000 /* Inode used for large EA */
 /* 0x00400000 was formerly EXT4_EOFBLOCKS_FL */
 
+#define EXT4_SNAPFILE_FL		0x01000000 /* Inode is a snapshot image */
 #define EXT4_DAX_FL			0x02000000 /* Inode is DAX */
 
 #define EXT4_INLINE_DATA_FL		0x10000000 /* Inode has inline data. */
@@ -596,6 +600,7 @@ enum {
 	EXT4_INODE_VERITY	= 20,	/* Verity protected inode */
 	EXT4_INODE_EA_INODE	= 21,	/* Inode used for large EA */
 /* 22 was formerly EXT4_INODE_EOFBLOCKS */
+	EXT4_INODE_SNAPFILE	= 24,	/* Inode is a snapshot image */
 	EXT4_INODE_DAX		= 25,	/* Inode is DAX */
 	EXT4_INODE_INLINE_DATA	= 28,	/* Data in inode. */
 	EXT4_INODE_PROJINHERIT	= 29,	/* Create with parents projid */
@@ -643,6 +648,7 @@ static inline void ext4_check_flag_values(void)
 	CHECK_FLAG_VALUE(EXTENTS);
 	CHECK_FLAG_VALUE(VERITY);
 	CHECK_FLAG_VALUE(EA_INODE);
+	CHECK_FLAG_VALUE(SNAPFILE);
 	CHECK_FLAG_VALUE(INLINE_DATA);
 	CHECK_FLAG_VALUE(PROJINHERIT);
 	CHECK_FLAG_VALUE(CASEFOLD);
@@ -720,6 +726,9 @@ enum {
 #define EXT4_GET_BLOCKS_IO_SUBMIT		0x0400
 	/* Caller is in the atomic contex, find extent if it has been cached */
 #define EXT4_GET_BLOCKS_CACHED_NOWAIT		0x0800
+	/* Caller is about to overwrite mapped blocks in place, move them
+	 * to the active snapshot first if they belong to it */
+#define EXT4_GET_BLOCKS_MOVE_ON_WRITE		0x1000
 
 /*
  * The bit position of these flags must not overlap with any of the
@@ -744,6 +753,7 @@ enum {
 #define EXT4_FREE_BLOCKS_NOFREE_FIRST_CLUSTER	0x0010
 #define EXT4_FREE_BLOCKS_NOFREE_LAST_CLUSTER	0x0020
 #define EXT4_FREE_BLOCKS_RERESERVE_CLUSTER      0x0040
+#define EXT4_FREE_BLOCKS_NO_SNAPSHOT		0x0080
 
 #if defined(__KERNEL__) && defined(CONFIG_COMPAT)
 /*
@@ -992,12 +1002,16 @@ do {										\
  *			  than the first
  *  I_DATA_SEM_QUOTA  - Used for quota inodes only
  *  I_DATA_SEM_EA     - Used for ea_inodes only
+ *  I_DATA_SEM_SNAPSHOT - Used for the active snapshot inode only, which
+ *			  gets blocks mapped while holding i_data_sem of
+ *			  the inode being modified
  */
 enum {
 	I_DATA_SEM_NORMAL = 0,
 	I_DATA_SEM_OTHER,
 	I_DATA_SEM_QUOTA,
-	I_DATA_SEM_EA
+	I_DATA_SEM_EA,
+	I_DATA_SEM_SNAPSHOT
 };
 
 
@@ -1117,6 +1131,22 @@ struct ext4_inode_info {
 	/* extents status tree */
 	struct ext4_es_tree i_es_tree;
 	rwlock_t i_es_lock;
+	seqcount_rwlock_t i_es_seq;	/* bumped when i_es_tree changes */
+
+	/*
+	 * Path of the last extent tree lookup, reused by the next one if the
+	 * tree hasn't changed since (i_ext_generation is still i_ext_cursor_gen)
+	 */
+	spinlock_t i_ext_cursor_lock;
+	struct ext4_ext_path *i_ext_cursor;
+	unsigned int i_ext_cursor_gen;
+	unsigned int i_ext_generation;	/* modified under i_data_sem */
+
+	/* shared hash ordered readdir cache, protected by i_lock */
+	struct ext4_dir_cache *i_dir_cache;
+	/* filter of names in a large directory, for negative lookups */
+	struct ext4_dir_bloom *i_dir_bloom;
+	unsigned long i_dir_bloom_retry;	/* jiffies, after a failed build */
 	struct list_head i_es_list;
 	unsigned int i_es_all_nr;	/* protected by i_es_lock */
 	unsigned int i_es_shk_nr;	/* protected by i_es_lock */
@@ -1254,6 +1284,9 @@ struct ext4_inode_info {
 						    * scanning in mballoc
 						    */
 #define EXT4_MOUNT2_ABORT		0x00000100 /* Abort filesystem */
+#define EXT4_MOUNT2_DIR_SHRINK		0x00000200 /* Compact htree dirs on
+						    * delete
+						    */
 
 #define clear_opt(sb, opt)		EXT4_SB(sb)->s_mount_opt &= \
 						~EXT4_MOUNT_##opt
@@ -1428,7 +1461,10 @@ struct ext4_super_block {
 	__le16  s_encoding;		/* Filename charset encoding */
 	__le16  s_encoding_flags;	/* Filename charset encoding flags */
 	__le32  s_orphan_file_inum;	/* Inode for tracking orphan inodes */
-	__le32	s_reserved[94];		/* Padding to the end of the block */
+	__le16	s_trim_mnt_count;	/* s_mnt_count while EXT4_BG_TRIMMED
+					   flags are kept up to date */
+	__le16	s_reserved_pad2;
+	__le32	s_reserved[93];		/* Padding to the end of the block */
 	__le32	s_checksum;		/* crc32c(superblock) */
 };
 
@@ -1536,6 +1572,8 @@ struct ext4_sb_info {
 	struct percpu_counter s_dirs_counter;
 	struct percpu_counter s_dirtyclusters_counter;
 	struct percpu_counter s_sra_exceeded_retry_limit;
+	struct percpu_counter s_dir_bloom_hits;	/* misses answered by filter */
+	struct percpu_counter s_dir_bloom_misses; /* filter false positives */
 	struct blockgroup_lock *s_blockgroup_lock;
 	struct proc_dir_entry *s_proc;
 	struct kobject s_kobj;
@@ -1583,7 +1621,17 @@ struct ext4_sb_info {
 	struct list_head s_freed_data_list[2];	/* List of blocks to be freed
 						   after commit completed */
 	struct list_head s_discard_list;
-	struct work_struct s_discard_work;
+	struct delayed_work s_discard_work;
+	atomic_t s_discard_queued;		/* extents waiting for discard */
+	atomic64_t s_discard_pending;		/* ... and their clusters */
+	unsigned int s_discard_max_kbps;	/* 0 = unlimited */
+	unsigned int s_discard_max_iops;	/* 0 = unlimited */
+	unsigned int s_discard_min_blocks;	/* shorter extents are skipped */
+	unsigned long s_discard_window;		/* start of the rate window */
+	u64 s_discard_window_bytes;		/* issued in the window */
+	unsigned int s_discard_window_ios;
+	struct work_struct s_mb_pregen_work;	/* buddy pre-generation */
+	bool s_mb_pregen_stop;
 	atomic_t s_retry_alloc_pending;
 	struct list_head *s_mb_avg_fragment_size;
 	rwlock_t *s_mb_avg_fragment_size_locks;
@@ -1600,11 +1648,17 @@ struct ext4_sb_info {
 	unsigned int s_mb_order2_reqs;
 	unsigned int s_mb_group_prealloc;
 	unsigned int s_max_dir_size_kb;
-	/* where last allocation was done - for stream allocation */
-	unsigned long s_mb_last_group;
-	unsigned long s_mb_last_start;
+	unsigned int s_dir_cache_max_kb;	/* largest dir given a readdir cache */
+	unsigned int s_dir_bloom_min_kb;	/* smallest dir given a filter */
+	unsigned int s_journal_revoke_hash;	/* revoke hash buckets, 0 = auto */
+	/* where last allocations were done - for stream allocation */
+	struct ext4_mb_stream_goal *s_mb_stream_goals;
+	unsigned int s_mb_nr_stream_goals;
 	unsigned int s_mb_prefetch;
 	unsigned int s_mb_prefetch_limit;
+	unsigned int s_mb_parallel_scan;	/* cold groups to init concurrently */
+	unsigned int s_mb_numa_groups;	/* bind group ranges to NUMA nodes */
+	unsigned int s_mb_pregen;	/* groups pre-generated concurrently */
 	unsigned int s_mb_best_avail_max_trim_order;
 
 	/* stats for buddy allocator */
@@ -1624,6 +1678,10 @@ struct ext4_sb_info {
 	atomic64_t s_bal_cX_groups_considered[EXT4_MB_NUM_CRS];
 	atomic64_t s_bal_cX_hits[EXT4_MB_NUM_CRS];
 	atomic64_t s_bal_cX_failed[EXT4_MB_NUM_CRS];		/* cX loop didn't find blocks */
+	atomic64_t s_bal_cX_time[EXT4_MB_NUM_CRS];	/* ns spent in cX loop */
+	atomic_t s_mb_parallel_inits;	/* groups initialized by parallel scan */
+	atomic_t s_mb_pregen_groups;	/* groups initialized by pre-generation */
+	atomic64_t s_mb_pregen_time;	/* ns taken by pre-generation */
 	atomic_t s_mb_buddies_generated;	/* number of buddies generated */
 	atomic64_t s_mb_generation_time;
 	atomic_t s_mb_lost_chunks;
@@ -1633,6 +1691,7 @@ struct ext4_sb_info {
 
 	/* locality groups */
 	struct ext4_locality_group __percpu *s_locality_groups;
+	struct ext4_mb_numa_stats *s_mb_numa_stats;	/* nr_node_ids entries */
 
 	/* for write statistics */
 	unsigned long s_sectors_written_start;
@@ -1647,6 +1706,10 @@ struct ext4_sb_info {
 
 	/* workqueue for reserved extent conversions (buffered io) */
 	struct workqueue_struct *rsv_conversion_wq;
+	unsigned int s_rsv_conv_max_active;	/* inodes converted at once */
+	atomic_t s_rsv_conv_pending;		/* io_ends waiting or running */
+	atomic64_t s_rsv_conv_done;
+	atomic64_t s_rsv_conv_wait_ns;		/* queueing to completion */
 
 	/* timer for periodic error stats printing */
 	struct timer_list s_err_report;
@@ -1655,12 +1718,18 @@ struct ext4_sb_info {
 	struct ext4_li_request *s_li_request;
 	/* Wait multiplier for lazy initialization thread */
 	unsigned int s_li_wait_mult;
+	unsigned int s_li_parallel;	/* inode tables zeroed at once */
+	unsigned int s_li_max_kbps;	/* zeroing budget, 0 = wait_mult */
+	unsigned int s_li_next_group;	/* lazy init progress */
+	atomic_t s_li_groups_zeroed;
 
 	/* Kernel thread for multiple mount protection */
 	struct task_struct *s_mmp_tsk;
 
 	/* record the last minlen when FITRIM is called. */
 	unsigned long s_last_trim_minblks;
+	unsigned int s_trim_parallel;		/* groups trimmed concurrently */
+	unsigned int s_trim_max_kbps;		/* FITRIM budget, 0 = unlimited */
 
 	/* Precomputed FS UUID checksum for seeding other checksums */
 	__u32 s_csum_seed;
@@ -1670,6 +1739,13 @@ struct ext4_sb_info {
 	struct list_head s_es_list;	/* List of inodes with reclaimable extents */
 	long s_es_nr_inode;
 	struct ext4_es_stats s_es_stats;
+
+	/* readdir caches, least recently used first */
+	struct list_head s_dir_cache_lru;
+	spinlock_t s_dir_cache_lock;
+	unsigned long s_dir_cache_pages;
+	struct shrinker *s_dir_cache_shrinker;
+
 	struct mb_cache *s_ea_block_cache;
 	struct mb_cache *s_ea_inode_cache;
 	spinlock_t s_es_lock ____cacheline_aligned_in_smp;
@@ -1751,12 +1827,34 @@ struct ext4_sb_info {
 	 */
 	spinlock_t s_fc_lock;
 	struct buffer_head *s_fc_bh;
+	/* Filled fast commit blocks not submitted yet, in log order */
+	struct buffer_head *s_fc_pending[EXT4_FC_MAX_BIO_BLOCKS];
+	int s_fc_nr_pending;
 	struct ext4_fc_stats s_fc_stats;
 	tid_t s_fc_ineligible_tid;
 #ifdef CONFIG_EXT4_DEBUG
 	int s_fc_debug_max_replay;
 #endif
 	struct ext4_fc_replay_state s_fc_replay_state;
+
+	/*
+	 * Active snapshot. s_snapshot_sem is held exclusively to activate
+	 * or deactivate it and shared by journal accesses checking whether
+	 * a block is preserved already. s_snapshot_mutex serializes
+	 * preserving blocks (copy-on-write and move-on-write) against each
+	 * other and against snapshot reads; s_snapshot_cow_owner is the task
+	 * holding it, so that journal accesses issued while mapping blocks
+	 * into the snapshot only stash the block's old contents in
+	 * s_snapshot_pending instead of recursing. s_snapshot_bitmaps caches
+	 * the block bitmaps as they were when the snapshot was taken,
+	 * indexed by group.
+	 */
+	struct inode *s_active_snapshot;
+	struct rw_semaphore s_snapshot_sem;
+	struct mutex s_snapshot_mutex;
+	struct task_struct *s_snapshot_cow_owner;
+	struct xarray s_snapshot_pending;
+	struct xarray s_snapshot_bitmaps;
 };
 
 static inline struct ext4_sb_info *EXT4_SB(struct super_block *sb)
@@ -1908,6 +2006,7 @@ enum {
 	EXT4_STATE_VERITY_IN_PROGRESS,	/* building fs-verity Merkle tree */
 	EXT4_STATE_FC_COMMITTING,	/* Fast commit ongoing */
 	EXT4_STATE_ORPHAN_FILE,		/* Inode orphaned in orphan file */
+	EXT4_STATE_DIR_SHRINK,		/* Directory tail awaits truncation */
 };
 
 #define EXT4_INODE_BIT_FNS(name, field, offset)				\
@@ -2010,6 +2109,7 @@ static inline bool ext4_verity_in_progress(struct inode *inode)
 #define EXT4_FEATURE_COMPAT_FAST_COMMIT		0x0400
 #define EXT4_FEATURE_COMPAT_STABLE_INODES	0x0800
 #define EXT4_FEATURE_COMPAT_ORPHAN_FILE		0x1000	/* Orphan file exists */
+#define EXT4_FEATURE_COMPAT_TRIMMED_BG		0x2000	/* EXT4_BG_TRIMMED used */
 
 #define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
 #define EXT4_FEATURE_RO_COMPAT_LARGE_FILE	0x0002
@@ -2018,6 +2118,7 @@ static inline bool ext4_verity_in_progress(struct inode *inode)
 #define EXT4_FEATURE_RO_COMPAT_GDT_CSUM		0x0010
 #define EXT4_FEATURE_RO_COMPAT_DIR_NLINK	0x0020
 #define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE	0x0040
+#define EXT4_FEATURE_RO_COMPAT_HAS_SNAPSHOT	0x0080
 #define EXT4_FEATURE_RO_COMPAT_QUOTA		0x0100
 #define EXT4_FEATURE_RO_COMPAT_BIGALLOC		0x0200
 /*
@@ -2116,6 +2217,7 @@ EXT4_FEATURE_COMPAT_FUNCS(sparse_super2,	SPARSE_SUPER2)
 EXT4_FEATURE_COMPAT_FUNCS(fast_commit,		FAST_COMMIT)
 EXT4_FEATURE_COMPAT_FUNCS(stable_inodes,	STABLE_INODES)
 EXT4_FEATURE_COMPAT_FUNCS(orphan_file,		ORPHAN_FILE)
+EXT4_FEATURE_COMPAT_FUNCS(trimmed_bg,		TRIMMED_BG)
 
 EXT4_FEATURE_RO_COMPAT_FUNCS(sparse_super,	SPARSE_SUPER)
 EXT4_FEATURE_RO_COMPAT_FUNCS(large_file,	LARGE_FILE)
@@ -2124,6 +2226,7 @@ EXT4_FEATURE_RO_COMPAT_FUNCS(huge_file,		HUGE_FILE)
 EXT4_FEATURE_RO_COMPAT_FUNCS(gdt_csum,		GDT_CSUM)
 EXT4_FEATURE_RO_COMPAT_FUNCS(dir_nlink,		DIR_NLINK)
 EXT4_FEATURE_RO_COMPAT_FUNCS(extra_isize,	EXTRA_ISIZE)
+EXT4_FEATURE_RO_COMPAT_FUNCS(has_snapshot,	HAS_SNAPSHOT)
 EXT4_FEATURE_RO_COMPAT_FUNCS(quota,		QUOTA)
 EXT4_FEATURE_RO_COMPAT_FUNCS(bigalloc,		BIGALLOC)
 EXT4_FEATURE_RO_COMPAT_FUNCS(metadata_csum,	METADATA_CSUM)
@@ -2165,7 +2268,8 @@ EXT4_FEATURE_INCOMPAT_FUNCS(casefold,		CASEFOLD)
 					 EXT4_FEATURE_RO_COMPAT_BTREE_DIR)
 
 #define EXT4_FEATURE_COMPAT_SUPP	(EXT4_FEATURE_COMPAT_EXT_ATTR| \
-					 EXT4_FEATURE_COMPAT_ORPHAN_FILE)
+					 EXT4_FEATURE_COMPAT_ORPHAN_FILE| \
+					 EXT4_FEATURE_COMPAT_TRIMMED_BG)
 #define EXT4_FEATURE_INCOMPAT_SUPP	(EXT4_FEATURE_INCOMPAT_FILETYPE| \
 					 EXT4_FEATURE_INCOMPAT_RECOVER| \
 					 EXT4_FEATURE_INCOMPAT_META_BG| \
@@ -2191,6 +2295,7 @@ EXT4_FEATURE_INCOMPAT_FUNCS(casefold,		CASEFOLD)
 					 EXT4_FEATURE_RO_COMPAT_QUOTA |\
 					 EXT4_FEATURE_RO_COMPAT_PROJECT |\
 					 EXT4_FEATURE_RO_COMPAT_VERITY |\
+					 EXT4_FEATURE_RO_COMPAT_HAS_SNAPSHOT |\
 					 EXT4_FEATURE_RO_COMPAT_ORPHAN_PRESENT)
 
 #define EXTN_FEATURE_FUNCS(ver) \
@@ -2227,6 +2332,15 @@ static inline bool ext4_has_incompat_features(struct super_block *sb)
 	return (EXT4_SB(sb)->s_es->s_feature_incompat != 0);
 }
 
+/* See ext4_trim_clear_stale() */
+static inline bool ext4_trimmed_bg_valid(struct super_block *sb)
+{
+	struct ext4_super_block *es = EXT4_SB(sb)->s_es;
+
+	return ext4_has_feature_trimmed_bg(sb) &&
+		es->s_trim_mnt_count == es->s_mnt_count;
+}
+
 extern int ext4_feature_set_ok(struct super_block *sb, int readonly);
 
 /*
@@ -2235,6 +2349,7 @@ extern int ext4_feature_set_ok(struct super_block *sb, int readonly);
 #define EXT4_FLAGS_RESIZING	0
 #define EXT4_FLAGS_SHUTDOWN	1
 #define EXT4_FLAGS_BDEV_IS_DAX	2
+#define EXT4_FLAGS_SNAPSHOT_UPDATE	3
 
 static inline int ext4_forced_shutdown(struct super_block *sb)
 {
@@ -2537,6 +2652,9 @@ struct dir_private_info {
 	__u32		next_hash;
 	u64		cookie;
 	bool		initialized;
+	struct ext4_dir_cache *dc;	/* shared cache being read */
+	struct ext4_dir_cache *dc_build; /* cache being filled */
+	unsigned int	dc_index;	/* next entry of dc */
 };
 
 /* calculate the first block number of the group */
@@ -2562,11 +2680,21 @@ static inline int ext4_dir_htree_level(struct super_block *sb)
 		EXT4_HTREE_LEVEL : EXT4_HTREE_LEVEL_COMPAT;
 }
 
+/*
+ * Largest htree directory, in kB, that gets a shared readdir cache.  Large
+ * enough for directories of ~10M entries; the shrinker bounds the total.
+ */
+#define EXT4_DEF_DIR_CACHE_MAX_KB	1048576
+
+/* Upper bound of the default number of concurrent extent conversions */
+#define EXT4_DEF_RSV_CONV_MAX_ACTIVE	16
+
 /*
  * Timeout and state flag for lazy initialization inode thread.
  */
 #define EXT4_DEF_LI_WAIT_MULT			10
 #define EXT4_DEF_LI_MAX_START_DELAY		5
+#define EXT4_DEF_LI_PARALLEL			4
 #define EXT4_LAZYINIT_QUIT			0x0001
 #define EXT4_LAZYINIT_RUNNING			0x0002
 
@@ -2592,6 +2720,9 @@ struct ext4_li_request {
 	struct list_head	lr_request;
 	unsigned long		lr_next_sched;
 	unsigned long		lr_timeout;
+	u64			lr_start_ns;	/* for s_li_max_kbps pacing */
+	u64			lr_zeroed_kb;
+	unsigned int		lr_kbps;
 };
 
 struct ext4_features {
@@ -2810,6 +2941,9 @@ extern int ext4_htree_store_dirent(struct file *dir_file, __u32 hash,
 				struct ext4_dir_entry_2 *dirent,
 				struct fscrypt_str *ent_name);
 extern void ext4_htree_free_dir_info(struct dir_private_info *p);
+extern void ext4_dir_cache_invalidate(struct inode *dir);
+extern int ext4_dir_cache_register_shrinker(struct ext4_sb_info *sbi);
+extern void ext4_dir_cache_unregister_shrinker(struct ext4_sb_info *sbi);
 extern int ext4_find_dest_de(struct inode *dir, struct inode *inode,
 			     struct buffer_head *bh,
 			     void *buf, int buf_size,
@@ -2919,6 +3053,8 @@ extern void ext4_exit_mballoc(void);
 extern ext4_group_t ext4_mb_prefetch(struct super_block *sb,
 				     ext4_group_t group,
 				     unsigned int nr, int *cnt);
+extern void ext4_mb_start_pregen(struct super_block *sb);
+extern void ext4_mb_stop_pregen(struct super_block *sb);
 extern void ext4_mb_prefetch_fini(struct super_block *sb, ext4_group_t group,
 				  unsigned int nr);
 
@@ -2932,6 +3068,7 @@ extern int ext4_mb_add_groupinfo(struct super_block *sb,
 extern int ext4_group_add_blocks(handle_t *handle, struct super_block *sb,
 				ext4_fsblk_t block, unsigned long count);
 extern int ext4_trim_fs(struct super_block *, struct fstrim_range *);
+extern void ext4_trim_clear_stale(struct super_block *sb);
 extern void ext4_process_freed_data(struct super_block *sb, tid_t commit_tid);
 extern void ext4_mb_mark_bb(struct super_block *sb, ext4_fsblk_t block,
 			    int len, bool state);
@@ -3042,6 +3179,7 @@ extern int ext4_ext_migrate(struct inode *);
 extern int ext4_ind_migrate(struct inode *inode);
 
 /* namei.c */
+extern void ext4_dir_bloom_release(struct inode *dir);
 extern int ext4_init_new_dir(handle_t *handle, struct inode *dir,
 			     struct inode *inode);
 extern int ext4_dirblock_csum_verify(struct inode *inode,
@@ -3698,6 +3836,14 @@ extern struct ext4_ext_path *ext4_find_extent(struct inode *, ext4_lblk_t,
 					      struct ext4_ext_path *,
 					      int flags);
 extern void ext4_free_ext_path(struct ext4_ext_path *);
+extern void ext4_ext_release_cursor(struct inode *inode);
+
+/* Called on any modification of the inode's extent tree */
+static inline void ext4_ext_tree_changed(struct inode *inode)
+{
+	WRITE_ONCE(EXT4_I(inode)->i_ext_generation,
+		   EXT4_I(inode)->i_ext_generation + 1);
+}
 extern int ext4_ext_check_inode(struct inode *inode);
 extern ext4_lblk_t ext4_ext_next_allocated_block(struct ext4_ext_path *path);
 extern int ext4_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
@@ -3755,6 +3901,38 @@ extern void ext4_stop_mmpd(struct ext4_sb_info *sbi);
 /* verity.c */
 extern const struct fsverity_operations ext4_verityops;
 
+/* snapshot.c */
+extern void ext4_snapshot_init(struct super_block *sb);
+extern int ext4_snapshot_load(struct super_block *sb);
+extern void ext4_snapshot_release(struct super_block *sb);
+extern int ext4_snapshot_take(struct file *filp);
+extern int ext4_snapshot_delete(struct file *filp);
+extern int ext4_snapshot_trans_blocks(struct super_block *sb, int blocks);
+extern int ext4_snapshot_get_write_access(handle_t *handle,
+					  struct super_block *sb,
+					  struct buffer_head *bh);
+extern int ext4_snapshot_move_on_write(handle_t *handle, struct inode *inode,
+				       struct ext4_map_blocks *map);
+extern int ext4_snapshot_new_blocks(struct inode *inode,
+				    struct ext4_map_blocks *map);
+extern bool ext4_snapshot_in_use(struct super_block *sb, ext4_fsblk_t block);
+extern bool ext4_snapshot_free_blocks(handle_t *handle, struct inode *inode,
+				      struct buffer_head *bh,
+				      ext4_fsblk_t block, unsigned long count,
+				      int flags);
+extern ssize_t ext4_snapshot_read_iter(struct kiocb *iocb,
+				       struct iov_iter *to);
+
+static inline bool ext4_snapshot_active(struct super_block *sb)
+{
+	return READ_ONCE(EXT4_SB(sb)->s_active_snapshot) != NULL;
+}
+
+static inline bool ext4_snapshot_file(struct inode *inode)
+{
+	return ext4_test_inode_flag(inode, EXT4_INODE_SNAPFILE);
+}
+
 /* orphan.c */
 extern int ext4_orphan_add(handle_t *, struct inode *);
 extern int ext4_orphan_del(handle_t *, struct inode *);
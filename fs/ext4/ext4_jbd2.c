@@ -109,6 +109,8 @@ handle_t *__ext4_journal_start_sb(struct inode *inode,
 	journal = EXT4_SB(sb)->s_journal;
 	if (!journal || (EXT4_SB(sb)->s_mount_state & EXT4_FC_REPLAY))
 		return ext4_get_nojournal();
+	if (ext4_snapshot_active(sb))
+		blocks = ext4_snapshot_trans_blocks(sb, blocks);
 	return jbd2__journal_start(journal, blocks, rsv_blocks, revoke_creds,
 				   GFP_NOFS, type, line);
 }
@@ -236,6 +238,11 @@ int __ext4_journal_get_write_access(const char *where, unsigned int line,
 	might_sleep();
 
 	if (ext4_handle_valid(handle)) {
+		if (ext4_snapshot_active(sb)) {
+			err = ext4_snapshot_get_write_access(handle, sb, bh);
+			if (err)
+				return err;
+		}
 		err = jbd2_journal_get_write_access(handle, bh);
 		if (err) {
 			ext4_journal_abort_handle(where, line, __func__, bh,
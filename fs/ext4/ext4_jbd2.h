@@ -83,6 +83,12 @@
  */
 #define EXT4_INDEX_EXTRA_TRANS_BLOCKS	12U
 
+/*
+ * Preserving one block in the active snapshot allocates a block for it,
+ * which may grow the snapshot's extent tree, and writes out the copy.
+ */
+#define EXT4_SNAPSHOT_COW_TRANS_BLOCKS(sb)	(EXT4_SINGLEDATA_TRANS_BLOCKS(sb) + 1)
+
 #ifdef CONFIG_QUOTA
 /* Amount of blocks needed for quota update - we know that the structure was
  * allocated so we need to update only data block */
@@ -410,6 +416,13 @@ static inline int ext4_journal_blocks_per_page(struct inode *inode)
 	return 0;
 }
 
+/* Blocks in the largest folio the page cache may use for @inode */
+static inline int ext4_journal_blocks_per_folio(struct inode *inode)
+{
+	return ext4_journal_blocks_per_page(inode) <<
+		mapping_max_folio_order(inode->i_mapping);
+}
+
 static inline int ext4_journal_force_commit(journal_t *journal)
 {
 	if (journal)
@@ -475,6 +488,19 @@ static inline int ext4_should_writeback_data(struct inode *inode)
 	return ext4_inode_journal_mode(inode) & EXT4_INODE_WRITEBACK_DATA_MODE;
 }
 
+/*
+ * Data of journalled inodes is copied to the active snapshot on
+ * get_write_access, like metadata. Other regular file data is written in
+ * place, so blocks which belong to the snapshot must be moved to it before
+ * they are overwritten.
+ */
+static inline bool ext4_snapshot_should_move_data(struct inode *inode)
+{
+	return ext4_snapshot_active(inode->i_sb) &&
+		S_ISREG(inode->i_mode) && !ext4_snapshot_file(inode) &&
+		!ext4_should_journal_data(inode);
+}
+
 static inline int ext4_free_data_revoke_credits(struct inode *inode, int blocks)
 {
 	if (test_opt(inode->i_sb, DATA_FLAGS) == EXT4_MOUNT_JOURNAL_DATA)
@@ -162,6 +162,7 @@ static int ext4_ext_get_access(handle_t *handle, struct inode *inode,
 {
 	int err = 0;
 
+	ext4_ext_tree_changed(inode);
 	if (path->p_bh) {
 		/* path points to block */
 		BUFFER_TRACE(path->p_bh, "get_write_access");
@@ -194,6 +195,7 @@ static int __ext4_ext_dirty(const char *where, unsigned int line,
 	int err;
 
 	WARN_ON(!rwsem_is_locked(&EXT4_I(inode)->i_data_sem));
+	ext4_ext_tree_changed(inode);
 	if (path->p_bh) {
 		ext4_extent_block_csum_set(inode, ext_block_hdr(path->p_bh));
 		/* path points to block */
@@ -879,6 +881,7 @@ void ext4_ext_tree_init(handle_t *handle, struct inode *inode)
 	eh->eh_magic = EXT4_EXT_MAGIC;
 	eh->eh_max = cpu_to_le16(ext4_ext_space_root(inode, 0));
 	eh->eh_generation = 0;
+	ext4_ext_tree_changed(inode);
 	ext4_mark_inode_dirty(handle, inode);
 }
 
@@ -966,6 +969,106 @@ ext4_find_extent(struct inode *inode, ext4_lblk_t block,
 	return ERR_PTR(ret);
 }
 
+/*
+ * Per-inode extent path cursor.
+ *
+ * ext4_ext_map_blocks() keeps the path of its last lookup in the inode,
+ * together with the extent tree generation it was valid for.  Any change
+ * to the tree bumps the generation, see ext4_ext_tree_changed().  If the
+ * tree hasn't changed and the next lookup falls under the same leaf, which
+ * is the common case for sequential access, we only need to search the leaf
+ * again; the index blocks are neither looked up nor read, and no new path
+ * is allocated.  Callers hold i_data_sem, which orders lookups against tree
+ * modifications; the cursor itself is taken and returned under
+ * i_ext_cursor_lock so that concurrent lookups each get their own path.
+ */
+
+/* Does @path lead to the leaf where a lookup of @block would end up? */
+static bool ext4_ext_path_covers(struct inode *inode,
+				 struct ext4_ext_path *path, ext4_lblk_t block)
+{
+	int depth = ext_depth(inode);
+	struct ext4_extent_idx *ix;
+	int i;
+
+	if (path[0].p_depth != depth || path[0].p_hdr != ext_inode_hdr(inode))
+		return false;
+
+	/* ext4_ext_binsearch_idx() picks the last index not after @block */
+	for (i = 0; i < depth; i++) {
+		ix = path[i].p_idx;
+		if (ix != EXT_FIRST_INDEX(path[i].p_hdr) &&
+		    block < le32_to_cpu(ix->ei_block))
+			return false;
+		if (ix != EXT_LAST_INDEX(path[i].p_hdr) &&
+		    block >= le32_to_cpu(ix[1].ei_block))
+			return false;
+	}
+	return true;
+}
+
+static struct ext4_ext_path *
+ext4_ext_cursor_find(struct inode *inode, ext4_lblk_t block, int flags)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_ext_path *path;
+	unsigned int gen;
+	int depth;
+
+	spin_lock(&ei->i_ext_cursor_lock);
+	path = ei->i_ext_cursor;
+	gen = ei->i_ext_cursor_gen;
+	ei->i_ext_cursor = NULL;
+	spin_unlock(&ei->i_ext_cursor_lock);
+
+	if (!path)
+		return ext4_find_extent(inode, block, NULL, flags);
+	if (gen != READ_ONCE(ei->i_ext_generation) ||
+	    !ext4_ext_path_covers(inode, path, block))
+		return ext4_find_extent(inode, block, path, flags);
+
+	depth = ext_depth(inode);
+	path[depth].p_ext = NULL;
+	ext4_ext_binsearch(inode, path + depth, block);
+	if (path[depth].p_ext)
+		path[depth].p_block = ext4_ext_pblock(path[depth].p_ext);
+	ext4_ext_show_path(inode, path);
+	return path;
+}
+
+/*
+ * Return @path from a lookup started at extent tree generation @gen to the
+ * cursor, or free it if the tree has changed since.
+ */
+static void ext4_ext_cursor_put(struct inode *inode,
+				struct ext4_ext_path *path, unsigned int gen)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+
+	if (IS_ERR_OR_NULL(path))
+		return;
+	if (gen == READ_ONCE(ei->i_ext_generation)) {
+		spin_lock(&ei->i_ext_cursor_lock);
+		swap(ei->i_ext_cursor, path);
+		ei->i_ext_cursor_gen = gen;
+		spin_unlock(&ei->i_ext_cursor_lock);
+	}
+	ext4_free_ext_path(path);
+}
+
+/* Drop the cursor and the references it holds to extent tree blocks */
+void ext4_ext_release_cursor(struct inode *inode)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_ext_path *path;
+
+	spin_lock(&ei->i_ext_cursor_lock);
+	path = ei->i_ext_cursor;
+	ei->i_ext_cursor = NULL;
+	spin_unlock(&ei->i_ext_cursor_lock);
+	ext4_free_ext_path(path);
+}
+
 /*
  * ext4_ext_insert_index:
  * insert new index [@logical;@ptr] into the block at @curp;
@@ -1368,6 +1471,7 @@ static int ext4_ext_grow_indepth(handle_t *handle, struct inode *inode,
 		goto out;
 
 	/* Update top-level index: num,max,pointer */
+	ext4_ext_tree_changed(inode);
 	neh = ext_inode_hdr(inode);
 	neh->eh_entries = cpu_to_le16(1);
 	ext4_idx_store_pblock(EXT_FIRST_INDEX(neh), newblock);
@@ -4197,12 +4301,13 @@ int ext4_ext_map_blocks(handle_t *handle, struct inode *inode,
 	unsigned int allocated_clusters = 0;
 	struct ext4_allocation_request ar;
 	ext4_lblk_t cluster_offset;
+	unsigned int gen = READ_ONCE(EXT4_I(inode)->i_ext_generation);
 
 	ext_debug(inode, "blocks %u/%u requested\n", map->m_lblk, map->m_len);
 	trace_ext4_ext_map_blocks_enter(inode, map->m_lblk, map->m_len, flags);
 
 	/* find extent for this block */
-	path = ext4_find_extent(inode, map->m_lblk, NULL, 0);
+	path = ext4_ext_cursor_find(inode, map->m_lblk, 0);
 	if (IS_ERR(path)) {
 		err = PTR_ERR(path);
 		goto out;
@@ -4433,7 +4538,7 @@ int ext4_ext_map_blocks(handle_t *handle, struct inode *inode,
 	allocated = map->m_len;
 	ext4_ext_show_leaf(inode, path);
 out:
-	ext4_free_ext_path(path);
+	ext4_ext_cursor_put(inode, path, gen);
 
 	trace_ext4_ext_map_blocks_exit(inode, flags, map,
 				       err ? err : allocated);
@@ -4762,6 +4867,17 @@ long ext4_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
 		     FALLOC_FL_INSERT_RANGE))
 		return -EOPNOTSUPP;
 
+	if (ext4_snapshot_file(inode))
+		return -EPERM;
+
+	/*
+	 * Zeroed blocks are converted to unwritten and later written in
+	 * place, which would overwrite blocks the snapshot still needs.
+	 */
+	if ((mode & FALLOC_FL_ZERO_RANGE) &&
+	    ext4_snapshot_should_move_data(inode))
+		return -EOPNOTSUPP;
+
 	inode_lock(inode);
 	ret = ext4_convert_inline_data(inode);
 	inode_unlock(inode);
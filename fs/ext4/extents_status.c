@@ -113,7 +113,11 @@
  *	next extent, adding a extent(a range of blocks) and removing a extent.
  *
  *   --	race on a extent status tree
- *	Extent status tree is protected by inode->i_es_lock.
+ *	Extent status tree is protected by inode->i_es_lock.  Modifications
+ *	of the tree are also bracketed by inode->i_es_seq, which lets
+ *	ext4_es_lookup_extent() walk the tree under RCU without taking the
+ *	lock, and retry with it if the tree changed under it.  Extents are
+ *	allocated from a SLAB_TYPESAFE_BY_RCU cache for the same reason.
  *
  *   --	memory consumption
  *      Fragmented extent tree will make extent status tree cost too much
@@ -144,6 +148,19 @@
 static struct kmem_cache *ext4_es_cachep;
 static struct kmem_cache *ext4_pending_cachep;
 
+/* Take i_es_lock for modifying the extent status tree */
+static inline void es_write_lock(struct ext4_inode_info *ei)
+{
+	write_lock(&ei->i_es_lock);
+	write_seqcount_begin(&ei->i_es_seq);
+}
+
+static inline void es_write_unlock(struct ext4_inode_info *ei)
+{
+	write_seqcount_end(&ei->i_es_seq);
+	write_unlock(&ei->i_es_lock);
+}
+
 static int __es_insert_extent(struct inode *inode, struct extent_status *newes,
 			      struct extent_status *prealloc);
 static int __es_remove_extent(struct inode *inode, ext4_lblk_t lblk,
@@ -158,7 +175,8 @@ static int __revise_pending(struct inode *inode, ext4_lblk_t lblk,
 
 int __init ext4_init_es(void)
 {
-	ext4_es_cachep = KMEM_CACHE(extent_status, SLAB_RECLAIM_ACCOUNT);
+	ext4_es_cachep = KMEM_CACHE(extent_status,
+				    SLAB_RECLAIM_ACCOUNT | SLAB_TYPESAFE_BY_RCU);
 	if (ext4_es_cachep == NULL)
 		return -ENOMEM;
 	return 0;
@@ -834,7 +852,7 @@ static int __es_insert_extent(struct inode *inode, struct extent_status *newes,
 	ext4_es_init_extent(inode, es, newes->es_lblk, newes->es_len,
 			    newes->es_pblk);
 
-	rb_link_node(&es->rb_node, parent, p);
+	rb_link_node_rcu(&es->rb_node, parent, p);
 	rb_insert_color(&es->rb_node, &tree->root);
 
 out:
@@ -890,7 +908,7 @@ void ext4_es_insert_extent(struct inode *inode, ext4_lblk_t lblk,
 		es2 = __es_alloc_extent(true);
 	if ((err1 || err2 || err3 < 0) && revise_pending && !pr)
 		pr = __alloc_pending(true);
-	write_lock(&EXT4_I(inode)->i_es_lock);
+	es_write_lock(EXT4_I(inode));
 
 	err1 = __es_remove_extent(inode, lblk, end, &resv_used, es1);
 	if (err1 != 0)
@@ -925,7 +943,7 @@ void ext4_es_insert_extent(struct inode *inode, ext4_lblk_t lblk,
 		pending = err3;
 	}
 error:
-	write_unlock(&EXT4_I(inode)->i_es_lock);
+	es_write_unlock(EXT4_I(inode));
 	/*
 	 * Reduce the reserved cluster count to reflect successful deferred
 	 * allocation of delayed allocated clusters or direct allocation of
@@ -980,12 +998,92 @@ void ext4_es_cache_extent(struct inode *inode, ext4_lblk_t lblk,
 
 	BUG_ON(end < lblk);
 
-	write_lock(&EXT4_I(inode)->i_es_lock);
+	es_write_lock(EXT4_I(inode));
 
 	es = __es_tree_search(&EXT4_I(inode)->i_es_tree.root, lblk);
 	if (!es || es->es_lblk > end)
 		__es_insert_extent(inode, &newes, NULL);
-	write_unlock(&EXT4_I(inode)->i_es_lock);
+	es_write_unlock(EXT4_I(inode));
+}
+
+/*
+ * A valid extent status tree is never deeper than this.  Bounds the walk of
+ * a lockless lookup that strayed onto extents which were freed and reused.
+ */
+#define ES_LOCKLESS_MAX_DEPTH	64
+
+/*
+ * Lockless lookup of the extent containing @lblk, see ext4_es_lookup_extent().
+ * Returns -EAGAIN if the tree changed under us, or if the lookup would need
+ * to mark the extent referenced, in which case the caller takes i_es_lock.
+ * Cached lookups thus don't write to memory shared with other CPUs.
+ */
+static int ext4_es_lookup_extent_rcu(struct inode *inode, ext4_lblk_t lblk,
+				     ext4_lblk_t *next_lblk,
+				     struct extent_status *es)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct extent_status *es1 = NULL;
+	struct rb_node *node;
+	ext4_lblk_t es_lblk, es_len, next = 0;
+	unsigned int seq;
+	int depth = 0, ret = -EAGAIN;
+
+	rcu_read_lock();
+	seq = read_seqcount_begin(&ei->i_es_seq);
+
+	if (!next_lblk) {
+		es1 = READ_ONCE(ei->i_es_tree.cache_es);
+		if (es1 && !in_range(lblk, READ_ONCE(es1->es_lblk),
+				     READ_ONCE(es1->es_len)))
+			es1 = NULL;
+	}
+
+	node = READ_ONCE(ei->i_es_tree.root.rb_node);
+	while (!es1 && node) {
+		if (++depth > ES_LOCKLESS_MAX_DEPTH)
+			goto out;
+		es1 = rb_entry(node, struct extent_status, rb_node);
+		es_lblk = READ_ONCE(es1->es_lblk);
+		es_len = READ_ONCE(es1->es_len);
+		if (lblk < es_lblk) {
+			/* Successor of @lblk unless we find a closer one */
+			next = es_lblk;
+			node = READ_ONCE(node->rb_left);
+			es1 = NULL;
+		} else if (lblk > es_lblk + es_len - 1) {
+			node = READ_ONCE(node->rb_right);
+			es1 = NULL;
+		}
+	}
+
+	es->es_lblk = es->es_len = es->es_pblk = 0;
+	if (es1) {
+		es->es_lblk = READ_ONCE(es1->es_lblk);
+		es->es_len = READ_ONCE(es1->es_len);
+		es->es_pblk = READ_ONCE(es1->es_pblk);
+		if (!ext4_es_is_referenced(es))
+			goto out;
+		if (next_lblk) {
+			node = READ_ONCE(es1->rb_node.rb_right);
+			while (node) {
+				if (++depth > ES_LOCKLESS_MAX_DEPTH)
+					goto out;
+				next = READ_ONCE(rb_entry(node,
+					struct extent_status, rb_node)->es_lblk);
+				node = READ_ONCE(node->rb_left);
+			}
+		}
+	}
+
+	if (read_seqcount_retry(&ei->i_es_seq, seq))
+		goto out;
+	ret = es1 != NULL;
+	if (ret && next_lblk)
+		*next_lblk = next;
+out:
+	rcu_read_unlock();
+	return ret;
 }
 
 /*
@@ -1011,6 +1109,18 @@ int ext4_es_lookup_extent(struct inode *inode, ext4_lblk_t lblk,
 	trace_ext4_es_lookup_extent_enter(inode, lblk);
 	es_debug("lookup extent in block %u\n", lblk);
 
+	stats = &EXT4_SB(inode->i_sb)->s_es_stats;
+	found = ext4_es_lookup_extent_rcu(inode, lblk, next_lblk, es);
+	if (found >= 0) {
+		if (found)
+			percpu_counter_inc(&stats->es_stats_cache_hits);
+		else
+			percpu_counter_inc(&stats->es_stats_cache_misses);
+		trace_ext4_es_lookup_extent_exit(inode, es, found);
+		return found;
+	}
+	found = 0;
+
 	tree = &EXT4_I(inode)->i_es_tree;
 	read_lock(&EXT4_I(inode)->i_es_lock);
 
@@ -1038,7 +1148,6 @@ int ext4_es_lookup_extent(struct inode *inode, ext4_lblk_t lblk,
 	}
 
 out:
-	stats = &EXT4_SB(inode->i_sb)->s_es_stats;
 	if (found) {
 		BUG_ON(!es1);
 		es->es_lblk = es1->es_lblk;
@@ -1537,7 +1646,7 @@ void ext4_es_remove_extent(struct inode *inode, ext4_lblk_t lblk,
 	 * so that we are sure __es_shrink() is done with the inode before it
 	 * is reclaimed.
 	 */
-	write_lock(&EXT4_I(inode)->i_es_lock);
+	es_write_lock(EXT4_I(inode));
 	err = __es_remove_extent(inode, lblk, end, &reserved, es);
 	/* Free preallocated extent if it didn't get used. */
 	if (es) {
@@ -1545,7 +1654,7 @@ void ext4_es_remove_extent(struct inode *inode, ext4_lblk_t lblk,
 			__es_free_extent(es);
 		es = NULL;
 	}
-	write_unlock(&EXT4_I(inode)->i_es_lock);
+	es_write_unlock(EXT4_I(inode));
 	if (err)
 		goto retry;
 
@@ -1595,6 +1704,7 @@ static int __es_shrink(struct ext4_sb_info *sbi, int nr_to_scan,
 			nr_skipped++;
 			continue;
 		}
+		write_seqcount_begin(&ei->i_es_seq);
 		/*
 		 * Now we hold i_es_lock which protects us from inode reclaim
 		 * freeing inode under us
@@ -1602,7 +1712,9 @@ static int __es_shrink(struct ext4_sb_info *sbi, int nr_to_scan,
 		spin_unlock(&sbi->s_es_lock);
 
 		nr_shrunk += es_reclaim_extents(ei, &nr_to_scan);
-		write_unlock(&ei->i_es_lock);
+		/* Also unpin the extent blocks held by the lookup cursor */
+		ext4_ext_release_cursor(&ei->vfs_inode);
+		es_write_unlock(ei);
 
 		if (nr_to_scan <= 0)
 			goto out;
@@ -1860,7 +1972,7 @@ void ext4_clear_inode_es(struct inode *inode)
 	struct ext4_es_tree *tree;
 	struct rb_node *node;
 
-	write_lock(&ei->i_es_lock);
+	es_write_lock(ei);
 	tree = &EXT4_I(inode)->i_es_tree;
 	tree->cache_es = NULL;
 	node = rb_first(&tree->root);
@@ -1873,7 +1985,8 @@ void ext4_clear_inode_es(struct inode *inode)
 		}
 	}
 	ext4_clear_inode_state(inode, EXT4_STATE_EXT_PRECACHED);
-	write_unlock(&ei->i_es_lock);
+	es_write_unlock(ei);
+	ext4_ext_release_cursor(inode);
 }
 
 #ifdef ES_DEBUG__
@@ -2126,7 +2239,7 @@ void ext4_es_insert_delayed_extent(struct inode *inode, ext4_lblk_t lblk,
 		if (end_allocated && !pr2)
 			pr2 = __alloc_pending(true);
 	}
-	write_lock(&EXT4_I(inode)->i_es_lock);
+	es_write_lock(EXT4_I(inode));
 
 	err1 = __es_remove_extent(inode, lblk, end, NULL, es1);
 	if (err1 != 0)
@@ -2167,7 +2280,7 @@ void ext4_es_insert_delayed_extent(struct inode *inode, ext4_lblk_t lblk,
 		}
 	}
 error:
-	write_unlock(&EXT4_I(inode)->i_es_lock);
+	es_write_unlock(EXT4_I(inode));
 	if (err1 || err2 || err3 < 0)
 		goto retry;
 
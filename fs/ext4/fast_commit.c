@@ -654,20 +654,102 @@ void ext4_fc_track_range(handle_t *handle, struct inode *inode, ext4_lblk_t star
 	trace_ext4_fc_track_range(handle, inode, start, end, ret);
 }
 
+/* A multi-block fast commit write and the buffers it covers */
+struct ext4_fc_bio {
+	int nr;
+	struct buffer_head *bhs[EXT4_FC_MAX_BIO_BLOCKS];
+};
+
+static void ext4_fc_end_bio(struct bio *bio)
+{
+	struct ext4_fc_bio *fcb = bio->bi_private;
+	int i;
+
+	for (i = 0; i < fcb->nr; i++)
+		ext4_end_buffer_io_sync(fcb->bhs[i], !bio->bi_status);
+	kfree(fcb);
+	bio_put(bio);
+}
+
+/*
+ * Write out the filled fast commit blocks queued by ext4_fc_submit_bh().
+ * They are physically contiguous, so they go out as a single bio.  If we
+ * can't allocate the completion context, fall back to one bio per block;
+ * in either case write_flags only apply to the last block.
+ */
+static void ext4_fc_submit_pending(struct super_block *sb,
+				   blk_opf_t write_flags)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	int i, nr = sbi->s_fc_nr_pending;
+	struct buffer_head *bh;
+	struct ext4_fc_bio *fcb = NULL;
+	struct bio *bio;
+
+	if (!nr)
+		return;
+	sbi->s_fc_nr_pending = 0;
+
+	if (nr > 1)
+		fcb = kmalloc(sizeof(*fcb), GFP_NOFS);
+	if (!fcb) {
+		for (i = 0; i < nr; i++) {
+			bh = sbi->s_fc_pending[i];
+			bh->b_end_io = ext4_end_buffer_io_sync;
+			submit_bh(REQ_OP_WRITE | REQ_SYNC |
+				  (i == nr - 1 ? write_flags : 0), bh);
+		}
+		return;
+	}
+
+	bh = sbi->s_fc_pending[0];
+	bio = bio_alloc(bh->b_bdev, nr, REQ_OP_WRITE | REQ_SYNC | write_flags,
+			GFP_NOFS);
+	bio->bi_iter.bi_sector = bh->b_blocknr * (bh->b_size >> 9);
+	fcb->nr = nr;
+	for (i = 0; i < nr; i++) {
+		bh = sbi->s_fc_pending[i];
+		fcb->bhs[i] = bh;
+		bio_add_folio_nofail(bio, bh->b_folio, bh->b_size,
+				     bh_offset(bh));
+	}
+	bio->bi_end_io = ext4_fc_end_bio;
+	bio->bi_private = fcb;
+	submit_bio(bio);
+}
+
+/*
+ * Queue the current fast commit block for writing.  Blocks are collected
+ * until EXT4_FC_MAX_BIO_BLOCKS of them are pending, the log becomes
+ * physically discontiguous, or the tail is written, so that we keep
+ * generating tags for the next blocks while the previous batch is in
+ * flight.  jbd2_fc_wait_bufs() still waits on the individual buffers.
+ */
 static void ext4_fc_submit_bh(struct super_block *sb, bool is_tail)
 {
-	blk_opf_t write_flags = REQ_SYNC;
-	struct buffer_head *bh = EXT4_SB(sb)->s_fc_bh;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct buffer_head *bh = sbi->s_fc_bh;
+	struct buffer_head *prev;
+
+	if (sbi->s_fc_nr_pending) {
+		prev = sbi->s_fc_pending[sbi->s_fc_nr_pending - 1];
+		if (prev->b_blocknr + 1 != bh->b_blocknr ||
+		    prev->b_bdev != bh->b_bdev)
+			ext4_fc_submit_pending(sb, 0);
+	}
 
-	/* Add REQ_FUA | REQ_PREFLUSH only its tail */
-	if (test_opt(sb, BARRIER) && is_tail)
-		write_flags |= REQ_FUA | REQ_PREFLUSH;
 	lock_buffer(bh);
 	set_buffer_dirty(bh);
 	set_buffer_uptodate(bh);
-	bh->b_end_io = ext4_end_buffer_io_sync;
-	submit_bh(REQ_OP_WRITE | write_flags, bh);
-	EXT4_SB(sb)->s_fc_bh = NULL;
+	sbi->s_fc_pending[sbi->s_fc_nr_pending++] = bh;
+	sbi->s_fc_bh = NULL;
+
+	/* Add REQ_FUA | REQ_PREFLUSH only to the bio carrying the tail */
+	if (is_tail)
+		ext4_fc_submit_pending(sb, test_opt(sb, BARRIER) ?
+				       REQ_FUA | REQ_PREFLUSH : 0);
+	else if (sbi->s_fc_nr_pending == EXT4_FC_MAX_BIO_BLOCKS)
+		ext4_fc_submit_pending(sb, 0);
 }
 
 /* Ext4 commit path routines */
@@ -1085,7 +1167,6 @@ static int ext4_fc_perform_commit(journal_t *journal)
 	struct ext4_inode_info *iter;
 	struct ext4_fc_head head;
 	struct inode *inode;
-	struct blk_plug plug;
 	int ret = 0;
 	u32 crc = 0;
 
@@ -1104,7 +1185,6 @@ static int ext4_fc_perform_commit(journal_t *journal)
 	if (journal->j_fs_dev != journal->j_dev)
 		blkdev_issue_flush(journal->j_fs_dev);
 
-	blk_start_plug(&plug);
 	if (sbi->s_fc_bytes == 0) {
 		/*
 		 * Add a head tag only if this is the first fast commit
@@ -1146,12 +1226,22 @@ static int ext4_fc_perform_commit(journal_t *journal)
 	ret = ext4_fc_write_tail(sb, crc);
 
 out:
-	blk_finish_plug(&plug);
+	/* Never leave queued buffers locked behind on failure */
+	ext4_fc_submit_pending(sb, 0);
 	return ret;
 }
 
+static void ext4_fc_account_latency(unsigned long *hist, u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+	int bucket = us ? ilog2(us) + 1 : 0;
+
+	hist[min(bucket, EXT4_FC_LAT_BUCKETS - 1)]++;
+}
+
 static void ext4_fc_update_stats(struct super_block *sb, int status,
-				 u64 commit_time, int nblks, tid_t commit_tid)
+				 u64 commit_time, u64 wait_time, int nblks,
+				 tid_t commit_tid)
 {
 	struct ext4_fc_stats *stats = &EXT4_SB(sb)->s_fc_stats;
 
@@ -1160,6 +1250,8 @@ static void ext4_fc_update_stats(struct super_block *sb, int status,
 	if (status == EXT4_FC_STATUS_OK) {
 		stats->fc_num_commits++;
 		stats->fc_numblks += nblks;
+		ext4_fc_account_latency(stats->fc_commit_lat_hist, commit_time);
+		ext4_fc_account_latency(stats->fc_wait_lat_hist, wait_time);
 		if (likely(stats->s_fc_avg_commit_time))
 			stats->s_fc_avg_commit_time =
 				(commit_time +
@@ -1190,7 +1282,7 @@ int ext4_fc_commit(journal_t *journal, tid_t commit_tid)
 	int nblks = 0, ret, bsize = journal->j_blocksize;
 	int subtid = atomic_read(&sbi->s_fc_subtid);
 	int status = EXT4_FC_STATUS_OK, fc_bufs_before = 0;
-	ktime_t start_time, commit_time;
+	ktime_t start_time, wait_start, commit_time, wait_time;
 
 	if (!test_opt2(sb, JOURNAL_FAST_COMMIT))
 		return jbd2_complete_transaction(journal, commit_tid);
@@ -1206,7 +1298,7 @@ int ext4_fc_commit(journal_t *journal, tid_t commit_tid)
 		if (atomic_read(&sbi->s_fc_subtid) <= subtid &&
 		    tid_gt(commit_tid, journal->j_commit_sequence))
 			goto restart_fc;
-		ext4_fc_update_stats(sb, EXT4_FC_STATUS_SKIPPED, 0, 0,
+		ext4_fc_update_stats(sb, EXT4_FC_STATUS_SKIPPED, 0, 0, 0,
 				commit_tid);
 		return 0;
 	} else if (ret) {
@@ -1214,7 +1306,7 @@ int ext4_fc_commit(journal_t *journal, tid_t commit_tid)
 		 * Commit couldn't start. Just update stats and perform a
 		 * full commit.
 		 */
-		ext4_fc_update_stats(sb, EXT4_FC_STATUS_FAILED, 0, 0,
+		ext4_fc_update_stats(sb, EXT4_FC_STATUS_FAILED, 0, 0, 0,
 				commit_tid);
 		return jbd2_complete_transaction(journal, commit_tid);
 	}
@@ -1235,11 +1327,13 @@ int ext4_fc_commit(journal_t *journal, tid_t commit_tid)
 		goto fallback;
 	}
 	nblks = (sbi->s_fc_bytes + bsize - 1) / bsize - fc_bufs_before;
+	wait_start = ktime_get();
 	ret = jbd2_fc_wait_bufs(journal, nblks);
 	if (ret < 0) {
 		status = EXT4_FC_STATUS_FAILED;
 		goto fallback;
 	}
+	wait_time = ktime_to_ns(ktime_sub(ktime_get(), wait_start));
 	atomic_inc(&sbi->s_fc_subtid);
 	ret = jbd2_fc_end_commit(journal);
 	/*
@@ -1247,12 +1341,13 @@ int ext4_fc_commit(journal_t *journal, tid_t commit_tid)
 	 * don't react too strongly to vast changes in the commit time
 	 */
 	commit_time = ktime_to_ns(ktime_sub(ktime_get(), start_time));
-	ext4_fc_update_stats(sb, status, commit_time, nblks, commit_tid);
+	ext4_fc_update_stats(sb, status, commit_time, wait_time, nblks,
+			     commit_tid);
 	return ret;
 
 fallback:
 	ret = jbd2_fc_end_commit_fallback(journal);
-	ext4_fc_update_stats(sb, status, 0, 0, commit_tid);
+	ext4_fc_update_stats(sb, status, 0, 0, 0, commit_tid);
 	return ret;
 }
 
@@ -2274,8 +2369,20 @@ static const char * const fc_ineligible_reasons[] = {
 	[EXT4_FC_REASON_FALLOC_RANGE] = "Falloc range op",
 	[EXT4_FC_REASON_INODE_JOURNAL_DATA] = "Data journalling",
 	[EXT4_FC_REASON_ENCRYPTED_FILENAME] = "Encrypted filename",
+	[EXT4_FC_REASON_DIR_SHRINK] = "Directory shrunk",
 };
 
+static void ext4_fc_show_latency(struct seq_file *seq, const char *name,
+				 unsigned long *hist)
+{
+	int i;
+
+	seq_printf(seq, "%s:\n", name);
+	for (i = 0; i < EXT4_FC_LAT_BUCKETS - 1; i++)
+		seq_printf(seq, "<%luus:\t%lu\n", 1UL << i, hist[i]);
+	seq_printf(seq, ">=%luus:\t%lu\n", 1UL << (i - 1), hist[i]);
+}
+
 int ext4_fc_info_show(struct seq_file *seq, void *v)
 {
 	struct ext4_sb_info *sbi = EXT4_SB((struct super_block *)seq->private);
@@ -2294,6 +2401,9 @@ int ext4_fc_info_show(struct seq_file *seq, void *v)
 	for (i = 0; i < EXT4_FC_REASON_MAX; i++)
 		seq_printf(seq, "\"%s\":\t%d\n", fc_ineligible_reasons[i],
 			stats->fc_ineligible_reason_count[i]);
+	ext4_fc_show_latency(seq, "Commit latency", stats->fc_commit_lat_hist);
+	ext4_fc_show_latency(seq, "Block wait latency",
+			     stats->fc_wait_lat_hist);
 
 	return 0;
 }
@@ -97,6 +97,7 @@ enum {
 	EXT4_FC_REASON_FALLOC_RANGE,
 	EXT4_FC_REASON_INODE_JOURNAL_DATA,
 	EXT4_FC_REASON_ENCRYPTED_FILENAME,
+	EXT4_FC_REASON_DIR_SHRINK,
 	EXT4_FC_REASON_MAX
 };
 
@@ -114,6 +115,12 @@ struct ext4_fc_dentry_update {
 	struct list_head fcd_dilist;
 };
 
+/*
+ * Commit latencies are accounted in power-of-two microsecond buckets; the
+ * last bucket also counts everything slower.
+ */
+#define EXT4_FC_LAT_BUCKETS	16
+
 struct ext4_fc_stats {
 	unsigned int fc_ineligible_reason_count[EXT4_FC_REASON_MAX];
 	unsigned long fc_num_commits;
@@ -122,8 +129,13 @@ struct ext4_fc_stats {
 	unsigned long fc_skipped_commits;
 	unsigned long fc_numblks;
 	u64 s_fc_avg_commit_time;
+	unsigned long fc_commit_lat_hist[EXT4_FC_LAT_BUCKETS];
+	unsigned long fc_wait_lat_hist[EXT4_FC_LAT_BUCKETS];
 };
 
+/* Maximum number of fast commit blocks written by a single bio */
+#define EXT4_FC_MAX_BIO_BLOCKS	16
+
 #define EXT4_FC_REPLAY_REALLOC_INCREMENT	4
 
 /*
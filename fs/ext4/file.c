@@ -141,6 +141,8 @@ static ssize_t ext4_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
 	if (IS_DAX(inode))
 		return ext4_dax_read_iter(iocb, to);
 #endif
+	if (ext4_snapshot_file(inode))
+		return ext4_snapshot_read_iter(iocb, to);
 	if (iocb->ki_flags & IOCB_DIRECT)
 		return ext4_dio_read_iter(iocb, to);
 
@@ -155,6 +157,8 @@ static ssize_t ext4_file_splice_read(struct file *in, loff_t *ppos,
 
 	if (unlikely(ext4_forced_shutdown(inode->i_sb)))
 		return -EIO;
+	if (ext4_snapshot_file(inode))
+		return copy_splice_read(in, ppos, pipe, len, flags);
 	return filemap_splice_read(in, ppos, pipe, len, flags);
 }
 
@@ -531,8 +535,13 @@ static ssize_t ext4_dio_write_iter(struct kiocb *iocb, struct iov_iter *from)
 			inode_lock(inode);
 	}
 
-	/* Fallback to buffered I/O if the inode does not support direct I/O. */
-	if (!ext4_should_use_dio(iocb, from)) {
+	/*
+	 * Fallback to buffered I/O if the inode does not support direct I/O,
+	 * or if blocks may have to be moved to the snapshot before they are
+	 * overwritten.
+	 */
+	if (!ext4_should_use_dio(iocb, from) ||
+	    ext4_snapshot_should_move_data(inode)) {
 		if (ilock_shared)
 			inode_unlock_shared(inode);
 		else
@@ -698,6 +707,9 @@ ext4_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
 		return ext4_dax_write_iter(iocb, from);
 #endif
 
+	if (unlikely(ext4_snapshot_file(inode)))
+		return -EPERM;
+
 	if (iocb->ki_flags & IOCB_ATOMIC) {
 		size_t len = iov_iter_count(from);
 		int ret;
@@ -809,6 +821,10 @@ static int ext4_file_mmap(struct file *file, struct vm_area_struct *vma)
 	if (unlikely(ext4_forced_shutdown(inode->i_sb)))
 		return -EIO;
 
+	/* Snapshot blocks are only read through ext4_snapshot_read_iter() */
+	if (ext4_snapshot_file(inode))
+		return -ENODEV;
+
 	/*
 	 * We don't support synchronous mappings for non-DAX files and
 	 * for DAX files if underneath dax_device is not synchronous.
@@ -896,6 +912,9 @@ static int ext4_file_open(struct inode *inode, struct file *filp)
 	if (ret)
 		return ret;
 
+	if (ext4_snapshot_file(inode) && (filp->f_mode & FMODE_WRITE))
+		return -EPERM;
+
 	/*
 	 * Set up the jbd2_inode if we are opening the inode for
 	 * writing and the journal is present
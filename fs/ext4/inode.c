@@ -569,6 +569,37 @@ static int ext4_map_create_blocks(handle_t *handle, struct inode *inode,
 	return retval;
 }
 
+/*
+ * The mapped blocks described by @map are about to be overwritten in place
+ * while a snapshot is active. If the snapshot needs their contents, hand
+ * them over to it (ext4_free_blocks() does that) and map new blocks in their
+ * place. map->m_len may be trimmed.
+ */
+static int ext4_map_move_on_write(handle_t *handle, struct inode *inode,
+				  struct ext4_map_blocks *map, int flags)
+{
+	ext4_lblk_t lblk = map->m_lblk;
+	int retval;
+
+	retval = ext4_snapshot_move_on_write(handle, inode, map);
+	if (retval <= 0)
+		return retval ? retval : map->m_len;
+
+	down_write(&EXT4_I(inode)->i_data_sem);
+	ext4_es_remove_extent(inode, lblk, map->m_len);
+	if (ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS))
+		retval = ext4_ext_remove_space(inode, lblk,
+					       lblk + map->m_len - 1);
+	else
+		retval = ext4_ind_remove_space(handle, inode, lblk,
+					       lblk + map->m_len);
+	if (!retval)
+		retval = ext4_map_create_blocks(handle, inode, map,
+				flags & ~EXT4_GET_BLOCKS_MOVE_ON_WRITE);
+	up_write(&EXT4_I(inode)->i_data_sem);
+	return retval;
+}
+
 /*
  * The ext4_map_blocks() function tries to look up the requested blocks,
  * and returns if the blocks are already mapped.
@@ -683,6 +714,16 @@ int ext4_map_blocks(handle_t *handle, struct inode *inode,
 	 * Note that if blocks have been preallocated
 	 * ext4_ext_map_blocks() returns with buffer head unmapped
 	 */
+	if (retval > 0 && map->m_flags & EXT4_MAP_MAPPED &&
+	    flags & EXT4_GET_BLOCKS_MOVE_ON_WRITE &&
+	    ext4_snapshot_should_move_data(inode)) {
+		/* Blocks still needed by the snapshot get replaced */
+		retval = ext4_map_move_on_write(handle, inode, map, flags);
+		if (retval <= 0 || !(map->m_flags & EXT4_MAP_NEW))
+			return retval;
+		goto created;
+	}
+
 	if (retval > 0 && map->m_flags & EXT4_MAP_MAPPED)
 		/*
 		 * If we need to convert extent to unwritten
@@ -701,6 +742,7 @@ int ext4_map_blocks(handle_t *handle, struct inode *inode,
 	down_write(&EXT4_I(inode)->i_data_sem);
 	retval = ext4_map_create_blocks(handle, inode, map, flags);
 	up_write((&EXT4_I(inode)->i_data_sem));
+created:
 	if (retval > 0 && map->m_flags & EXT4_MAP_MAPPED) {
 		ret = check_block_validity(inode, map);
 		if (ret != 0)
@@ -714,12 +756,19 @@ int ext4_map_blocks(handle_t *handle, struct inode *inode,
 		if (map->m_flags & EXT4_MAP_NEW &&
 		    !(map->m_flags & EXT4_MAP_UNWRITTEN) &&
 		    !(flags & EXT4_GET_BLOCKS_ZERO) &&
-		    !ext4_is_quota_file(inode) &&
+		    !ext4_is_quota_file(inode) && !ext4_snapshot_file(inode) &&
 		    ext4_should_order_data(inode)) {
 			loff_t start_byte =
 				(loff_t)map->m_lblk << inode->i_blkbits;
 			loff_t length = (loff_t)map->m_len << inode->i_blkbits;
 
+			/* Let commit know it may write these blocks */
+			if (ext4_snapshot_should_move_data(inode)) {
+				ret = ext4_snapshot_new_blocks(inode, map);
+				if (ret)
+					return ret;
+			}
+
 			if (flags & EXT4_GET_BLOCKS_IO_SUBMIT)
 				ret = ext4_jbd2_inode_add_wait(handle, inode,
 						start_byte, length);
@@ -1019,11 +1068,56 @@ int do_journal_get_write_access(handle_t *handle, struct inode *inode,
 					    EXT4_JTR_NONE);
 }
 
+/*
+ * Mapped buffer @bh is about to be modified while a snapshot is active.
+ * Read its current contents and let ext4_map_blocks() move the block to the
+ * snapshot if needed; @bh then maps a new block holding the same data.
+ */
+static int ext4_block_move_on_write(struct inode *inode, struct folio *folio,
+				    struct buffer_head *bh, sector_t iblock)
+{
+	int err;
+
+	if (folio_test_uptodate(folio))
+		set_buffer_uptodate(bh);
+	if (!buffer_uptodate(bh)) {
+		err = ext4_read_bh_lock(bh, 0, true);
+		if (err)
+			return err;
+		if (fscrypt_inode_uses_fs_layer_crypto(inode)) {
+			err = fscrypt_decrypt_pagecache_blocks(folio,
+					bh->b_size, bh_offset(bh));
+			if (err) {
+				clear_buffer_uptodate(bh);
+				return err;
+			}
+		}
+	}
+	err = _ext4_get_block(inode, iblock, bh, EXT4_GET_BLOCKS_CREATE |
+			      EXT4_GET_BLOCKS_MOVE_ON_WRITE);
+	/* The new block is not written yet, but the buffer is valid */
+	if (buffer_new(bh))
+		clear_buffer_new(bh);
+	return err;
+}
+
+/*
+ * Offset in @folio just past the part of a @len byte write at @pos that it
+ * covers. With large folios, ->write_begin may be asked for more than the
+ * folio it finds in the page cache holds.
+ */
+static inline unsigned int ext4_folio_write_end(struct folio *folio,
+						loff_t pos, unsigned int len)
+{
+	return min_t(size_t, offset_in_folio(folio, pos) + len,
+		     folio_size(folio));
+}
+
 int ext4_block_write_begin(handle_t *handle, struct folio *folio,
 			   loff_t pos, unsigned len,
 			   get_block_t *get_block)
 {
-	unsigned from = pos & (PAGE_SIZE - 1);
+	unsigned from = offset_in_folio(folio, pos);
 	unsigned to = from + len;
 	struct inode *inode = folio->mapping->host;
 	unsigned block_start, block_end;
@@ -1037,8 +1131,8 @@ int ext4_block_write_begin(handle_t *handle, struct folio *folio,
 	bool should_journal_data = ext4_should_journal_data(inode);
 
 	BUG_ON(!folio_test_locked(folio));
-	BUG_ON(from > PAGE_SIZE);
-	BUG_ON(to > PAGE_SIZE);
+	BUG_ON(from > folio_size(folio));
+	BUG_ON(to > folio_size(folio));
 	BUG_ON(from > to);
 
 	head = folio_buffers(folio);
@@ -1089,6 +1183,13 @@ int ext4_block_write_begin(handle_t *handle, struct folio *folio,
 				continue;
 			}
 		}
+		if (handle && !buffer_delay(bh) && !buffer_unwritten(bh) &&
+		    ext4_snapshot_should_move_data(inode)) {
+			err = ext4_block_move_on_write(inode, folio, bh, block);
+			if (err)
+				break;
+			continue;
+		}
 		if (folio_test_uptodate(folio)) {
 			set_buffer_uptodate(bh);
 			continue;
@@ -1159,8 +1260,6 @@ static int ext4_write_begin(struct file *file, struct address_space *mapping,
 	 */
 	needed_blocks = ext4_writepage_trans_blocks(inode) + 1;
 	index = pos >> PAGE_SHIFT;
-	from = pos & (PAGE_SIZE - 1);
-	to = from + len;
 
 	if (ext4_test_inode_state(inode, EXT4_STATE_MAY_INLINE_DATA)) {
 		ret = ext4_try_to_write_inline_data(mapping, inode, pos, len,
@@ -1179,10 +1278,13 @@ static int ext4_write_begin(struct file *file, struct address_space *mapping,
 	 * the folio (if needed) without using GFP_NOFS.
 	 */
 retry_grab:
-	folio = __filemap_get_folio(mapping, index, FGP_WRITEBEGIN,
-					mapping_gfp_mask(mapping));
+	folio = __filemap_get_folio(mapping, index,
+				    FGP_WRITEBEGIN | fgf_set_order(len),
+				    mapping_gfp_mask(mapping));
 	if (IS_ERR(folio))
 		return PTR_ERR(folio);
+	from = offset_in_folio(folio, pos);
+	to = ext4_folio_write_end(folio, pos, len);
 	/*
 	 * The same as page allocation, we prealloc buffer heads before
 	 * starting the handle.
@@ -1211,10 +1313,10 @@ static int ext4_write_begin(struct file *file, struct address_space *mapping,
 	folio_wait_stable(folio);
 
 	if (ext4_should_dioread_nolock(inode))
-		ret = ext4_block_write_begin(handle, folio, pos, len,
+		ret = ext4_block_write_begin(handle, folio, pos, to - from,
 					     ext4_get_block_unwritten);
 	else
-		ret = ext4_block_write_begin(handle, folio, pos, len,
+		ret = ext4_block_write_begin(handle, folio, pos, to - from,
 					     ext4_get_block);
 	if (!ret && ext4_should_journal_data(inode)) {
 		ret = ext4_walk_page_buffers(handle, inode,
@@ -1557,6 +1659,7 @@ struct mpage_da_data {
 	unsigned int do_map:1;
 	unsigned int scanned_until_end:1;
 	unsigned int journalled_more_data:1;
+	unsigned int move_data:1;	/* Overwrites go to new blocks */
 };
 
 static void mpage_release_unused_pages(struct mpage_da_data *mpd,
@@ -1931,7 +2034,7 @@ static int mpage_submit_folio(struct mpage_da_data *mpd, struct folio *folio)
 		len = size & (len - 1);
 	err = ext4_bio_write_folio(&mpd->io_submit, folio, len);
 	if (!err)
-		mpd->wbc->nr_to_write--;
+		mpd->wbc->nr_to_write -= folio_nr_pages(folio);
 
 	return err;
 }
@@ -1964,9 +2067,12 @@ static bool mpage_add_bh_to_extent(struct mpage_da_data *mpd, ext4_lblk_t lblk,
 {
 	struct ext4_map_blocks *map = &mpd->map;
 
-	/* Buffer that doesn't need mapping for writeback? */
+	/*
+	 * Buffer that doesn't need mapping for writeback? With a snapshot
+	 * active, overwritten blocks may have to be moved to it first.
+	 */
 	if (!buffer_dirty(bh) || !buffer_mapped(bh) ||
-	    (!buffer_delay(bh) && !buffer_unwritten(bh))) {
+	    (!buffer_delay(bh) && !buffer_unwritten(bh) && !mpd->move_data)) {
 		/* So far no extent to map => we write the buffer right away */
 		if (map->m_len == 0)
 			return true;
@@ -2113,6 +2219,9 @@ static int mpage_process_folio(struct mpage_da_data *mpd, struct folio *folio,
 		if (buffer_delay(bh)) {
 			clear_buffer_delay(bh);
 			bh->b_blocknr = pblock++;
+		} else if (mpd->move_data && !buffer_unwritten(bh)) {
+			/* The block may have been moved to the snapshot */
+			bh->b_blocknr = pblock++;
 		}
 		clear_buffer_unwritten(bh);
 		io_end_size += (1 << blkbits);
@@ -2154,7 +2263,6 @@ static int mpage_map_and_submit_buffers(struct mpage_da_data *mpd)
 
 	start = mpd->map.m_lblk >> bpp_bits;
 	end = (mpd->map.m_lblk + mpd->map.m_len - 1) >> bpp_bits;
-	lblk = start << bpp_bits;
 	pblock = mpd->map.m_pblk;
 
 	folio_batch_init(&fbatch);
@@ -2165,6 +2273,8 @@ static int mpage_map_and_submit_buffers(struct mpage_da_data *mpd)
 		for (i = 0; i < nr; i++) {
 			struct folio *folio = fbatch.folios[i];
 
+			/* A large folio may start before the mapped extent */
+			lblk = ((ext4_lblk_t)folio->index) << bpp_bits;
 			err = mpage_process_folio(mpd, folio, &lblk, &pblock,
 						 &map_bh);
 			/*
@@ -2215,6 +2325,8 @@ static int mpage_map_one_extent(handle_t *handle, struct mpage_da_data *mpd)
 	dioread_nolock = ext4_should_dioread_nolock(inode);
 	if (dioread_nolock)
 		get_blocks_flags |= EXT4_GET_BLOCKS_IO_CREATE_EXT;
+	if (mpd->move_data)
+		get_blocks_flags |= EXT4_GET_BLOCKS_MOVE_ON_WRITE;
 
 	err = ext4_map_blocks(handle, inode, map, get_blocks_flags);
 	if (err < 0)
@@ -2345,15 +2457,15 @@ static int mpage_map_and_submit_extent(handle_t *handle,
  * Calculate the total number of credits to reserve for one writepages
  * iteration. This is called from ext4_writepages(). We map an extent of
  * up to MAX_WRITEPAGES_EXTENT_LEN blocks and then we go on and finish mapping
- * the last partial page. So in total we can map MAX_WRITEPAGES_EXTENT_LEN +
- * bpp - 1 blocks in bpp different extents.
+ * the last partial folio. So in total we can map MAX_WRITEPAGES_EXTENT_LEN +
+ * bpf - 1 blocks in bpf different extents.
  */
 static int ext4_da_writepages_trans_blocks(struct inode *inode)
 {
-	int bpp = ext4_journal_blocks_per_page(inode);
+	int bpf = ext4_journal_blocks_per_folio(inode);
 
 	return ext4_meta_trans_blocks(inode,
-				MAX_WRITEPAGES_EXTENT_LEN + bpp - 1, bpp);
+				MAX_WRITEPAGES_EXTENT_LEN + bpf - 1, bpf);
 }
 
 static int ext4_journal_folio_buffers(handle_t *handle, struct folio *folio,
@@ -2642,13 +2754,24 @@ static int ext4_do_writepages(struct mpage_da_data *mpd)
 	}
 	mpd->journalled_more_data = 0;
 
+	/*
+	 * With a snapshot active, buffers dirtied before it was taken or
+	 * through a mapping that was writable already may still map blocks
+	 * it needs. Writeback maps them with EXT4_GET_BLOCKS_MOVE_ON_WRITE.
+	 * Transaction commit cannot, so it leaves them dirty. Writeback holds
+	 * s_writepages_rwsem, which keeps the snapshot from being activated
+	 * under us; commit runs only after activation is complete.
+	 */
+	mpd->move_data = ext4_snapshot_should_move_data(inode);
+
 	if (ext4_should_dioread_nolock(inode)) {
 		/*
 		 * We may need to convert up to one extent per block in
-		 * the page and we may dirty the inode.
+		 * the folio and we may dirty the inode.
 		 */
 		rsv_blocks = 1 + ext4_chunk_trans_blocks(inode,
-						PAGE_SIZE >> inode->i_blkbits);
+				mapping_max_folio_size(mapping) >>
+				inode->i_blkbits);
 	}
 
 	if (wbc->range_start == 0 && wbc->range_end == LLONG_MAX)
@@ -2666,6 +2789,7 @@ static int ext4_do_writepages(struct mpage_da_data *mpd)
 	}
 
 	ext4_io_submit_init(&mpd->io_submit, wbc);
+	mpd->io_submit.io_keep_in_use = mpd->move_data && !mpd->can_map;
 retry:
 	if (wbc->sync_mode == WB_SYNC_ALL || wbc->tagged_writepages)
 		tag_pages_for_writeback(mapping, mpd->first_page,
@@ -2920,7 +3044,8 @@ static int ext4_da_write_begin(struct file *file, struct address_space *mapping,
 
 	index = pos >> PAGE_SHIFT;
 
-	if (ext4_nonda_switch(inode->i_sb) || ext4_verity_in_progress(inode)) {
+	if (ext4_nonda_switch(inode->i_sb) || ext4_verity_in_progress(inode) ||
+	    ext4_snapshot_should_move_data(inode)) {
 		*fsdata = (void *)FALL_BACK_TO_NONDELALLOC;
 		return ext4_write_begin(file, mapping, pos,
 					len, foliop, fsdata);
@@ -2938,13 +3063,15 @@ static int ext4_da_write_begin(struct file *file, struct address_space *mapping,
 	}
 
 retry:
-	folio = __filemap_get_folio(mapping, index, FGP_WRITEBEGIN,
-			mapping_gfp_mask(mapping));
+	folio = __filemap_get_folio(mapping, index,
+				    FGP_WRITEBEGIN | fgf_set_order(len),
+				    mapping_gfp_mask(mapping));
 	if (IS_ERR(folio))
 		return PTR_ERR(folio);
 
-	ret = ext4_block_write_begin(NULL, folio, pos, len,
-				     ext4_da_get_block_prep);
+	ret = ext4_block_write_begin(NULL, folio, pos,
+			ext4_folio_write_end(folio, pos, len) -
+			offset_in_folio(folio, pos), ext4_da_get_block_prep);
 	if (ret < 0) {
 		folio_unlock(folio);
 		folio_put(folio);
@@ -3031,7 +3158,7 @@ static int ext4_da_do_write_end(struct address_space *mapping,
 		unsigned long end;
 
 		i_size_write(inode, new_i_size);
-		end = (new_i_size - 1) & (PAGE_SIZE - 1);
+		end = offset_in_folio(folio, new_i_size - 1);
 		if (copied && ext4_da_should_update_i_disksize(folio, end)) {
 			ext4_update_i_disksize(inode, new_i_size);
 			disksize_changed = true;
@@ -3650,6 +3777,43 @@ static const struct address_space_operations ext4_dax_aops = {
 	.swap_activate		= ext4_iomap_swap_activate,
 };
 
+/*
+ * Large folios are limited to 2048 blocks so that the per-folio journal
+ * credits computed by ext4_writepage_trans_blocks() stay reasonable.
+ */
+#define EXT4_MAX_PAGECACHE_ORDER(inode) \
+	min_t(unsigned int, MAX_PAGECACHE_ORDER, \
+	      11 + (inode)->i_blkbits - PAGE_SHIFT)
+
+/*
+ * Buffered I/O through the extent and indirect mapped paths handles folios
+ * of any size. Data journalling, fscrypt and fs-verity still work page by
+ * page, so only use large folios when none of them can apply to the inode.
+ */
+static bool ext4_should_enable_large_folio(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+
+	if (!S_ISREG(inode->i_mode) || IS_DAX(inode))
+		return false;
+	if (ext4_test_inode_flag(inode, EXT4_INODE_EA_INODE))
+		return false;
+	if (ext4_inode_journal_mode(inode) == EXT4_INODE_JOURNAL_DATA_MODE)
+		return false;
+	if (ext4_has_feature_encrypt(sb) || ext4_has_feature_verity(sb))
+		return false;
+	return true;
+}
+
+static void ext4_set_inode_mapping_order(struct inode *inode)
+{
+	if (ext4_should_enable_large_folio(inode))
+		mapping_set_folio_order_range(inode->i_mapping, 0,
+					EXT4_MAX_PAGECACHE_ORDER(inode));
+	else
+		mapping_set_folio_order_range(inode->i_mapping, 0, 0);
+}
+
 void ext4_set_aops(struct inode *inode)
 {
 	switch (ext4_inode_journal_mode(inode)) {
@@ -3658,6 +3822,7 @@ void ext4_set_aops(struct inode *inode)
 		break;
 	case EXT4_INODE_JOURNAL_DATA_MODE:
 		inode->i_mapping->a_ops = &ext4_journalled_aops;
+		ext4_set_inode_mapping_order(inode);
 		return;
 	default:
 		BUG();
@@ -3668,6 +3833,7 @@ void ext4_set_aops(struct inode *inode)
 		inode->i_mapping->a_ops = &ext4_da_aops;
 	else
 		inode->i_mapping->a_ops = &ext4_aops;
+	ext4_set_inode_mapping_order(inode);
 }
 
 /*
@@ -3679,8 +3845,7 @@ void ext4_set_aops(struct inode *inode)
 static int __ext4_block_zero_page_range(handle_t *handle,
 		struct address_space *mapping, loff_t from, loff_t length)
 {
-	ext4_fsblk_t index = from >> PAGE_SHIFT;
-	unsigned offset = from & (PAGE_SIZE-1);
+	unsigned offset;
 	unsigned blocksize, pos;
 	ext4_lblk_t iblock;
 	struct inode *inode = mapping->host;
@@ -3696,7 +3861,9 @@ static int __ext4_block_zero_page_range(handle_t *handle,
 
 	blocksize = inode->i_sb->s_blocksize;
 
-	iblock = index << (PAGE_SHIFT - inode->i_sb->s_blocksize_bits);
+	offset = offset_in_folio(folio, from);
+	iblock = (ext4_lblk_t)folio->index <<
+		 (PAGE_SHIFT - inode->i_sb->s_blocksize_bits);
 
 	bh = folio_buffers(folio);
 	if (!bh)
@@ -3743,6 +3910,12 @@ static int __ext4_block_zero_page_range(handle_t *handle,
 			}
 		}
 	}
+	if (!buffer_delay(bh) && !buffer_unwritten(bh) &&
+	    ext4_snapshot_should_move_data(inode)) {
+		err = ext4_block_move_on_write(inode, folio, bh, iblock);
+		if (err)
+			goto unlock;
+	}
 	if (ext4_should_journal_data(inode)) {
 		BUFFER_TRACE(bh, "get write access");
 		err = ext4_journal_get_write_access(handle, inode->i_sb, bh,
@@ -5362,6 +5535,9 @@ int ext4_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
 				  ATTR_GID | ATTR_TIMES_SET))))
 		return -EPERM;
 
+	if (unlikely(ext4_snapshot_file(inode) && (ia_valid & ATTR_SIZE)))
+		return -EPERM;
+
 	error = setattr_prepare(idmap, dentry, attr);
 	if (error)
 		return error;
@@ -5762,14 +5938,14 @@ static int ext4_meta_trans_blocks(struct inode *inode, int lblocks,
  */
 int ext4_writepage_trans_blocks(struct inode *inode)
 {
-	int bpp = ext4_journal_blocks_per_page(inode);
+	int bpf = ext4_journal_blocks_per_folio(inode);
 	int ret;
 
-	ret = ext4_meta_trans_blocks(inode, bpp, bpp);
+	ret = ext4_meta_trans_blocks(inode, bpf, bpf);
 
 	/* Account for data blocks for journalled mode */
 	if (ext4_should_journal_data(inode))
-		ret += bpp;
+		ret += bpf;
 	return ret;
 }
 
@@ -6084,6 +6260,13 @@ int ext4_change_inode_journal_flag(struct inode *inode, int val)
 			filemap_invalidate_unlock(inode->i_mapping);
 			return err;
 		}
+		/*
+		 * Journalled aops work on order-0 folios only. All data is
+		 * on disk now, so drop any large folios from the page cache
+		 * before ext4_set_aops() limits the mapping to order 0.
+		 */
+		if (mapping_large_folio_support(inode->i_mapping))
+			truncate_pagecache(inode, 0);
 	}
 
 	alloc_ctx = ext4_writepages_down_write(inode->i_sb);
@@ -6151,6 +6334,7 @@ vm_fault_t ext4_page_mkwrite(struct vm_fault *vmf)
 	struct address_space *mapping = inode->i_mapping;
 	handle_t *handle;
 	get_block_t *get_block;
+	bool move_data;
 	int retries = 0;
 
 	if (unlikely(IS_IMMUTABLE(inode)))
@@ -6165,13 +6349,20 @@ vm_fault_t ext4_page_mkwrite(struct vm_fault *vmf)
 	if (err)
 		goto out_ret;
 
+	/*
+	 * Blocks the active snapshot still needs are moved to it by
+	 * ext4_block_write_begin(), even if they are all mapped.  Decide
+	 * once: block_page_mkwrite() below needs get_block set up.
+	 */
+	move_data = ext4_snapshot_should_move_data(inode);
+
 	/*
 	 * On data journalling we skip straight to the transaction handle:
 	 * there's no delalloc; page truncated will be checked later; the
 	 * early return w/ all buffers mapped (calculates size/len) can't
 	 * be used; and there's no dioread_nolock, so only ext4_get_block.
 	 */
-	if (ext4_should_journal_data(inode))
+	if (ext4_should_journal_data(inode) || move_data)
 		goto retry_alloc;
 
 	/* Delalloc case is easy... */
@@ -6232,7 +6423,7 @@ vm_fault_t ext4_page_mkwrite(struct vm_fault *vmf)
 	 * will set_buffer_dirty() before do_journal_get_write_access()
 	 * thus might hit warning messages for dirty metadata buffers.
 	 */
-	if (!ext4_should_journal_data(inode)) {
+	if (!ext4_should_journal_data(inode) && !move_data) {
 		err = block_page_mkwrite(vma, vmf, get_block);
 	} else {
 		folio_lock(folio);
@@ -6249,12 +6440,16 @@ vm_fault_t ext4_page_mkwrite(struct vm_fault *vmf)
 
 		err = ext4_block_write_begin(handle, folio, 0, len,
 					     ext4_get_block);
-		if (!err) {
+		if (err) {
+			folio_unlock(folio);
+		} else if (ext4_should_journal_data(inode)) {
 			ret = VM_FAULT_SIGBUS;
 			if (ext4_journal_folio_buffers(handle, folio, len))
 				goto out_error;
 		} else {
-			folio_unlock(folio);
+			block_commit_write(&folio->page, 0, len);
+			folio_mark_dirty(folio);
+			folio_wait_stable(folio);
 		}
 	}
 	ext4_journal_stop(handle);
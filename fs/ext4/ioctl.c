@@ -330,6 +330,8 @@ static void swap_inode_data(struct inode *inode1, struct inode *inode2)
 	inode_set_mtime_to_ts(inode2, ts1);
 
 	memswap(ei1->i_data, ei2->i_data, sizeof(ei1->i_data));
+	ext4_ext_tree_changed(inode1);
+	ext4_ext_tree_changed(inode2);
 	tmp = ei1->i_flags & EXT4_FL_SHOULD_SWAP;
 	ei1->i_flags = (ei2->i_flags & EXT4_FL_SHOULD_SWAP) |
 		(ei1->i_flags & ~EXT4_FL_SHOULD_SWAP);
@@ -1356,6 +1358,10 @@ static long __ext4_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			ext4_msg(sb, KERN_ERR,
 				 "Online defrag not supported with DAX");
 			return -EOPNOTSUPP;
+		} else if (ext4_snapshot_active(sb)) {
+			ext4_msg(sb, KERN_ERR,
+				 "Online defrag not supported with a snapshot");
+			return -EBUSY;
 		}
 
 		err = mnt_want_write_file(filp);
@@ -1609,6 +1615,10 @@ static long __ext4_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		return ext4_ioctl_getuuid(EXT4_SB(sb), (void __user *)arg);
 	case EXT4_IOC_SETFSUUID:
 		return ext4_ioctl_setuuid(filp, (const void __user *)arg);
+	case EXT4_IOC_SNAPSHOT_TAKE:
+		return ext4_snapshot_take(filp);
+	case EXT4_IOC_SNAPSHOT_DELETE:
+		return ext4_snapshot_delete(filp);
 	default:
 		return -ENOTTY;
 	}
@@ -1688,6 +1698,8 @@ long ext4_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case FS_IOC_SETFSLABEL:
 	case EXT4_IOC_GETFSUUID:
 	case EXT4_IOC_SETFSUUID:
+	case EXT4_IOC_SNAPSHOT_TAKE:
+	case EXT4_IOC_SNAPSHOT_DELETE:
 		break;
 	default:
 		return -ENOIOCTLCMD;
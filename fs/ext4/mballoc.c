@@ -15,6 +15,8 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/nospec.h>
+#include <linux/hash.h>
+#include <linux/list_sort.h>
 #include <linux/backing-dev.h>
 #include <linux/freezer.h>
 #include <trace/events/ext4.h>
@@ -867,6 +869,95 @@ mb_update_avg_fragment_size(struct super_block *sb, struct ext4_group_info *grp)
 					grp->bb_avg_fragment_size_order]);
 }
 
+/*
+ * NUMA group affinity.  Locality group allocations are already per-cpu,
+ * but nothing stops writers on different sockets from picking the same
+ * block groups, so they contend on ext4_lock_group() and bounce bitmap
+ * and buddy cachelines between nodes.  When mb_numa_groups is set, the
+ * flex groups of the filesystem are split into one contiguous range per
+ * online node and locality group allocations start in, and the optimized
+ * scans stick to, the range of the node the allocating cpu belongs to.
+ * The linear scans still walk the whole filesystem, so a full range
+ * falls back to its neighbours.
+ *
+ * Node ids may be sparse, so a node's range is picked by its rank among
+ * the online nodes rather than by its id.  An offline node has no range.
+ */
+static void ext4_mb_numa_range(struct super_block *sb, int node,
+			       ext4_group_t *start, ext4_group_t *end)
+{
+	ext4_group_t ngroups = ext4_get_groups_count(sb);
+	unsigned int shift = 0, nr, rank = 0;
+	ext4_group_t nflex;
+	int n;
+
+	*start = *end = 0;
+	if (node == NUMA_NO_NODE || !node_online(node))
+		return;
+	for_each_online_node(n) {
+		if (n == node)
+			break;
+		rank++;
+	}
+	nr = num_online_nodes();
+	if (rank >= nr)
+		return;
+
+	if (ext4_has_feature_flex_bg(sb))
+		shift = EXT4_SB(sb)->s_log_groups_per_flex;
+	nflex = (ngroups + (1 << shift) - 1) >> shift;
+	*start = min_t(u64, div_u64((u64)nflex * rank, nr) << shift, ngroups);
+	*end = min_t(u64, div_u64((u64)nflex * (rank + 1), nr) << shift,
+		     ngroups);
+}
+
+static void ext4_mb_numa_goal(struct ext4_allocation_context *ac)
+{
+	struct super_block *sb = ac->ac_sb;
+	ext4_group_t start, end, nflex, group;
+	unsigned int shift = 0;
+
+	if (!READ_ONCE(EXT4_SB(sb)->s_mb_numa_groups) ||
+	    !ext4_test_inode_flag(ac->ac_inode, EXT4_INODE_EXTENTS))
+		return;
+
+	ext4_mb_numa_range(sb, ac->ac_lg->lg_node, &start, &end);
+	if (start >= end)
+		return;
+	ac->ac_numa_start = start;
+	ac->ac_numa_end = end;
+	if (ac->ac_g_ex.fe_group >= start && ac->ac_g_ex.fe_group < end)
+		return;
+
+	/* Spread the cpus of the node over the flex groups of its range */
+	if (ext4_has_feature_flex_bg(sb))
+		shift = EXT4_SB(sb)->s_log_groups_per_flex;
+	nflex = (end - start + (1 << shift) - 1) >> shift;
+	group = start + ((raw_smp_processor_id() % nflex) << shift);
+	ac->ac_g_ex.fe_group = min(group, end - 1);
+	ac->ac_g_ex.fe_start = 0;
+}
+
+/* Should an optimized scan skip @group because it belongs to another node? */
+static inline bool ext4_mb_numa_remote(struct ext4_allocation_context *ac,
+				       ext4_group_t group)
+{
+	return ac->ac_numa_end &&
+		(group < ac->ac_numa_start || group >= ac->ac_numa_end);
+}
+
+static void ext4_mb_numa_account(struct ext4_allocation_context *ac)
+{
+	struct ext4_mb_numa_stats *stats = EXT4_SB(ac->ac_sb)->s_mb_numa_stats;
+
+	if (!ac->ac_numa_end || !ac->ac_b_ex.fe_len || !stats)
+		return;
+	stats += ac->ac_lg->lg_node;
+	atomic64_inc(&stats->nm_allocs);
+	if (ext4_mb_numa_remote(ac, ac->ac_b_ex.fe_group))
+		atomic64_inc(&stats->nm_remote);
+}
+
 /*
  * Choose next group by traversing largest_free_order lists. Updates *new_cr if
  * cr level needs an update.
@@ -894,6 +985,8 @@ static void ext4_mb_choose_next_group_p2_aligned(struct ext4_allocation_context
 		}
 		list_for_each_entry(iter, &sbi->s_mb_largest_free_orders[i],
 				    bb_largest_free_order_node) {
+			if (ext4_mb_numa_remote(ac, iter->bb_group))
+				continue;
 			if (sbi->s_mb_stats)
 				atomic64_inc(&sbi->s_bal_cX_groups_considered[CR_POWER2_ALIGNED]);
 			if (likely(ext4_mb_good_group(ac, iter->bb_group, CR_POWER2_ALIGNED))) {
@@ -930,6 +1023,8 @@ ext4_mb_find_good_group_avg_frag_lists(struct ext4_allocation_context *ac, int o
 		return NULL;
 	}
 	list_for_each_entry(iter, frag_list, bb_avg_fragment_size_node) {
+		if (ext4_mb_numa_remote(ac, iter->bb_group))
+			continue;
 		if (sbi->s_mb_stats)
 			atomic64_inc(&sbi->s_bal_cX_groups_considered[cr]);
 		if (likely(ext4_mb_good_group(ac, iter->bb_group, cr))) {
@@ -2130,13 +2225,51 @@ static int mb_mark_used(struct ext4_buddy *e4b, struct ext4_free_extent *ex)
 	return ret;
 }
 
+/*
+ * Stream allocations used to share a single goal, so concurrent sequential
+ * writers all chased the same group, contended on its lock and interleaved
+ * their extents.  The goals are now kept in slots, initially spread over
+ * the flex groups, and an inode always uses the slot it hashes to.
+ */
+static struct ext4_mb_stream_goal *
+ext4_mb_stream_goal(struct ext4_allocation_context *ac)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(ac->ac_sb);
+
+	return &sbi->s_mb_stream_goals[hash_long(ac->ac_inode->i_ino, 32) %
+				       sbi->s_mb_nr_stream_goals];
+}
+
+static int ext4_mb_init_stream_goals(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_group_t ngroups = ext4_get_groups_count(sb);
+	unsigned int log_flex = sbi->s_es->s_log_groups_per_flex;
+	unsigned int i, nr;
+
+	nr = min_t(ext4_group_t, num_possible_cpus(), DIV_ROUND_UP(ngroups, 4));
+	sbi->s_mb_stream_goals = kcalloc(nr, sizeof(struct ext4_mb_stream_goal),
+					 GFP_KERNEL);
+	if (!sbi->s_mb_stream_goals)
+		return -ENOMEM;
+	sbi->s_mb_nr_stream_goals = nr;
+	for (i = 0; i < nr; i++) {
+		ext4_group_t group = div_u64((u64)ngroups * i, nr);
+
+		/* flex_bg info is not set up yet, so use the on-disk value */
+		if (ext4_has_feature_flex_bg(sb) && log_flex < 32)
+			group = round_down(group, 1U << log_flex);
+		sbi->s_mb_stream_goals[i].sg_group = group;
+	}
+	return 0;
+}
+
 /*
  * Must be called under group lock!
  */
 static void ext4_mb_use_best_found(struct ext4_allocation_context *ac,
 					struct ext4_buddy *e4b)
 {
-	struct ext4_sb_info *sbi = EXT4_SB(ac->ac_sb);
 	int ret;
 
 	BUG_ON(ac->ac_b_ex.fe_group != e4b->bd_group);
@@ -2167,10 +2300,10 @@ static void ext4_mb_use_best_found(struct ext4_allocation_context *ac,
 	folio_get(ac->ac_buddy_folio);
 	/* store last allocated for subsequent stream allocation */
 	if (ac->ac_flags & EXT4_MB_STREAM_ALLOC) {
-		spin_lock(&sbi->s_md_lock);
-		sbi->s_mb_last_group = ac->ac_f_ex.fe_group;
-		sbi->s_mb_last_start = ac->ac_f_ex.fe_start;
-		spin_unlock(&sbi->s_md_lock);
+		struct ext4_mb_stream_goal *sg = ext4_mb_stream_goal(ac);
+
+		WRITE_ONCE(sg->sg_group, ac->ac_f_ex.fe_group);
+		WRITE_ONCE(sg->sg_start, ac->ac_f_ex.fe_start);
 	}
 	/*
 	 * As we've just preallocated more space than
@@ -2793,6 +2926,178 @@ void ext4_mb_prefetch_fini(struct super_block *sb, ext4_group_t group,
 	}
 }
 
+/*
+ * Parallel group initialization.
+ *
+ * On a freshly mounted filesystem most groups have not been initialized
+ * yet, and the cheap criteria skip such groups rather than waiting for
+ * their bitmaps, so allocations end up at the expensive criteria which
+ * read and initialize cold groups one after another.  When mb_parallel_scan
+ * is set, a cold group met at a cheap criterion instead makes us initialize
+ * it and the following groups of the scan concurrently, up to
+ * mb_parallel_scan of them, and then carry on scanning them in memory, the
+ * best extent being picked by the usual scan.
+ */
+#define EXT4_MB_MAX_PARALLEL_INIT	128
+
+struct ext4_mb_init_work {
+	struct work_struct work;
+	struct super_block *sb;
+	ext4_group_t group;
+	atomic_t *pending;
+	struct completion *done;
+};
+
+static bool ext4_mb_want_parallel_init(struct ext4_group_info *grp,
+				       ext4_grpblk_t min_free)
+{
+	return grp && EXT4_MB_GRP_NEED_INIT(grp) &&
+		!EXT4_MB_GRP_BBITMAP_CORRUPT(grp) &&
+		grp->bb_free >= min_free;
+}
+
+static void ext4_mb_init_group_work(struct work_struct *work)
+{
+	struct ext4_mb_init_work *iw =
+		container_of(work, struct ext4_mb_init_work, work);
+	unsigned int nofs = memalloc_nofs_save();
+
+	/* Errors are found again when the scan gets to the group */
+	ext4_mb_init_group(iw->sb, iw->group, GFP_NOFS);
+	memalloc_nofs_restore(nofs);
+	if (atomic_dec_and_test(iw->pending))
+		complete(iw->done);
+}
+
+/*
+ * Initialize the groups among the @nr following @group which have at least
+ * @min_free free clusters, using @works, and wait for them.  Returns the
+ * number of groups initialized.
+ */
+static unsigned int ext4_mb_init_groups(struct super_block *sb,
+					struct ext4_mb_init_work *works,
+					ext4_group_t group, unsigned int nr,
+					ext4_grpblk_t min_free)
+{
+	ext4_group_t ngroups = ext4_get_groups_count(sb);
+	DECLARE_COMPLETION_ONSTACK(done);
+	atomic_t pending = ATOMIC_INIT(1);
+	unsigned int i, queued = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (ext4_mb_want_parallel_init(ext4_get_group_info(sb, group),
+					       min_free)) {
+			struct ext4_mb_init_work *iw = &works[queued++];
+
+			INIT_WORK(&iw->work, ext4_mb_init_group_work);
+			iw->sb = sb;
+			iw->group = group;
+			iw->pending = &pending;
+			iw->done = &done;
+			atomic_inc(&pending);
+			queue_work(system_unbound_wq, &iw->work);
+		}
+		if (++group >= ngroups)
+			group = 0;
+	}
+	if (!atomic_dec_and_test(&pending))
+		wait_for_completion(&done);
+	return queued;
+}
+
+static void ext4_mb_parallel_init(struct ext4_allocation_context *ac,
+				  ext4_group_t group, ext4_group_t ngroups)
+{
+	struct super_block *sb = ac->ac_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_mb_init_work *works;
+	unsigned int nr, queued;
+
+	nr = min3(READ_ONCE(sbi->s_mb_parallel_scan), ngroups,
+		  (ext4_group_t)EXT4_MB_MAX_PARALLEL_INIT);
+	works = kcalloc(nr, sizeof(*works), GFP_NOFS);
+	if (!works)
+		return;
+
+	queued = ext4_mb_init_groups(sb, works, group, nr, ac->ac_g_ex.fe_len);
+	if (sbi->s_mb_stats)
+		atomic_add(queued, &sbi->s_mb_parallel_inits);
+	kfree(works);
+}
+
+/*
+ * Buddy pre-generation.
+ *
+ * With the mb_pregen=N mount option, a background worker walks all the
+ * groups after mount, reading their block bitmaps ahead and initializing
+ * N groups at a time, so that the buddy caches and the largest free order
+ * and average fragment size lists are complete before the first write
+ * burst instead of being built group by group by the allocating tasks.
+ * Allocations racing with it simply initialize the group themselves, as
+ * ext4_mb_init_group() is serialized per group.
+ */
+static void ext4_mb_pregen_work(struct work_struct *work)
+{
+	struct ext4_sb_info *sbi = container_of(work, struct ext4_sb_info,
+						s_mb_pregen_work);
+	struct super_block *sb = sbi->s_sb;
+	ext4_group_t ngroups = ext4_get_groups_count(sb);
+	struct ext4_mb_init_work *works;
+	ext4_group_t group, next;
+	unsigned int nr;
+	u64 start = ktime_get_ns();
+
+	nr = min3(sbi->s_mb_pregen, ngroups,
+		  (ext4_group_t)EXT4_MB_MAX_PARALLEL_INIT);
+	works = kcalloc(nr, sizeof(*works), GFP_KERNEL);
+	if (!works)
+		return;
+
+	next = ext4_mb_prefetch(sb, 0, nr, NULL);
+	for (group = 0; group < ngroups; group += nr) {
+		if (READ_ONCE(sbi->s_mb_pregen_stop))
+			break;
+		/* Keep the next batch of bitmaps in flight */
+		if (next)
+			next = ext4_mb_prefetch(sb, next, nr, NULL);
+		atomic_add(ext4_mb_init_groups(sb, works, group,
+					       min_t(ext4_group_t, nr,
+						     ngroups - group), 1),
+			   &sbi->s_mb_pregen_groups);
+		cond_resched();
+	}
+	kfree(works);
+	atomic64_set(&sbi->s_mb_pregen_time, ktime_get_ns() - start);
+	ext4_debug("pregenerated %u buddies in %llu ns\n",
+		   atomic_read(&sbi->s_mb_pregen_groups),
+		   atomic64_read(&sbi->s_mb_pregen_time));
+}
+
+void ext4_mb_start_pregen(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	if (!sbi->s_mb_pregen || READ_ONCE(sbi->s_mb_pregen_stop))
+		return;
+	queue_work(system_unbound_wq, &sbi->s_mb_pregen_work);
+}
+
+void ext4_mb_stop_pregen(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	WRITE_ONCE(sbi->s_mb_pregen_stop, true);
+	flush_work(&sbi->s_mb_pregen_work);
+}
+
+static void ext4_mb_account_cr_time(struct ext4_sb_info *sbi,
+				    enum criteria cr, ktime_t start)
+{
+	if (sbi->s_mb_stats)
+		atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+			     &sbi->s_bal_cX_time[cr]);
+}
+
 static noinline_for_stack int
 ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 {
@@ -2803,6 +3108,7 @@ ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 	struct ext4_sb_info *sbi;
 	struct super_block *sb;
 	struct ext4_buddy e4b;
+	ktime_t cr_start = 0;
 	int lost;
 
 	sb = ac->ac_sb;
@@ -2842,13 +3148,15 @@ ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 							   MB_NUM_ORDERS(sb));
 	}
 
-	/* if stream allocation is enabled, use global goal */
+	/* if stream allocation is enabled, use the goal of the inode's slot */
 	if (ac->ac_flags & EXT4_MB_STREAM_ALLOC) {
-		/* TBD: may be hot point */
-		spin_lock(&sbi->s_md_lock);
-		ac->ac_g_ex.fe_group = sbi->s_mb_last_group;
-		ac->ac_g_ex.fe_start = sbi->s_mb_last_start;
-		spin_unlock(&sbi->s_md_lock);
+		struct ext4_mb_stream_goal *sg = ext4_mb_stream_goal(ac);
+		ext4_group_t goal_group = READ_ONCE(sg->sg_group);
+
+		if (goal_group < ext4_get_groups_count(sb)) {
+			ac->ac_g_ex.fe_group = goal_group;
+			ac->ac_g_ex.fe_start = READ_ONCE(sg->sg_start);
+		}
 	}
 
 	/*
@@ -2861,6 +3169,8 @@ ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 repeat:
 	for (; cr < EXT4_MB_NUM_CRS && ac->ac_status == AC_STATUS_CONTINUE; cr++) {
 		ac->ac_criteria = cr;
+		if (sbi->s_mb_stats)
+			cr_start = ktime_get();
 		/*
 		 * searching for the right group start
 		 * from the goal value specified
@@ -2876,6 +3186,7 @@ ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 
 			cond_resched();
 			if (new_cr != cr) {
+				ext4_mb_account_cr_time(sbi, cr, cr_start);
 				cr = new_cr;
 				goto repeat;
 			}
@@ -2899,6 +3210,12 @@ ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 							nr, &prefetch_ios);
 			}
 
+			if (sbi->s_mb_parallel_scan && !ext4_mb_cr_expensive(cr) &&
+			    ext4_mb_want_parallel_init(
+					ext4_get_group_info(sb, group),
+					ac->ac_g_ex.fe_len))
+				ext4_mb_parallel_init(ac, group, ngroups);
+
 			/* This now checks without needing the buddy page */
 			ret = ext4_mb_good_group_nolock(ac, group, cr);
 			if (ret <= 0) {
@@ -2949,6 +3266,7 @@ ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 			if (ac->ac_status != AC_STATUS_CONTINUE)
 				break;
 		}
+		ext4_mb_account_cr_time(sbi, cr, cr_start);
 		/* Processed all groups and haven't found blocks */
 		if (sbi->s_mb_stats && i == ngroups)
 			atomic64_inc(&sbi->s_bal_cX_failed[cr]);
@@ -3123,6 +3441,8 @@ int ext4_seq_mb_stats_show(struct seq_file *seq, void *offset)
 		   atomic_read(&sbi->s_bal_cX_ex_scanned[CR_POWER2_ALIGNED]));
 	seq_printf(seq, "\t\tuseless_loops: %llu\n",
 		   atomic64_read(&sbi->s_bal_cX_failed[CR_POWER2_ALIGNED]));
+	seq_printf(seq, "\t\ttime_us: %llu\n",
+		   div_u64(atomic64_read(&sbi->s_bal_cX_time[CR_POWER2_ALIGNED]), 1000));
 	seq_printf(seq, "\t\tbad_suggestions: %u\n",
 		   atomic_read(&sbi->s_bal_p2_aligned_bad_suggestions));
 
@@ -3137,6 +3457,8 @@ int ext4_seq_mb_stats_show(struct seq_file *seq, void *offset)
 		   atomic_read(&sbi->s_bal_cX_ex_scanned[CR_GOAL_LEN_FAST]));
 	seq_printf(seq, "\t\tuseless_loops: %llu\n",
 		   atomic64_read(&sbi->s_bal_cX_failed[CR_GOAL_LEN_FAST]));
+	seq_printf(seq, "\t\ttime_us: %llu\n",
+		   div_u64(atomic64_read(&sbi->s_bal_cX_time[CR_GOAL_LEN_FAST]), 1000));
 	seq_printf(seq, "\t\tbad_suggestions: %u\n",
 		   atomic_read(&sbi->s_bal_goal_fast_bad_suggestions));
 
@@ -3152,6 +3474,8 @@ int ext4_seq_mb_stats_show(struct seq_file *seq, void *offset)
 		   atomic_read(&sbi->s_bal_cX_ex_scanned[CR_BEST_AVAIL_LEN]));
 	seq_printf(seq, "\t\tuseless_loops: %llu\n",
 		   atomic64_read(&sbi->s_bal_cX_failed[CR_BEST_AVAIL_LEN]));
+	seq_printf(seq, "\t\ttime_us: %llu\n",
+		   div_u64(atomic64_read(&sbi->s_bal_cX_time[CR_BEST_AVAIL_LEN]), 1000));
 	seq_printf(seq, "\t\tbad_suggestions: %u\n",
 		   atomic_read(&sbi->s_bal_best_avail_bad_suggestions));
 
@@ -3166,6 +3490,8 @@ int ext4_seq_mb_stats_show(struct seq_file *seq, void *offset)
 		   atomic_read(&sbi->s_bal_cX_ex_scanned[CR_GOAL_LEN_SLOW]));
 	seq_printf(seq, "\t\tuseless_loops: %llu\n",
 		   atomic64_read(&sbi->s_bal_cX_failed[CR_GOAL_LEN_SLOW]));
+	seq_printf(seq, "\t\ttime_us: %llu\n",
+		   div_u64(atomic64_read(&sbi->s_bal_cX_time[CR_GOAL_LEN_SLOW]), 1000));
 
 	/* CR_ANY_FREE stats */
 	seq_puts(seq, "\tcr_any_free_stats:\n");
@@ -3178,6 +3504,8 @@ int ext4_seq_mb_stats_show(struct seq_file *seq, void *offset)
 		   atomic_read(&sbi->s_bal_cX_ex_scanned[CR_ANY_FREE]));
 	seq_printf(seq, "\t\tuseless_loops: %llu\n",
 		   atomic64_read(&sbi->s_bal_cX_failed[CR_ANY_FREE]));
+	seq_printf(seq, "\t\ttime_us: %llu\n",
+		   div_u64(atomic64_read(&sbi->s_bal_cX_time[CR_ANY_FREE]), 1000));
 
 	/* Aggregates */
 	seq_printf(seq, "\textents_scanned: %u\n",
@@ -3193,6 +3521,12 @@ int ext4_seq_mb_stats_show(struct seq_file *seq, void *offset)
 		   ext4_get_groups_count(sb));
 	seq_printf(seq, "\tbuddies_time_used: %llu\n",
 		   atomic64_read(&sbi->s_mb_generation_time));
+	seq_printf(seq, "\tparallel_inits: %u\n",
+		   atomic_read(&sbi->s_mb_parallel_inits));
+	seq_printf(seq, "\tpregenerated: %u\n",
+		   atomic_read(&sbi->s_mb_pregen_groups));
+	seq_printf(seq, "\tpregen_time_us: %llu\n",
+		   div_u64(atomic64_read(&sbi->s_mb_pregen_time), 1000));
 	seq_printf(seq, "\tpreallocated: %u\n",
 		   atomic_read(&sbi->s_mb_preallocated));
 	seq_printf(seq, "\tdiscarded: %u\n", atomic_read(&sbi->s_mb_discarded));
@@ -3222,6 +3556,28 @@ static void *ext4_mb_seq_structs_summary_next(struct seq_file *seq, void *v, lof
 	return (void *) ((unsigned long) position);
 }
 
+static void ext4_mb_seq_numa_show(struct seq_file *seq, struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_group_t start, end;
+	int node;
+
+	seq_printf(seq, "numa_groups: %u\n", READ_ONCE(sbi->s_mb_numa_groups));
+	if (!sbi->s_mb_numa_stats)
+		return;
+	for_each_node(node) {
+		struct ext4_mb_numa_stats *stats = &sbi->s_mb_numa_stats[node];
+
+		ext4_mb_numa_range(sb, node, &start, &end);
+		if (start >= end)
+			continue;
+		seq_printf(seq, "\tnode_%d: groups %u-%u allocs %lld remote %lld\n",
+			   node, start, end - 1,
+			   atomic64_read(&stats->nm_allocs),
+			   atomic64_read(&stats->nm_remote));
+	}
+}
+
 static int ext4_mb_seq_structs_summary_show(struct seq_file *seq, void *v)
 {
 	struct super_block *sb = pde_data(file_inode(seq->file));
@@ -3250,6 +3606,7 @@ static int ext4_mb_seq_structs_summary_show(struct seq_file *seq, void *v)
 	if (position == 0) {
 		seq_printf(seq, "optimize_scan: %d\n",
 			   test_opt2(sb, MB_OPTIMIZE_SCAN) ? 1 : 0);
+		ext4_mb_seq_numa_show(seq, sb);
 		seq_puts(seq, "max_free_order_lists:\n");
 	}
 	count = 0;
@@ -3374,6 +3731,11 @@ int ext4_mb_add_groupinfo(struct super_block *sb, ext4_group_t group,
 			ext4_free_group_clusters(sb, desc);
 	}
 
+	/* FITRIM left the group clean and nothing was freed since */
+	if (ext4_trimmed_bg_valid(sb) &&
+	    (desc->bg_flags & cpu_to_le16(EXT4_BG_TRIMMED)))
+		EXT4_MB_GRP_SET_TRIMMED(meta_group_info[i]);
+
 	INIT_LIST_HEAD(&meta_group_info[i]->bb_prealloc_list);
 	init_rwsem(&meta_group_info[i]->alloc_sem);
 	meta_group_info[i]->bb_free_root = RB_ROOT;
@@ -3538,21 +3900,232 @@ static int ext4_groupinfo_create_slab(size_t size)
 	return 0;
 }
 
+/*
+ * Online discard engine.
+ *
+ * With -o discard, the extents freed by a commit are queued on
+ * s_discard_list and discarded from a worker, so discards never sit on the
+ * commit path.  The worker sorts what has accumulated, across however many
+ * transactions, merges adjacent extents, skips extents shorter than
+ * discard_min_blocks and issues up to EXT4_DISCARD_BATCH discards of a
+ * group at once, keeping them busy in the buddy until they complete.
+ * discard_max_kbps and discard_max_iops bound what is issued per second;
+ * over budget, the rest of the queue is put back and the worker comes back
+ * when the next window opens.
+ */
+#define EXT4_DISCARD_BATCH	32
+
+struct ext4_discard_batch {
+	unsigned int nr;
+	struct {
+		ext4_grpblk_t start;
+		ext4_grpblk_t len;
+	} ext[EXT4_DISCARD_BATCH];
+};
+
+static int ext4_discard_cmp(void *priv, const struct list_head *a,
+			    const struct list_head *b)
+{
+	struct ext4_free_data *fa, *fb;
+
+	fa = list_entry(a, struct ext4_free_data, efd_list);
+	fb = list_entry(b, struct ext4_free_data, efd_list);
+	if (fa->efd_group != fb->efd_group)
+		return fa->efd_group < fb->efd_group ? -1 : 1;
+	return fa->efd_start_cluster < fb->efd_start_cluster ? -1 :
+		fa->efd_start_cluster > fb->efd_start_cluster;
+}
+
+static void ext4_discard_dequeue(struct ext4_sb_info *sbi,
+				 struct ext4_free_data *fd)
+{
+	list_del(&fd->efd_list);
+	atomic_dec(&sbi->s_discard_queued);
+	atomic64_sub(fd->efd_count, &sbi->s_discard_pending);
+	kmem_cache_free(ext4_free_data_cachep, fd);
+}
+
+/* Merge adjacent or overlapping extents of a sorted discard list */
+static void ext4_discard_merge(struct ext4_sb_info *sbi,
+			       struct list_head *list)
+{
+	struct ext4_free_data *fd, *next;
+	ext4_grpblk_t end, old;
+
+	list_for_each_entry_safe(fd, next, list, efd_list) {
+		while (!list_is_head(&next->efd_list, list) &&
+		       next->efd_group == fd->efd_group &&
+		       next->efd_start_cluster <=
+				fd->efd_start_cluster + fd->efd_count) {
+			struct ext4_free_data *tmp = next;
+
+			next = list_next_entry(next, efd_list);
+			end = max(fd->efd_start_cluster + fd->efd_count,
+				  tmp->efd_start_cluster + tmp->efd_count);
+			old = fd->efd_count;
+			fd->efd_count = end - fd->efd_start_cluster;
+			atomic64_add(fd->efd_count - old, &sbi->s_discard_pending);
+			ext4_discard_dequeue(sbi, tmp);
+		}
+	}
+}
+
+/* Returns the jiffies to wait if the discard budget is exhausted */
+static unsigned long ext4_discard_throttle(struct ext4_sb_info *sbi)
+{
+	unsigned int kbps = READ_ONCE(sbi->s_discard_max_kbps);
+	unsigned int iops = READ_ONCE(sbi->s_discard_max_iops);
+
+	if (!kbps && !iops)
+		return 0;
+	if (time_after_eq(jiffies, sbi->s_discard_window + HZ)) {
+		sbi->s_discard_window = jiffies;
+		sbi->s_discard_window_bytes = 0;
+		sbi->s_discard_window_ios = 0;
+		return 0;
+	}
+	if ((kbps && sbi->s_discard_window_bytes >= (u64)kbps << 10) ||
+	    (iops && sbi->s_discard_window_ios >= iops))
+		return max(sbi->s_discard_window + HZ - jiffies, 1UL);
+	return 0;
+}
+
+/*
+ * Give the extents of the batch back to the buddy without discarding them.
+ * Called with the group locked.
+ */
+static void ext4_discard_batch_drop(struct ext4_buddy *e4b,
+				    struct ext4_discard_batch *batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->nr; i++)
+		mb_free_blocks(NULL, e4b, batch->ext[i].start,
+			       batch->ext[i].len);
+	batch->nr = 0;
+}
+
+/*
+ * Issue the discards of the batch and wait for them, then give the extents
+ * back to the buddy.  Called and returns with the group locked.
+ */
+static int ext4_discard_batch_flush(struct super_block *sb,
+				    struct ext4_buddy *e4b,
+				    struct ext4_discard_batch *batch)
+__releases(ext4_group_lock_ptr(sb, e4b->bd_group))
+__acquires(ext4_group_lock_ptr(sb, e4b->bd_group))
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_group_t group = e4b->bd_group;
+	struct bio *bio = NULL;
+	struct blk_plug plug;
+	unsigned int i;
+	int err = 0;
+
+	if (!batch->nr)
+		return 0;
+
+	ext4_unlock_group(sb, group);
+	blk_start_plug(&plug);
+	for (i = 0; i < batch->nr && !err; i++) {
+		ext4_fsblk_t block = EXT4_C2B(sbi, batch->ext[i].start) +
+				     ext4_group_first_block_no(sb, group);
+		unsigned int count = EXT4_C2B(sbi, batch->ext[i].len);
+
+		trace_ext4_discard_blocks(sb, block, count);
+		err = __blkdev_issue_discard(sb->s_bdev,
+				block << (sb->s_blocksize_bits - SECTOR_SHIFT),
+				(sector_t)count <<
+					(sb->s_blocksize_bits - SECTOR_SHIFT),
+				GFP_NOFS, &bio);
+		sbi->s_discard_window_bytes +=
+			(u64)count << sb->s_blocksize_bits;
+		sbi->s_discard_window_ios++;
+	}
+	if (bio) {
+		int ret = submit_bio_wait(bio);
+
+		if (!err)
+			err = ret;
+		bio_put(bio);
+	}
+	blk_finish_plug(&plug);
+	ext4_lock_group(sb, group);
+
+	ext4_discard_batch_drop(e4b, batch);
+	return err;
+}
+
+/*
+ * Discard the free extents of at least @minblocks clusters found between
+ * @start and @max.  Called and returns with the group locked.
+ */
+static int ext4_discard_range(struct super_block *sb, struct ext4_buddy *e4b,
+			      ext4_grpblk_t start, ext4_grpblk_t max,
+			      ext4_grpblk_t minblocks,
+			      struct ext4_discard_batch *batch)
+{
+	void *bitmap = e4b->bd_bitmap;
+	struct ext4_free_extent ex;
+	ext4_grpblk_t next;
+	int err;
+
+	if (unlikely(EXT4_MB_GRP_BBITMAP_CORRUPT(e4b->bd_info)))
+		return 0;
+
+	while (start <= max) {
+		start = mb_find_next_zero_bit(bitmap, max + 1, start);
+		if (start > max)
+			break;
+		next = mb_find_next_bit(bitmap, max + 1, start);
+		if (next - start >= minblocks) {
+			/* Keep it busy so that nobody reuses it meanwhile */
+			ex.fe_start = start;
+			ex.fe_group = e4b->bd_group;
+			ex.fe_len = next - start;
+			mb_mark_used(e4b, &ex);
+			batch->ext[batch->nr].start = start;
+			batch->ext[batch->nr].len = next - start;
+			if (++batch->nr == EXT4_DISCARD_BATCH) {
+				err = ext4_discard_batch_flush(sb, e4b, batch);
+				if (err)
+					return err;
+			}
+		}
+		start = next + 1;
+	}
+	return 0;
+}
+
 static void ext4_discard_work(struct work_struct *work)
 {
-	struct ext4_sb_info *sbi = container_of(work,
+	struct ext4_sb_info *sbi = container_of(to_delayed_work(work),
 			struct ext4_sb_info, s_discard_work);
 	struct super_block *sb = sbi->s_sb;
+	struct ext4_discard_batch *batch;
 	struct ext4_free_data *fd, *nfd;
 	struct ext4_buddy e4b;
 	LIST_HEAD(discard_list);
 	ext4_group_t grp, load_grp;
+	ext4_grpblk_t minblocks;
+	unsigned long delay;
 	int err = 0;
 
 	spin_lock(&sbi->s_md_lock);
 	list_splice_init(&sbi->s_discard_list, &discard_list);
 	spin_unlock(&sbi->s_md_lock);
 
+	list_sort(NULL, &discard_list, ext4_discard_cmp);
+	ext4_discard_merge(sbi, &discard_list);
+
+	minblocks = max(EXT4_NUM_B2C(sbi, READ_ONCE(sbi->s_discard_min_blocks)),
+			1U);
+	batch = kmalloc(sizeof(*batch), GFP_NOFS);
+	if (batch)
+		batch->nr = 0;
+	else
+		err = -ENOMEM;
+
 	load_grp = UINT_MAX;
 	list_for_each_entry_safe(fd, nfd, &discard_list, efd_list) {
 		/*
@@ -3561,6 +4134,27 @@ static void ext4_discard_work(struct work_struct *work)
 		 */
 		if ((sb->s_flags & SB_ACTIVE) && !err &&
 		    !atomic_read(&sbi->s_retry_alloc_pending)) {
+			delay = ext4_discard_throttle(sbi);
+			if (delay) {
+				/*
+				 * Extents of the group being processed are
+				 * marked used and their entries are already
+				 * gone, finish them before backing off.
+				 */
+				if (batch->nr) {
+					ext4_lock_group(sb, load_grp);
+					ext4_discard_batch_flush(sb, &e4b,
+								 batch);
+					ext4_unlock_group(sb, load_grp);
+				}
+				spin_lock(&sbi->s_md_lock);
+				list_splice(&discard_list, &sbi->s_discard_list);
+				spin_unlock(&sbi->s_md_lock);
+				queue_delayed_work(system_unbound_wq,
+						   &sbi->s_discard_work, delay);
+				break;
+			}
+
 			grp = fd->efd_group;
 			if (grp != load_grp) {
 				if (load_grp != UINT_MAX)
@@ -3568,7 +4162,7 @@ static void ext4_discard_work(struct work_struct *work)
 
 				err = ext4_mb_load_buddy(sb, grp, &e4b);
 				if (err) {
-					kmem_cache_free(ext4_free_data_cachep, fd);
+					ext4_discard_dequeue(sbi, fd);
 					load_grp = UINT_MAX;
 					continue;
 				} else {
@@ -3577,15 +4171,33 @@ static void ext4_discard_work(struct work_struct *work)
 			}
 
 			ext4_lock_group(sb, grp);
-			ext4_try_to_trim_range(sb, &e4b, fd->efd_start_cluster,
-						fd->efd_start_cluster + fd->efd_count - 1, 1);
+			err = ext4_discard_range(sb, &e4b, fd->efd_start_cluster,
+					fd->efd_start_cluster + fd->efd_count - 1,
+					minblocks, batch);
+			/* Flush before moving to another group */
+			if (list_is_last(&fd->efd_list, &discard_list) ||
+			    nfd->efd_group != grp || err) {
+				int ret = ext4_discard_batch_flush(sb, &e4b,
+								   batch);
+
+				if (!err)
+					err = ret;
+			}
 			ext4_unlock_group(sb, grp);
+			if (err == -EOPNOTSUPP)
+				err = 0;
+		} else if (batch && batch->nr) {
+			/* Giving up, make the held extents allocatable again */
+			ext4_lock_group(sb, load_grp);
+			ext4_discard_batch_drop(&e4b, batch);
+			ext4_unlock_group(sb, load_grp);
 		}
-		kmem_cache_free(ext4_free_data_cachep, fd);
+		ext4_discard_dequeue(sbi, fd);
 	}
 
 	if (load_grp != UINT_MAX)
 		ext4_mb_unload_buddy(&e4b);
+	kfree(batch);
 }
 
 int ext4_mb_init(struct super_block *sb)
@@ -3674,7 +4286,14 @@ int ext4_mb_init(struct super_block *sb)
 	INIT_LIST_HEAD(&sbi->s_freed_data_list[0]);
 	INIT_LIST_HEAD(&sbi->s_freed_data_list[1]);
 	INIT_LIST_HEAD(&sbi->s_discard_list);
-	INIT_WORK(&sbi->s_discard_work, ext4_discard_work);
+	INIT_DELAYED_WORK(&sbi->s_discard_work, ext4_discard_work);
+	atomic_set(&sbi->s_discard_queued, 0);
+	atomic64_set(&sbi->s_discard_pending, 0);
+	sbi->s_discard_min_blocks =
+		max(bdev_discard_granularity(sb->s_bdev) >> sb->s_blocksize_bits,
+		    1U);
+	sbi->s_discard_window = jiffies;
+	INIT_WORK(&sbi->s_mb_pregen_work, ext4_mb_pregen_work);
 	atomic_set(&sbi->s_retry_alloc_pending, 0);
 
 	sbi->s_mb_max_to_scan = MB_DEFAULT_MAX_TO_SCAN;
@@ -3711,6 +4330,10 @@ int ext4_mb_init(struct super_block *sb)
 			sbi->s_mb_group_prealloc, EXT4_NUM_B2C(sbi, sbi->s_stripe));
 	}
 
+	ret = ext4_mb_init_stream_goals(sb);
+	if (ret)
+		goto out;
+
 	sbi->s_locality_groups = alloc_percpu(struct ext4_locality_group);
 	if (sbi->s_locality_groups == NULL) {
 		ret = -ENOMEM;
@@ -3723,8 +4346,14 @@ int ext4_mb_init(struct super_block *sb)
 		for (j = 0; j < PREALLOC_TB_SIZE; j++)
 			INIT_LIST_HEAD(&lg->lg_prealloc_list[j]);
 		spin_lock_init(&lg->lg_prealloc_lock);
+		lg->lg_node = cpu_to_node(i);
 	}
 
+	/* Not fatal, the per-node stats are just not reported without it */
+	sbi->s_mb_numa_stats = kcalloc(nr_node_ids,
+				       sizeof(struct ext4_mb_numa_stats),
+				       GFP_KERNEL);
+
 	if (bdev_nonrot(sb->s_bdev))
 		sbi->s_mb_max_linear_groups = 0;
 	else
@@ -3737,9 +4366,13 @@ int ext4_mb_init(struct super_block *sb)
 	return 0;
 
 out_free_locality_groups:
+	kfree(sbi->s_mb_numa_stats);
+	sbi->s_mb_numa_stats = NULL;
 	free_percpu(sbi->s_locality_groups);
 	sbi->s_locality_groups = NULL;
 out:
+	kfree(sbi->s_mb_stream_goals);
+	sbi->s_mb_stream_goals = NULL;
 	kfree(sbi->s_mb_avg_fragment_size);
 	kfree(sbi->s_mb_avg_fragment_size_locks);
 	kfree(sbi->s_mb_largest_free_orders);
@@ -3777,13 +4410,12 @@ void ext4_mb_release(struct super_block *sb)
 	struct kmem_cache *cachep = get_groupinfo_cache(sb->s_blocksize_bits);
 	int count;
 
-	if (test_opt(sb, DISCARD)) {
-		/*
-		 * wait the discard work to drain all of ext4_free_data
-		 */
-		flush_work(&sbi->s_discard_work);
-		WARN_ON_ONCE(!list_empty(&sbi->s_discard_list));
-	}
+	/*
+	 * wait the discard work to drain all of ext4_free_data, even if
+	 * discard was turned off by a remount while some were queued
+	 */
+	flush_delayed_work(&sbi->s_discard_work);
+	WARN_ON_ONCE(!list_empty(&sbi->s_discard_list));
 
 	if (sbi->s_group_info) {
 		for (i = 0; i < ngroups; i++) {
@@ -3842,6 +4474,8 @@ void ext4_mb_release(struct super_block *sb)
 				atomic_read(&sbi->s_mb_discarded));
 	}
 
+	kfree(sbi->s_mb_numa_stats);
+	kfree(sbi->s_mb_stream_goals);
 	free_percpu(sbi->s_locality_groups);
 }
 
@@ -3922,12 +4556,17 @@ void ext4_process_freed_data(struct super_block *sb, tid_t commit_tid)
 		ext4_free_data_in_buddy(sb, entry);
 
 	if (test_opt(sb, DISCARD)) {
+		list_for_each_entry(entry, &freed_data_list, efd_list) {
+			atomic_inc(&sbi->s_discard_queued);
+			atomic64_add(entry->efd_count, &sbi->s_discard_pending);
+		}
 		spin_lock(&sbi->s_md_lock);
 		wake = list_empty(&sbi->s_discard_list);
 		list_splice_tail(&freed_data_list, &sbi->s_discard_list);
 		spin_unlock(&sbi->s_md_lock);
 		if (wake)
-			queue_work(system_unbound_wq, &sbi->s_discard_work);
+			queue_delayed_work(system_unbound_wq,
+					   &sbi->s_discard_work, 0);
 	} else {
 		list_for_each_entry_safe(entry, tmp, &freed_data_list, efd_list)
 			kmem_cache_free(ext4_free_data_cachep, entry);
@@ -4044,6 +4683,8 @@ ext4_mb_mark_context(handle_t *handle, struct super_block *sb, bool state,
 		mb_clear_bits(bitmap_bh->b_data, blkoff, len);
 		ext4_free_group_clusters_set(sb, gdp,
 			ext4_free_group_clusters(sb, gdp) + changed);
+		/* The freed clusters have not been discarded yet */
+		gdp->bg_flags &= cpu_to_le16(~EXT4_BG_TRIMMED);
 	}
 
 	ext4_block_bitmap_csum_set(sb, gdp, bitmap_bh);
@@ -5781,6 +6422,7 @@ static void ext4_mb_group_or_file(struct ext4_allocation_context *ac)
 
 	/* we're going to use group allocation */
 	ac->ac_flags |= EXT4_MB_HINT_GROUP_ALLOC;
+	ext4_mb_numa_goal(ac);
 
 	/* serialize all allocations in the group */
 	mutex_lock(&ac->ac_lg->lg_mutex);
@@ -6004,8 +6646,10 @@ static void ext4_mb_release_context(struct ext4_allocation_context *ac)
 		folio_put(ac->ac_bitmap_folio);
 	if (ac->ac_buddy_folio)
 		folio_put(ac->ac_buddy_folio);
-	if (ac->ac_flags & EXT4_MB_HINT_GROUP_ALLOC)
+	if (ac->ac_flags & EXT4_MB_HINT_GROUP_ALLOC) {
+		ext4_mb_numa_account(ac);
 		mutex_unlock(&ac->ac_lg->lg_mutex);
+	}
 	ext4_mb_collect_stats(ac);
 }
 
@@ -6594,6 +7238,12 @@ void ext4_free_blocks(handle_t *handle, struct inode *inode,
 	ext4_debug("freeing block %llu\n", block);
 	trace_ext4_free_blocks(inode, block, count, flags);
 
+	/* Blocks the active snapshot needs are moved to it, not freed */
+	if (ext4_snapshot_active(sb) &&
+	    !(flags & EXT4_FREE_BLOCKS_NO_SNAPSHOT) &&
+	    ext4_snapshot_free_blocks(handle, inode, bh, block, count, flags))
+		return;
+
 	if (bh && (flags & EXT4_FREE_BLOCKS_FORGET)) {
 		BUG_ON(count > 1);
 
@@ -6845,6 +7495,130 @@ __releases(ext4_group_lock_ptr(sb, e4b->bd_group))
 	return count;
 }
 
+/* The smallest extent FITRIM can be asked to discard on this device */
+static ext4_grpblk_t ext4_trim_min_clusters(struct super_block *sb)
+{
+	return max(EXT4_NUM_B2C(EXT4_SB(sb),
+		bdev_discard_granularity(sb->s_bdev) >> sb->s_blocksize_bits),
+		   1U);
+}
+
+/*
+ * Record in the group descriptor that all the free space of @group has
+ * been discarded, so that FITRIM keeps skipping it after a remount.  Any
+ * free in the group clears the flag again (see ext4_mb_mark_context()).
+ * Frees are reflected in the descriptor before they reach the buddy, at
+ * commit time, so the flag is only set when both agree on the free count
+ * and nothing is waiting for a commit to be given back.
+ *
+ * Kernels that predate the flag do not clear it, so it is only used with
+ * the trimmed_bg feature and trusted as described at ext4_trim_clear_stale().
+ */
+static void ext4_trim_persist(struct super_block *sb, ext4_group_t group)
+{
+	struct ext4_group_info *grp = ext4_get_group_info(sb, group);
+	struct ext4_group_desc *gdp;
+	struct buffer_head *gdp_bh;
+	handle_t *handle;
+	bool dirty = false;
+	int err;
+
+	if (!grp || sb_rdonly(sb) || !ext4_has_feature_trimmed_bg(sb))
+		return;
+	gdp = ext4_get_group_desc(sb, group, &gdp_bh);
+	if (!gdp || (gdp->bg_flags & cpu_to_le16(EXT4_BG_TRIMMED)))
+		return;
+
+	handle = ext4_journal_start_sb(sb, EXT4_HT_MISC, 1);
+	if (IS_ERR(handle))
+		return;
+	BUFFER_TRACE(gdp_bh, "get_write_access");
+	err = ext4_journal_get_write_access(handle, sb, gdp_bh, EXT4_JTR_NONE);
+	if (err)
+		goto out;
+
+	ext4_lock_group(sb, group);
+	if (EXT4_MB_GRP_WAS_TRIMMED(grp) && !grp->bb_free_root.rb_node &&
+	    ext4_free_group_clusters(sb, gdp) == grp->bb_free) {
+		gdp->bg_flags |= cpu_to_le16(EXT4_BG_TRIMMED);
+		ext4_group_desc_csum_set(sb, group, gdp);
+		dirty = true;
+	}
+	ext4_unlock_group(sb, group);
+	if (dirty)
+		ext4_handle_dirty_metadata(handle, NULL, gdp_bh);
+out:
+	ext4_journal_stop(handle);
+}
+
+/*
+ * EXT4_BG_TRIMMED flags are trusted while s_trim_mnt_count matches
+ * s_mnt_count, which ext4_setup_super() advances in step. Any mount by a
+ * kernel that does not know the flags, and a full e2fsck, changes
+ * s_mnt_count alone. Freed space may then carry the flag without having
+ * been discarded, so the flags are ignored for this mount and cleared here,
+ * once the snapshot, if any, is loaded, before they are trusted again.
+ */
+void ext4_trim_clear_stale(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_super_block *es = sbi->s_es;
+	ext4_group_t group, ngroups = ext4_get_groups_count(sb);
+	struct ext4_group_desc *gdp;
+	struct buffer_head *gdp_bh;
+	handle_t *handle;
+	int err = 0;
+
+	if (!ext4_has_feature_trimmed_bg(sb) || ext4_trimmed_bg_valid(sb))
+		return;
+
+	for (group = 0; group < ngroups && !err; group++) {
+		gdp = ext4_get_group_desc(sb, group, &gdp_bh);
+		if (!gdp || !(gdp->bg_flags & cpu_to_le16(EXT4_BG_TRIMMED)))
+			continue;
+		handle = ext4_journal_start_sb(sb, EXT4_HT_MISC, 1);
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+			break;
+		}
+		BUFFER_TRACE(gdp_bh, "get_write_access");
+		err = ext4_journal_get_write_access(handle, sb, gdp_bh,
+						    EXT4_JTR_NONE);
+		if (!err) {
+			ext4_lock_group(sb, group);
+			gdp->bg_flags &= cpu_to_le16(~EXT4_BG_TRIMMED);
+			ext4_group_desc_csum_set(sb, group, gdp);
+			ext4_unlock_group(sb, group);
+			err = ext4_handle_dirty_metadata(handle, NULL, gdp_bh);
+		}
+		ext4_journal_stop(handle);
+		cond_resched();
+	}
+	if (err)
+		goto out;
+
+	handle = ext4_journal_start_sb(sb, EXT4_HT_MISC, 1);
+	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
+		goto out;
+	}
+	BUFFER_TRACE(sbi->s_sbh, "get_write_access");
+	err = ext4_journal_get_write_access(handle, sb, sbi->s_sbh,
+					    EXT4_JTR_NONE);
+	if (!err) {
+		lock_buffer(sbi->s_sbh);
+		es->s_trim_mnt_count = es->s_mnt_count;
+		ext4_superblock_csum_set(sb);
+		unlock_buffer(sbi->s_sbh);
+		err = ext4_handle_dirty_metadata(handle, NULL, sbi->s_sbh);
+	}
+	ext4_journal_stop(handle);
+out:
+	/* Not fatal: the flags stay untrusted and are cleared next mount */
+	if (err)
+		ext4_warning(sb, "error %d clearing trimmed group flags", err);
+}
+
 /**
  * ext4_trim_all_free -- function to trim all free space in alloc. group
  * @sb:			super block for file system
@@ -6864,6 +7638,7 @@ ext4_trim_all_free(struct super_block *sb, ext4_group_t group,
 		   ext4_grpblk_t minblocks)
 {
 	struct ext4_buddy e4b;
+	bool persist = false;
 	int ret;
 
 	trace_ext4_trim_all_free(sb, group, start, max);
@@ -6878,20 +7653,161 @@ ext4_trim_all_free(struct super_block *sb, ext4_group_t group,
 	ext4_lock_group(sb, group);
 
 	if (!EXT4_MB_GRP_WAS_TRIMMED(e4b.bd_info) ||
-	    minblocks < EXT4_SB(sb)->s_last_trim_minblks)
+	    minblocks < EXT4_SB(sb)->s_last_trim_minblks) {
+		/*
+		 * A flag left by an earlier, coarser trim does not cover
+		 * this pass; only a complete pass may set it again.
+		 */
+		EXT4_MB_GRP_CLEAR_TRIMMED(e4b.bd_info);
 		ret = ext4_try_to_trim_range(sb, &e4b, start, max, minblocks);
-	else
+		persist = EXT4_MB_GRP_WAS_TRIMMED(e4b.bd_info) &&
+			  minblocks <= ext4_trim_min_clusters(sb);
+	} else
 		ret = 0;
 
 	ext4_unlock_group(sb, group);
 	ext4_mb_unload_buddy(&e4b);
 
+	if (persist)
+		ext4_trim_persist(sb, group);
+
 	ext4_debug("trimmed %d blocks in the group %d\n",
 		ret, group);
 
 	return ret;
 }
 
+/*
+ * FITRIM can trim several groups at once, trim_parallel of them, each in
+ * its own work item, and paces itself to trim_max_kbps of discarded space.
+ */
+#define EXT4_TRIM_MAX_PARALLEL	64
+
+struct ext4_trim_ctx {
+	struct super_block *sb;
+	ext4_group_t first_group, last_group;
+	ext4_grpblk_t first_cluster, last_cluster, minlen;
+	atomic64_t trimmed;		/* clusters */
+	u64 start_ns;
+	/* parallel trimming */
+	atomic_t next_group;
+	atomic_t pending;
+	struct completion done;
+	bool stop;
+	int err;
+};
+
+struct ext4_trim_work {
+	struct work_struct work;
+	struct ext4_trim_ctx *ctx;
+};
+
+/* Sleep while what was trimmed so far is ahead of the budget */
+static void ext4_trim_throttle(struct ext4_trim_ctx *ctx)
+{
+	struct super_block *sb = ctx->sb;
+	unsigned int kbps = READ_ONCE(EXT4_SB(sb)->s_trim_max_kbps);
+	u64 kbytes, due_ms, elapsed_ms;
+
+	if (!kbps)
+		return;
+	kbytes = (EXT4_C2B(EXT4_SB(sb), atomic64_read(&ctx->trimmed)) <<
+		  sb->s_blocksize_bits) >> 10;
+	due_ms = div_u64(kbytes * MSEC_PER_SEC, kbps);
+	elapsed_ms = div_u64(ktime_get_ns() - ctx->start_ns, NSEC_PER_MSEC);
+	if (due_ms > elapsed_ms)
+		msleep_interruptible(min_t(u64, due_ms - elapsed_ms,
+					   MSEC_PER_SEC));
+}
+
+static int ext4_trim_group(struct ext4_trim_ctx *ctx, ext4_group_t group)
+{
+	struct super_block *sb = ctx->sb;
+	struct ext4_group_info *grp;
+	ext4_grpblk_t start, end, cnt;
+	int ret;
+
+	grp = ext4_get_group_info(sb, group);
+	if (!grp)
+		return 0;
+	/* We only do this if the grp has never been initialized */
+	if (unlikely(EXT4_MB_GRP_NEED_INIT(grp))) {
+		ret = ext4_mb_init_group(sb, group, GFP_NOFS);
+		if (ret)
+			return ret;
+	}
+
+	/*
+	 * Only the first and the last groups of the range can be partial,
+	 * note that first_cluster and last_cluster are already computed by
+	 * ext4_get_group_no_and_offset().
+	 */
+	start = group == ctx->first_group ? ctx->first_cluster : 0;
+	end = group == ctx->last_group ? ctx->last_cluster :
+		EXT4_CLUSTERS_PER_GROUP(sb) - 1;
+	if (grp->bb_free >= ctx->minlen) {
+		cnt = ext4_trim_all_free(sb, group, start, end, ctx->minlen);
+		if (cnt < 0)
+			return cnt;
+		atomic64_add(cnt, &ctx->trimmed);
+		if (cnt)
+			ext4_trim_throttle(ctx);
+	}
+	return 0;
+}
+
+static void ext4_trim_work(struct work_struct *work)
+{
+	struct ext4_trim_ctx *ctx =
+		container_of(work, struct ext4_trim_work, work)->ctx;
+	ext4_group_t group;
+	int err;
+
+	while (!READ_ONCE(ctx->stop)) {
+		group = (ext4_group_t)atomic_inc_return(&ctx->next_group) - 1;
+		if (group > ctx->last_group || group < ctx->first_group)
+			break;
+		err = ext4_trim_group(ctx, group);
+		if (err) {
+			cmpxchg(&ctx->err, 0, err);
+			WRITE_ONCE(ctx->stop, true);
+		}
+	}
+	if (atomic_dec_and_test(&ctx->pending))
+		complete(&ctx->done);
+}
+
+/* Returns -EAGAIN if the groups have to be trimmed by the caller instead */
+static int ext4_trim_groups_parallel(struct ext4_trim_ctx *ctx,
+				     unsigned int nr)
+{
+	struct ext4_trim_work *works;
+	unsigned int i;
+
+	works = kcalloc(nr, sizeof(*works), GFP_KERNEL);
+	if (!works)
+		return -EAGAIN;
+
+	atomic_set(&ctx->next_group, ctx->first_group);
+	atomic_set(&ctx->pending, nr);
+	init_completion(&ctx->done);
+	ctx->stop = false;
+	ctx->err = 0;
+	for (i = 0; i < nr; i++) {
+		INIT_WORK(&works[i].work, ext4_trim_work);
+		works[i].ctx = ctx;
+		queue_work(system_unbound_wq, &works[i].work);
+	}
+
+	/* The workers finish the group they are on once told to stop */
+	while (!wait_for_completion_timeout(&ctx->done, HZ / 10))
+		if (ext4_trim_interrupted())
+			WRITE_ONCE(ctx->stop, true);
+
+	kfree(works);
+	return ctx->err;
+}
+
 /**
  * ext4_trim_fs() -- trim ioctl handle function
  * @sb:			superblock for filesystem
@@ -6907,9 +7823,9 @@ ext4_trim_all_free(struct super_block *sb, ext4_group_t group,
 int ext4_trim_fs(struct super_block *sb, struct fstrim_range *range)
 {
 	unsigned int discard_granularity = bdev_discard_granularity(sb->s_bdev);
-	struct ext4_group_info *grp;
-	ext4_group_t group, first_group, last_group;
-	ext4_grpblk_t cnt = 0, first_cluster, last_cluster;
+	struct ext4_trim_ctx ctx;
+	ext4_group_t group, first_group, last_group, nr;
+	ext4_grpblk_t first_cluster, last_cluster;
 	uint64_t start, end, minlen, trimmed = 0;
 	ext4_fsblk_t first_data_blk =
 			le32_to_cpu(EXT4_SB(sb)->s_es->s_first_data_block);
@@ -6945,46 +7861,33 @@ int ext4_trim_fs(struct super_block *sb, struct fstrim_range *range)
 	ext4_get_group_no_and_offset(sb, (ext4_fsblk_t) end,
 				     &last_group, &last_cluster);
 
-	/* end now represents the last cluster to discard in this group */
-	end = EXT4_CLUSTERS_PER_GROUP(sb) - 1;
-
-	for (group = first_group; group <= last_group; group++) {
-		if (ext4_trim_interrupted())
-			break;
-		grp = ext4_get_group_info(sb, group);
-		if (!grp)
-			continue;
-		/* We only do this if the grp has never been initialized */
-		if (unlikely(EXT4_MB_GRP_NEED_INIT(grp))) {
-			ret = ext4_mb_init_group(sb, group, GFP_NOFS);
-			if (ret)
+	ctx.sb = sb;
+	ctx.first_group = first_group;
+	ctx.last_group = last_group;
+	ctx.first_cluster = first_cluster;
+	ctx.last_cluster = last_cluster;
+	ctx.minlen = minlen;
+	ctx.start_ns = ktime_get_ns();
+	atomic64_set(&ctx.trimmed, 0);
+
+	nr = min3(READ_ONCE(EXT4_SB(sb)->s_trim_parallel),
+		  last_group - first_group + 1,
+		  (ext4_group_t)EXT4_TRIM_MAX_PARALLEL);
+	if (nr > 1)
+		ret = ext4_trim_groups_parallel(&ctx, nr);
+	else
+		ret = -EAGAIN;
+	if (ret == -EAGAIN) {
+		ret = 0;
+		for (group = first_group; group <= last_group; group++) {
+			if (ext4_trim_interrupted())
 				break;
-		}
-
-		/*
-		 * For all the groups except the last one, last cluster will
-		 * always be EXT4_CLUSTERS_PER_GROUP(sb)-1, so we only need to
-		 * change it for the last group, note that last_cluster is
-		 * already computed earlier by ext4_get_group_no_and_offset()
-		 */
-		if (group == last_group)
-			end = last_cluster;
-		if (grp->bb_free >= minlen) {
-			cnt = ext4_trim_all_free(sb, group, first_cluster,
-						 end, minlen);
-			if (cnt < 0) {
-				ret = cnt;
+			ret = ext4_trim_group(&ctx, group);
+			if (ret)
 				break;
-			}
-			trimmed += cnt;
 		}
-
-		/*
-		 * For every group except the first one, we are sure
-		 * that the first cluster to discard will be cluster #0.
-		 */
-		first_cluster = 0;
 	}
+	trimmed = atomic64_read(&ctx.trimmed);
 
 	if (!ret)
 		EXT4_SB(sb)->s_last_trim_minblks = minlen;
@@ -168,8 +168,28 @@ struct ext4_locality_group {
 	/* list of preallocations */
 	struct list_head	lg_prealloc_list[PREALLOC_TB_SIZE];
 	spinlock_t		lg_prealloc_lock;
+	/* NUMA node of the cpu owning this group */
+	int			lg_node;
 };
 
+/*
+ * Per-node statistics of locality group allocations bound to the node's
+ * range of groups (see mb_numa_groups).
+ */
+struct ext4_mb_numa_stats {
+	atomic64_t		nm_allocs;	/* bound allocations */
+	atomic64_t		nm_remote;	/* ... satisfied out of range */
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Goal for stream allocations, shared by the inodes hashing to it.  Only a
+ * hint, so it is read and updated without locking.
+ */
+struct ext4_mb_stream_goal {
+	ext4_group_t		sg_group;
+	ext4_grpblk_t		sg_start;
+} ____cacheline_aligned_in_smp;
+
 struct ext4_allocation_context {
 	struct inode *ac_inode;
 	struct super_block *ac_sb;
@@ -208,6 +228,9 @@ struct ext4_allocation_context {
 	struct folio *ac_buddy_folio;
 	struct ext4_prealloc_space *ac_pa;
 	struct ext4_locality_group *ac_lg;
+	/* groups [ac_numa_start, ac_numa_end) preferred by mb_numa_groups */
+	ext4_group_t ac_numa_start;
+	ext4_group_t ac_numa_end;
 };
 
 #define AC_STATUS_CONTINUE	1
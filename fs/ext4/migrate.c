@@ -322,6 +322,7 @@ static int ext4_ext_swap_inode_data(handle_t *handle, struct inode *inode,
 	 */
 	ext4_set_inode_flag(inode, EXT4_INODE_EXTENTS);
 	memcpy(ei->i_data, tmp_ei->i_data, sizeof(ei->i_data));
+	ext4_ext_tree_changed(inode);
 
 	/*
 	 * Update i_blocks with the new blocks that got
@@ -658,6 +659,7 @@ int ext4_ind_migrate(struct inode *inode)
 
 	ext4_clear_inode_flag(inode, EXT4_INODE_EXTENTS);
 	memset(ei->i_data, 0, sizeof(ei->i_data));
+	ext4_ext_tree_changed(inode);
 	for (i = start; i <= end; i++)
 		ei->i_data[i] = cpu_to_le32(blk++);
 	ret2 = ext4_mark_inode_dirty(handle, inode);
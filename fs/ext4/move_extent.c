@@ -135,6 +135,7 @@ mext_folio_double_lock(struct inode *inode1, struct inode *inode2,
 		mapping[1] = inode1->i_mapping;
 	}
 
+again:
 	flags = memalloc_nofs_save();
 	folio[0] = __filemap_get_folio(mapping[0], index1, FGP_WRITEBEGIN,
 			mapping_gfp_mask(mapping[0]));
@@ -145,12 +146,33 @@ mext_folio_double_lock(struct inode *inode1, struct inode *inode2,
 
 	folio[1] = __filemap_get_folio(mapping[1], index2, FGP_WRITEBEGIN,
 			mapping_gfp_mask(mapping[1]));
-	memalloc_nofs_restore(flags);
 	if (IS_ERR(folio[1])) {
+		memalloc_nofs_restore(flags);
 		folio_unlock(folio[0]);
 		folio_put(folio[0]);
 		return PTR_ERR(folio[1]);
 	}
+	/*
+	 * Extents are moved page by page, so split large folios the page
+	 * cache may hold for either file and look the pages up again.
+	 */
+	if (folio_test_large(folio[0]) || folio_test_large(folio[1])) {
+		int err = 0;
+
+		if (folio_test_large(folio[0]))
+			err = split_folio(folio[0]);
+		if (!err && folio_test_large(folio[1]))
+			err = split_folio(folio[1]);
+		memalloc_nofs_restore(flags);
+		folio_unlock(folio[0]);
+		folio_put(folio[0]);
+		folio_unlock(folio[1]);
+		folio_put(folio[1]);
+		if (err)
+			return err;
+		goto again;
+	}
+	memalloc_nofs_restore(flags);
 	/*
 	 * __filemap_get_folio() may not wait on folio's writeback if
 	 * BDI not demand that. But it is reasonable to be very conservative
@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * KUnit test of ext4 directory block scanning.
+ */
+
+#include <kunit/test.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+
+#include "ext4.h"
+
+#define NT_NAME_MAX		48
+#define NT_SEARCH_ROUNDS	2000
+
+struct nt_ctx {
+	struct super_block sb;
+	struct ext4_sb_info sbi;
+	struct ext4_super_block es;
+	struct inode dir;
+	char *buf;
+	unsigned int size;
+	unsigned int nr;
+	unsigned int *offsets;
+};
+
+static const char nt_chars[] = "abcdefghijklmnopqrstuvwxyz0123456789_.-";
+
+/*
+ * Fill the block with unique, randomly sized names.  The index is appended
+ * to every name so that a lookup of entry i can only ever return entry i.
+ */
+static void nt_fill_block(struct nt_ctx *ctx)
+{
+	unsigned int off = 0, prev = 0;
+	struct ext4_dir_entry_2 *de = NULL;
+	char name[NT_NAME_MAX + 16];
+	int len, i;
+
+	ctx->nr = 0;
+	while (1) {
+		unsigned int plen = get_random_u32_below(NT_NAME_MAX);
+
+		for (i = 0; i < plen; i++)
+			name[i] = nt_chars[get_random_u32_below(
+						sizeof(nt_chars) - 1)];
+		len = plen + snprintf(name + plen, sizeof(name) - plen, "%x",
+				      ctx->nr);
+		if (off + ext4_dir_rec_len(len, NULL) > ctx->size)
+			break;
+
+		de = (struct ext4_dir_entry_2 *)(ctx->buf + off);
+		de->inode = cpu_to_le32(ctx->nr + 12);
+		de->name_len = len;
+		de->file_type = EXT4_FT_REG_FILE;
+		memcpy(de->name, name, len);
+		de->rec_len = ext4_rec_len_to_disk(ext4_dir_rec_len(len, NULL),
+						   ctx->size);
+		ctx->offsets[ctx->nr++] = off;
+		prev = off;
+		off += ext4_dir_rec_len(len, NULL);
+	}
+	/* The last entry covers the rest of the block */
+	if (de)
+		de->rec_len = ext4_rec_len_to_disk(ctx->size - prev, ctx->size);
+}
+
+static int nt_init(struct kunit *test, unsigned int size)
+{
+	struct nt_ctx *ctx;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+	ctx->buf = kunit_kzalloc(test, size, GFP_KERNEL);
+	ctx->offsets = kunit_kcalloc(test, size / ext4_dir_rec_len(1, NULL) + 1,
+				     sizeof(*ctx->offsets), GFP_KERNEL);
+	if (!ctx->buf || !ctx->offsets)
+		return -ENOMEM;
+
+	ctx->size = size;
+	ctx->sb.s_blocksize = size;
+	ctx->sb.s_blocksize_bits = ilog2(size);
+	ctx->sb.s_fs_info = &ctx->sbi;
+	ctx->sbi.s_sb = &ctx->sb;
+	ctx->sbi.s_es = &ctx->es;
+	ctx->es.s_inodes_count = cpu_to_le32(U32_MAX);
+	ctx->dir.i_sb = &ctx->sb;
+	ctx->dir.i_mode = S_IFDIR;
+	nt_fill_block(ctx);
+
+	test->priv = ctx;
+	return 0;
+}
+
+static int nt_search(struct nt_ctx *ctx, const char *name, int len,
+		     struct ext4_dir_entry_2 **res)
+{
+	struct qstr q = QSTR_INIT(name, len);
+	struct ext4_filename fname = {
+		.usr_fname = &q,
+		.disk_name = { .name = (unsigned char *)name, .len = len },
+	};
+
+	return ext4_search_dir(NULL, ctx->buf, ctx->size, &ctx->dir, &fname,
+			       0, res);
+}
+
+static const unsigned int nt_block_sizes[] = { 4096, 65536 };
+
+static void nt_show_size(const unsigned int *size, char *desc)
+{
+	snprintf(desc, KUNIT_PARAM_DESC_SIZE, "blocksize=%u", *size);
+}
+KUNIT_ARRAY_PARAM(nt_sizes, nt_block_sizes, nt_show_size);
+
+static void test_search_dir_match(struct kunit *test)
+{
+	const unsigned int *size = test->param_value;
+	struct ext4_dir_entry_2 *de, *res;
+	struct nt_ctx *ctx;
+	char name[NT_NAME_MAX + 16];
+	int i, ret;
+
+	KUNIT_ASSERT_EQ(test, nt_init(test, *size), 0);
+	ctx = test->priv;
+	KUNIT_ASSERT_GT(test, ctx->nr, 0);
+
+	for (i = 0; i < ctx->nr; i++) {
+		de = (struct ext4_dir_entry_2 *)(ctx->buf + ctx->offsets[i]);
+		res = NULL;
+		ret = nt_search(ctx, de->name, de->name_len, &res);
+		KUNIT_EXPECT_EQ(test, ret, 1);
+		KUNIT_EXPECT_PTR_EQ(test, res, de);
+
+		/* Same name with the last byte changed must not match */
+		memcpy(name, de->name, de->name_len);
+		name[de->name_len - 1] = '!';
+		KUNIT_EXPECT_EQ(test, nt_search(ctx, name, de->name_len, &res),
+				0);
+	}
+
+	/* Deleted entries are skipped even if the name matches */
+	de = (struct ext4_dir_entry_2 *)(ctx->buf + ctx->offsets[0]);
+	de->inode = 0;
+	KUNIT_EXPECT_EQ(test, nt_search(ctx, de->name, de->name_len, &res), 0);
+}
+
+/*
+ * Compare the scan rate of ext4_search_dir() with a plain walk that calls
+ * ext4_match() on every entry, i.e. the scan without the prefilter.  The
+ * name looked up is absent, so every round walks the whole block.
+ */
+static void test_search_dir_cost(struct kunit *test)
+{
+	const unsigned int *size = test->param_value;
+	static const char absent[] = "this-name-is-not-there";
+	struct qstr q = QSTR_INIT(absent, sizeof(absent) - 1);
+	struct ext4_filename fname = {
+		.usr_fname = &q,
+		.disk_name = { .name = (unsigned char *)absent,
+			       .len = sizeof(absent) - 1 },
+	};
+	struct ext4_dir_entry_2 *de, *res;
+	struct nt_ctx *ctx;
+	u64 start, fast, slow;
+	unsigned int found = 0;
+	char *dlimit;
+	int i;
+
+	KUNIT_ASSERT_EQ(test, nt_init(test, *size), 0);
+	ctx = test->priv;
+	dlimit = ctx->buf + ctx->size;
+
+	start = ktime_get_ns();
+	for (i = 0; i < NT_SEARCH_ROUNDS; i++)
+		found += ext4_search_dir(NULL, ctx->buf, ctx->size, &ctx->dir,
+					 &fname, 0, &res);
+	fast = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	for (i = 0; i < NT_SEARCH_ROUNDS; i++) {
+		de = (struct ext4_dir_entry_2 *)ctx->buf;
+		while ((char *)de < dlimit - EXT4_BASE_DIR_LEN) {
+			if (de->name + de->name_len <= dlimit &&
+			    ext4_match(&ctx->dir, &fname, de))
+				found++;
+			de = (struct ext4_dir_entry_2 *)((char *)de +
+				ext4_rec_len_from_disk(de->rec_len,
+						       ctx->size));
+		}
+	}
+	slow = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, found, 0);
+	kunit_info(test, "%u entries: %llu entries/s prefiltered, %llu entries/s bytewise\n",
+		   ctx->nr,
+		   div64_u64((u64)ctx->nr * NT_SEARCH_ROUNDS * NSEC_PER_SEC,
+			     max(fast, 1ULL)),
+		   div64_u64((u64)ctx->nr * NT_SEARCH_ROUNDS * NSEC_PER_SEC,
+			     max(slow, 1ULL)));
+}
+
+static struct kunit_case nt_test_cases[] = {
+	KUNIT_CASE_PARAM(test_search_dir_match, nt_sizes_gen_params),
+	KUNIT_CASE_PARAM_ATTR(test_search_dir_cost, nt_sizes_gen_params,
+			      { .speed = KUNIT_SPEED_SLOW }),
+	{}
+};
+
+static struct kunit_suite nt_test_suite = {
+	.name = "ext4_namei_test",
+	.test_cases = nt_test_cases,
+};
+
+kunit_test_suites(&nt_test_suite);
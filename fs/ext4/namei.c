@@ -36,6 +36,8 @@
 #include <linux/bio.h>
 #include <linux/iversion.h>
 #include <linux/unicode.h>
+#include <linux/hash.h>
+#include <linux/unaligned.h>
 #include "ext4.h"
 #include "ext4_jbd2.h"
 
@@ -1481,6 +1483,56 @@ static bool ext4_match(struct inode *parent,
 	return fscrypt_match_name(&f, de->name, de->name_len);
 }
 
+/*
+ * Word-at-a-time prefilter for ext4_search_dir().  The eight bytes starting
+ * at de->rec_len hold rec_len, name_len, file_type and the first four bytes
+ * of the name, so a single unaligned load compared under a mask rejects
+ * nearly every non-matching entry without calling ext4_match().  Only used
+ * when the on-disk name is compared byte for byte against the lookup name,
+ * i.e. the directory is neither encrypted nor casefolded.
+ */
+#define EXT4_DIRENT_KEY_END	(offsetof(struct ext4_dir_entry_2, rec_len) + \
+				 sizeof(u64))
+
+struct ext4_dirent_key {
+	u64 key;
+	u64 mask;
+};
+
+static bool ext4_dirent_key_init(struct inode *dir,
+				 const struct ext4_filename *fname,
+				 struct ext4_dirent_key *k)
+{
+	u8 key[sizeof(u64)] = { 0 }, mask[sizeof(u64)] = { 0 };
+	unsigned int len = fname->disk_name.len;
+	unsigned int n = min(len, 4U);
+
+	if (IS_ENCRYPTED(dir) || IS_CASEFOLDED(dir) || !fname->disk_name.name)
+		return false;
+
+	/* Same layout as the on-disk entry starting at rec_len */
+	key[2] = len;
+	mask[2] = 0xff;
+	memcpy(key + 4, fname->disk_name.name, n);
+	memset(mask + 4, 0xff, n);
+	memcpy(&k->key, key, sizeof(k->key));
+	memcpy(&k->mask, mask, sizeof(k->mask));
+	return true;
+}
+
+/*
+ * Returns false only if @de certainly does not match the key.  Entries too
+ * close to @dlimit for the wide load fall back to the full comparison.
+ */
+static inline bool ext4_dirent_key_maybe(const struct ext4_dirent_key *k,
+					 struct ext4_dir_entry_2 *de,
+					 const char *dlimit)
+{
+	if (!k || (char *)de + EXT4_DIRENT_KEY_END > dlimit)
+		return true;
+	return !((get_unaligned((u64 *)&de->rec_len) ^ k->key) & k->mask);
+}
+
 /*
  * Returns 0 if not found, -EFSCORRUPTED on failure, and 1 on success
  */
@@ -1489,15 +1541,19 @@ int ext4_search_dir(struct buffer_head *bh, char *search_buf, int buf_size,
 		    unsigned int offset, struct ext4_dir_entry_2 **res_dir)
 {
 	struct ext4_dir_entry_2 * de;
+	struct ext4_dirent_key key, *kp = NULL;
 	char * dlimit;
 	int de_len;
 
+	if (ext4_dirent_key_init(dir, fname, &key))
+		kp = &key;
 	de = (struct ext4_dir_entry_2 *)search_buf;
 	dlimit = search_buf + buf_size;
 	while ((char *) de < dlimit - EXT4_BASE_DIR_LEN) {
 		/* this code is executed quadratically often */
 		/* do minimal checking `by hand' */
-		if (de->name + de->name_len <= dlimit &&
+		if (ext4_dirent_key_maybe(kp, de, dlimit) &&
+		    de->name + de->name_len <= dlimit &&
 		    ext4_match(dir, fname, de)) {
 			/* found a match - just to be sure, do
 			 * a full check */
@@ -1534,6 +1590,258 @@ static int is_dx_internal_node(struct inode *dir, ext4_lblk_t block,
 	return 0;
 }
 
+/*
+ * Negative lookup filter.  Build systems and package managers stat() lots
+ * of names that do not exist in huge directories, and every such miss
+ * costs a dx_probe() and a leaf scan.  An htree directory of at least
+ * dir_bloom_min_kb gets a bloom filter over the htree hashes of its names
+ * on its first lookup, and names the filter has never seen are reported
+ * missing without touching the directory.  New names are added to the
+ * filter.  Removed names cannot be, so the filter is dropped after enough
+ * removals (or additions beyond its sizing) and rebuilt on a later lookup.
+ * If building it fails, lookups go to the directory until it changes or
+ * EXT4_BLOOM_RETRY has passed.
+ *
+ * Lookups hold i_rwsem shared and only test bits.  Additions and removals
+ * hold it exclusively, so a filter is never freed under a lookup.
+ */
+#define EXT4_BLOOM_BITS_PER_NAME	10
+#define EXT4_BLOOM_PROBES		7
+#define EXT4_BLOOM_MAX_BITS_LOG		27
+#define EXT4_BLOOM_RETRY		(30 * HZ)
+
+struct ext4_dir_bloom {
+	int		db_hash_version;
+	u32		db_seed[4];
+	unsigned int	db_mask;	/* number of bits - 1 */
+	unsigned int	db_capacity;	/* names it was sized for */
+	atomic_t	db_nr;		/* names added */
+	atomic_t	db_removed;	/* names removed */
+	unsigned long	db_map[];
+};
+
+/* Placeholders while a lookup builds the filter and after that failed */
+static struct ext4_dir_bloom ext4_dir_bloom_building;
+static struct ext4_dir_bloom ext4_dir_bloom_failed;
+
+static inline bool ext4_dir_bloom_placeholder(struct ext4_dir_bloom *db)
+{
+	return db == &ext4_dir_bloom_building || db == &ext4_dir_bloom_failed;
+}
+
+static inline struct ext4_dir_bloom *ext4_dir_bloom_get(struct inode *dir)
+{
+	struct ext4_dir_bloom *db = smp_load_acquire(&EXT4_I(dir)->i_dir_bloom);
+
+	return ext4_dir_bloom_placeholder(db) ? NULL : db;
+}
+
+void ext4_dir_bloom_release(struct inode *dir)
+{
+	struct ext4_dir_bloom *db = xchg(&EXT4_I(dir)->i_dir_bloom, NULL);
+
+	if (db && !ext4_dir_bloom_placeholder(db))
+		kvfree(db);
+}
+
+/* The directory changed, a failed build may be retried right away */
+static inline void ext4_dir_bloom_changed(struct inode *dir)
+{
+	cmpxchg(&EXT4_I(dir)->i_dir_bloom, &ext4_dir_bloom_failed, NULL);
+}
+
+static bool ext4_dir_bloom_key(struct inode *dir, struct ext4_dir_bloom *db,
+			       const char *name, int len, u32 *h1, u32 *h2)
+{
+	struct dx_hash_info hinfo = {
+		.hash_version = db->db_hash_version,
+		.seed = db->db_seed,
+	};
+
+	if (ext4fs_dirhash(dir, name, len, &hinfo))
+		return false;
+	*h1 = hinfo.hash;
+	*h2 = hash_32(hinfo.hash ^ hinfo.minor_hash, 32) | 1;
+	return true;
+}
+
+static void ext4_dir_bloom_set(struct ext4_dir_bloom *db, u32 h1, u32 h2)
+{
+	int i;
+
+	for (i = 0; i < EXT4_BLOOM_PROBES; i++, h1 += h2)
+		set_bit(h1 & db->db_mask, db->db_map);
+}
+
+static bool ext4_dir_bloom_test(struct ext4_dir_bloom *db, u32 h1, u32 h2)
+{
+	int i;
+
+	for (i = 0; i < EXT4_BLOOM_PROBES; i++, h1 += h2)
+		if (!test_bit(h1 & db->db_mask, db->db_map))
+			return false;
+	return true;
+}
+
+/* Hash every name in the directory into a new filter */
+static struct ext4_dir_bloom *ext4_dir_bloom_build(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	ext4_lblk_t block, nblocks = dir->i_size >> sb->s_blocksize_bits;
+	struct ext4_dir_bloom hdr = { }, *db;
+	unsigned int nr = 0, size = 0, names, bits_log;
+	struct ext4_dir_entry_2 *de;
+	struct buffer_head *bh;
+	struct dx_root *root;
+	u32 *keys = NULL, *tmp;
+	char *top;
+	int i;
+
+	bh = ext4_read_dirblock(dir, 0, INDEX);
+	if (IS_ERR(bh))
+		return NULL;
+	root = (struct dx_root *)bh->b_data;
+	hdr.db_hash_version = root->info.hash_version;
+	if (hdr.db_hash_version <= DX_HASH_TEA)
+		hdr.db_hash_version += EXT4_SB(sb)->s_hash_unsigned;
+	memcpy(hdr.db_seed, EXT4_SB(sb)->s_hash_seed, sizeof(hdr.db_seed));
+	brelse(bh);
+
+	for (block = 1; block < nblocks; block++) {
+		cond_resched();
+		bh = ext4_read_dirblock(dir, block, DIRENT);
+		if (IS_ERR(bh))
+			goto fail;
+		if (!bh)
+			continue;
+		if (is_dx_internal_node(dir, block,
+					(struct ext4_dir_entry *)bh->b_data) ||
+		    ext4_check_all_de(dir, bh, bh->b_data, sb->s_blocksize)) {
+			brelse(bh);
+			continue;
+		}
+		top = bh->b_data + sb->s_blocksize;
+		for (de = (struct ext4_dir_entry_2 *)bh->b_data;
+		     (char *)de < top; de = ext4_next_entry(de, sb->s_blocksize)) {
+			if (!de->inode)
+				continue;
+			if (nr + 2 > size) {
+				size = max(size * 2, 1024U);
+				tmp = kvrealloc(keys, size * sizeof(u32),
+						GFP_KERNEL);
+				if (!tmp) {
+					brelse(bh);
+					goto fail;
+				}
+				keys = tmp;
+			}
+			if (ext4_dir_bloom_key(dir, &hdr, de->name,
+					       de->name_len, &keys[nr],
+					       &keys[nr + 1]))
+				nr += 2;
+		}
+		brelse(bh);
+	}
+
+	/* Leave room for the directory to double before we rebuild */
+	names = nr / 2;
+	hdr.db_capacity = max(names, 1024U);
+	bits_log = order_base_2(2 * hdr.db_capacity * EXT4_BLOOM_BITS_PER_NAME);
+	bits_log = min_t(unsigned int, bits_log, EXT4_BLOOM_MAX_BITS_LOG);
+	hdr.db_mask = (1U << bits_log) - 1;
+	db = kvzalloc(struct_size(db, db_map, BITS_TO_LONGS(1UL << bits_log)),
+		      GFP_KERNEL_ACCOUNT);
+	if (!db)
+		goto fail;
+	memcpy(db, &hdr, sizeof(hdr));
+	for (i = 0; i < nr; i += 2)
+		ext4_dir_bloom_set(db, keys[i], keys[i + 1]);
+	atomic_set(&db->db_nr, names);
+	kvfree(keys);
+	return db;
+fail:
+	kvfree(keys);
+	return NULL;
+}
+
+/*
+ * Return true if @fname is certainly not in @dir.  The first lookup of a
+ * large enough directory builds the filter, other lookups racing with it
+ * go to the directory.  So do lookups after a failed build, until
+ * i_dir_bloom_retry.
+ */
+static bool ext4_dir_bloom_absent(struct inode *dir,
+				  struct ext4_filename *fname, bool *tested)
+{
+	struct ext4_inode_info *ei = EXT4_I(dir);
+	struct ext4_dir_bloom *db;
+	unsigned int min_kb = EXT4_SB(dir->i_sb)->s_dir_bloom_min_kb;
+	u32 h1, h2;
+
+	*tested = false;
+	if (!min_kb || IS_ENCRYPTED(dir) ||
+	    dir->i_size < ((loff_t)min_kb << 10))
+		return false;
+	db = smp_load_acquire(&ei->i_dir_bloom);
+	if (!db || db == &ext4_dir_bloom_failed) {
+		if (db && time_before(jiffies, READ_ONCE(ei->i_dir_bloom_retry)))
+			return false;
+		if (cmpxchg(&ei->i_dir_bloom, db,
+			    &ext4_dir_bloom_building) != db)
+			return false;
+		db = ext4_dir_bloom_build(dir);
+		if (!db) {
+			WRITE_ONCE(ei->i_dir_bloom_retry,
+				   jiffies + EXT4_BLOOM_RETRY);
+			smp_store_release(&ei->i_dir_bloom,
+					  &ext4_dir_bloom_failed);
+			return false;
+		}
+		smp_store_release(&ei->i_dir_bloom, db);
+	} else if (db == &ext4_dir_bloom_building) {
+		return false;
+	}
+	if (!ext4_dir_bloom_key(dir, db, fname_name(fname), fname_len(fname),
+				&h1, &h2))
+		return false;
+	*tested = true;
+	if (ext4_dir_bloom_test(db, h1, h2))
+		return false;
+	percpu_counter_inc(&EXT4_SB(dir->i_sb)->s_dir_bloom_hits);
+	return true;
+}
+
+static void ext4_dir_bloom_add(struct inode *dir, struct ext4_filename *fname)
+{
+	struct ext4_dir_bloom *db = ext4_dir_bloom_get(dir);
+	u32 h1, h2;
+
+	if (!db) {
+		ext4_dir_bloom_changed(dir);
+		return;
+	}
+	if (atomic_inc_return(&db->db_nr) > 2 * db->db_capacity ||
+	    !ext4_dir_bloom_key(dir, db, fname_name(fname), fname_len(fname),
+				&h1, &h2)) {
+		ext4_dir_bloom_release(dir);
+		return;
+	}
+	ext4_dir_bloom_set(db, h1, h2);
+}
+
+static void ext4_dir_bloom_remove(struct inode *dir)
+{
+	struct ext4_dir_bloom *db = ext4_dir_bloom_get(dir);
+
+	if (!db) {
+		ext4_dir_bloom_changed(dir);
+		return;
+	}
+	/* Stale bits only cost false positives; rebuild when they pile up */
+	if (atomic_inc_return(&db->db_removed) > atomic_read(&db->db_nr) / 2)
+		ext4_dir_bloom_release(dir);
+}
+
 /*
  *	__ext4_find_entry()
  *
@@ -1561,6 +1869,7 @@ static struct buffer_head *__ext4_find_entry(struct inode *dir,
 				   buffer */
 	ext4_lblk_t  nblocks;
 	int i, namelen, retval;
+	bool filtered;
 
 	*res_dir = NULL;
 	sb = dir->i_sb;
@@ -1589,7 +1898,11 @@ static struct buffer_head *__ext4_find_entry(struct inode *dir,
 		goto restart;
 	}
 	if (is_dx(dir)) {
+		if (ext4_dir_bloom_absent(dir, fname, &filtered))
+			goto cleanup_and_exit;
 		ret = ext4_dx_find_entry(dir, fname, res_dir);
+		if (filtered && !ret)
+			percpu_counter_inc(&EXT4_SB(sb)->s_dir_bloom_misses);
 		/*
 		 * On success, or if the error was file not found,
 		 * return.  Otherwise, fall back to doing a search the
@@ -2177,6 +2490,8 @@ static int add_dirent_to_buf(handle_t *handle, struct ext4_filename *fname,
 	inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
 	ext4_update_dx_flag(dir);
 	inode_inc_iversion(dir);
+	ext4_dir_cache_invalidate(dir);
+	ext4_dir_bloom_add(dir, fname);
 	err2 = ext4_mark_inode_dirty(handle, dir);
 	BUFFER_TRACE(bh, "call ext4_handle_dirty_metadata");
 	err = ext4_handle_dirty_dirblock(handle, dir, bh);
@@ -2709,6 +3024,8 @@ int ext4_generic_delete_entry(struct inode *dir,
 			}
 
 			inode_inc_iversion(dir);
+			ext4_dir_cache_invalidate(dir);
+			ext4_dir_bloom_remove(dir);
 			return 0;
 		}
 		i += ext4_rec_len_from_disk(de->rec_len, blocksize);
@@ -2759,6 +3076,485 @@ static int ext4_delete_entry(handle_t *handle,
 	return err;
 }
 
+/*
+ * Directory shrinking.  With the dir_shrink mount option, removing a name
+ * from an htree leaf that is less than half full tries, in this order, to
+ * merge the leaf into a sibling under the same index node, to merge its
+ * index node into a sibling, or to pull the only child of the root back
+ * into the root.  At most one block is freed per unlink.  The freed block
+ * is refilled with the directory's last block and the directory is then
+ * truncated by one block, so it never has holes or unreferenced blocks.
+ */
+#define EXT4_DX_SHRINK_CREDITS	12
+
+static unsigned int dx_leaf_size(struct inode *dir)
+{
+	unsigned int size = dir->i_sb->s_blocksize;
+
+	if (ext4_has_metadata_csum(dir->i_sb))
+		size -= sizeof(struct ext4_dir_entry_tail);
+	return size;
+}
+
+/* Bytes needed by the live entries of a leaf; @first is set to the first */
+static unsigned int dx_leaf_used(struct inode *dir, struct buffer_head *bh,
+				 struct ext4_dir_entry_2 **first)
+{
+	unsigned int blocksize = dir->i_sb->s_blocksize;
+	char *top = bh->b_data + dx_leaf_size(dir);
+	struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)bh->b_data;
+	unsigned int used = 0;
+
+	*first = NULL;
+	for (; (char *)de < top; de = ext4_next_entry(de, blocksize)) {
+		if (!de->inode)
+			continue;
+		if (!*first)
+			*first = de;
+		used += ext4_dir_rec_len(de->name_len, dir);
+	}
+	return used;
+}
+
+/* Pack the live entries of @bh at @to; @last is set to the last one copied */
+static char *dx_copy_live(struct inode *dir, char *to, struct buffer_head *bh,
+			  struct ext4_dir_entry_2 **last)
+{
+	unsigned int blocksize = dir->i_sb->s_blocksize;
+	char *top = bh->b_data + dx_leaf_size(dir);
+	struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)bh->b_data;
+	unsigned int rec_len;
+
+	for (; (char *)de < top; de = ext4_next_entry(de, blocksize)) {
+		if (!de->inode)
+			continue;
+		rec_len = ext4_dir_rec_len(de->name_len, dir);
+		memcpy(to, de, rec_len);
+		*last = (struct ext4_dir_entry_2 *)to;
+		(*last)->rec_len = ext4_rec_len_to_disk(rec_len, blocksize);
+		to += rec_len;
+	}
+	return to;
+}
+
+static int ext4_dx_name_hash(struct inode *dir, const char *name, int len,
+			     struct dx_hash_info *hinfo)
+{
+	struct buffer_head *bh;
+	struct dx_root *root;
+
+	bh = ext4_read_dirblock(dir, 0, INDEX);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	root = (struct dx_root *)bh->b_data;
+	hinfo->hash_version = root->info.hash_version;
+	if (hinfo->hash_version <= DX_HASH_TEA)
+		hinfo->hash_version += EXT4_SB(dir->i_sb)->s_hash_unsigned;
+	hinfo->seed = EXT4_SB(dir->i_sb)->s_hash_seed;
+	brelse(bh);
+	return ext4fs_dirhash(dir, name, len, hinfo);
+}
+
+static ext4_lblk_t ext4_dir_last_block(struct inode *dir)
+{
+	return (dir->i_size >> dir->i_sb->s_blocksize_bits) - 1;
+}
+
+/*
+ * Check that the last block of the directory is a leaf we can find through
+ * the index, and set @hinfo to the hash that leads to it.
+ */
+static bool ext4_dx_last_movable(struct inode *dir, struct dx_hash_info *hinfo)
+{
+	ext4_lblk_t last = ext4_dir_last_block(dir);
+	struct dx_frame frames[EXT4_HTREE_LEVEL], *frame;
+	struct ext4_dir_entry_2 *de;
+	struct buffer_head *bh;
+	bool ret = false;
+
+	bh = ext4_read_dirblock(dir, last, DIRENT_HTREE);
+	if (IS_ERR(bh))
+		return false;
+	if (is_dx_internal_node(dir, last, (struct ext4_dir_entry *)bh->b_data) ||
+	    ext4_check_all_de(dir, bh, bh->b_data, dx_leaf_size(dir)))
+		goto out;
+	dx_leaf_used(dir, bh, &de);
+	if (!de || ext4fs_dirhash(dir, de->name, de->name_len, hinfo))
+		goto out;
+	frame = dx_probe(NULL, dir, hinfo, frames);
+	if (IS_ERR(frame))
+		goto out;
+	ret = dx_get_block(frame->at) == last;
+	dx_release(frames);
+out:
+	brelse(bh);
+	return ret;
+}
+
+/*
+ * Block @free is no longer referenced by the index.  Move the last block
+ * of the directory into it unless it is the last block itself, and cut
+ * the last block off.  The directory stays on the orphan list until
+ * ext4_dx_shrink_tail() has truncated it.
+ */
+static int ext4_dx_release_block(handle_t *handle, struct inode *dir,
+				 struct dx_hash_info *hinfo, ext4_lblk_t free,
+				 struct buffer_head *free_bh)
+{
+	struct super_block *sb = dir->i_sb;
+	ext4_lblk_t last = ext4_dir_last_block(dir);
+	struct dx_frame frames[EXT4_HTREE_LEVEL], *frame;
+	struct buffer_head *last_bh;
+	int err;
+
+	if (free != last) {
+		last_bh = ext4_read_dirblock(dir, last, DIRENT_HTREE);
+		if (IS_ERR(last_bh))
+			return PTR_ERR(last_bh);
+		frame = dx_probe(NULL, dir, hinfo, frames);
+		if (IS_ERR(frame)) {
+			brelse(last_bh);
+			return PTR_ERR(frame);
+		}
+		err = -EFSCORRUPTED;
+		if (dx_get_block(frame->at) != last) {
+			ext4_warning_inode(dir,
+				"lost index entry of block %u while shrinking",
+				last);
+			goto out;
+		}
+		BUFFER_TRACE(free_bh, "get_write_access");
+		err = ext4_journal_get_write_access(handle, sb, free_bh,
+						    EXT4_JTR_NONE);
+		if (err)
+			goto out;
+		BUFFER_TRACE(frame->bh, "get_write_access");
+		err = ext4_journal_get_write_access(handle, sb, frame->bh,
+						    EXT4_JTR_NONE);
+		if (err)
+			goto out;
+		memcpy(free_bh->b_data, last_bh->b_data, dx_leaf_size(dir));
+		if (ext4_has_metadata_csum(sb))
+			ext4_initialize_dirent_tail(free_bh, sb->s_blocksize);
+		dx_set_block(frame->at, free);
+		err = ext4_handle_dirty_dirblock(handle, dir, free_bh);
+		if (!err)
+			err = ext4_handle_dirty_dx_node(handle, dir, frame->bh);
+out:
+		dx_release(frames);
+		brelse(last_bh);
+		if (err)
+			return err;
+	}
+
+	err = ext4_orphan_add(handle, dir);
+	if (err)
+		return err;
+	ext4_set_inode_state(dir, EXT4_STATE_DIR_SHRINK);
+	i_size_write(dir, (loff_t)last << sb->s_blocksize_bits);
+	EXT4_I(dir)->i_disksize = dir->i_size;
+	ext4_fc_mark_ineligible(sb, EXT4_FC_REASON_DIR_SHRINK, handle);
+	return ext4_mark_inode_dirty(handle, dir);
+}
+
+/* Merge leaf @bh with a sibling under @frame.  Returns 1 if merged. */
+static int ext4_dx_merge_leaves(handle_t *handle, struct inode *dir,
+				struct dx_frame *frame, struct buffer_head *bh,
+				struct dx_hash_info *hinfo)
+{
+	struct super_block *sb = dir->i_sb;
+	unsigned int size = dx_leaf_size(dir);
+	struct dx_entry *entries = frame->entries, *left, *right;
+	struct buffer_head *bh2, *lbh, *rbh, *keep_bh, *free_bh;
+	ext4_lblk_t keep, free, last = ext4_dir_last_block(dir);
+	struct dx_hash_info lhinfo = *hinfo;
+	struct ext4_dir_entry_2 *de = NULL;
+	unsigned int count = dx_get_count(entries);
+	char *buf, *to;
+	int err = 0;
+
+	if (count < 2)
+		return 0;
+	left = frame->at > entries ? frame->at - 1 : frame->at;
+	right = left + 1;
+	bh2 = ext4_read_dirblock(dir, dx_get_block(left == frame->at ?
+						   right : left),
+				 DIRENT_HTREE);
+	if (IS_ERR(bh2))
+		return PTR_ERR(bh2);
+	lbh = left == frame->at ? bh : bh2;
+	rbh = left == frame->at ? bh2 : bh;
+	if (ext4_check_all_de(dir, bh2, bh2->b_data, size) ||
+	    dx_leaf_used(dir, bh, &de) + dx_leaf_used(dir, bh2, &de) > size)
+		goto out;
+
+	/* Keep whichever block is not the last one */
+	keep = dx_get_block(left);
+	free = dx_get_block(right);
+	keep_bh = lbh;
+	free_bh = rbh;
+	if (keep == last) {
+		swap(keep, free);
+		swap(keep_bh, free_bh);
+	}
+	if (free != last && !ext4_dx_last_movable(dir, &lhinfo))
+		goto out;
+
+	buf = kzalloc(sb->s_blocksize, GFP_NOFS);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+	de = NULL;
+	to = dx_copy_live(dir, buf, lbh, &de);
+	dx_copy_live(dir, to, rbh, &de);
+	if (!de)
+		de = (struct ext4_dir_entry_2 *)buf;
+	de->rec_len = ext4_rec_len_to_disk(buf + size - (char *)de,
+					   sb->s_blocksize);
+
+	BUFFER_TRACE(keep_bh, "get_write_access");
+	err = ext4_journal_get_write_access(handle, sb, keep_bh,
+					    EXT4_JTR_NONE);
+	if (err)
+		goto out_free;
+	BUFFER_TRACE(frame->bh, "get_write_access");
+	err = ext4_journal_get_write_access(handle, sb, frame->bh,
+					    EXT4_JTR_NONE);
+	if (err)
+		goto out_free;
+	memcpy(keep_bh->b_data, buf, size);
+	if (ext4_has_metadata_csum(sb))
+		ext4_initialize_dirent_tail(keep_bh, sb->s_blocksize);
+	dx_set_block(left, keep);
+	memmove(right, right + 1, (entries + count - right - 1) *
+				  sizeof(struct dx_entry));
+	dx_set_count(entries, count - 1);
+	err = ext4_handle_dirty_dirblock(handle, dir, keep_bh);
+	if (!err)
+		err = ext4_handle_dirty_dx_node(handle, dir, frame->bh);
+	if (!err)
+		err = ext4_dx_release_block(handle, dir, &lhinfo, free,
+					    free_bh);
+	if (!err)
+		err = 1;
+out_free:
+	kfree(buf);
+out:
+	brelse(bh2);
+	return err;
+}
+
+/* Merge the index node of @frame with a sibling.  Returns 1 if merged. */
+static int ext4_dx_merge_nodes(handle_t *handle, struct inode *dir,
+			       struct dx_frame *frame,
+			       struct dx_hash_info *hinfo)
+{
+	struct super_block *sb = dir->i_sb;
+	struct dx_frame *parent = frame - 1;
+	struct dx_entry *entries = parent->entries, *left, *right;
+	struct dx_entry *le, *re, *tmp, *ke;
+	struct buffer_head *bh2, *lbh, *rbh, *keep_bh, *free_bh;
+	ext4_lblk_t keep, free, last = ext4_dir_last_block(dir);
+	struct dx_hash_info lhinfo = *hinfo;
+	unsigned int count = dx_get_count(entries);
+	unsigned int c1, c2, limit = dx_node_limit(dir);
+	int err = 0;
+
+	if (count < 2)
+		return 0;
+	left = parent->at > entries ? parent->at - 1 : parent->at;
+	right = left + 1;
+	bh2 = ext4_read_dirblock(dir, dx_get_block(left == parent->at ?
+						   right : left), INDEX);
+	if (IS_ERR(bh2))
+		return PTR_ERR(bh2);
+	lbh = left == parent->at ? frame->bh : bh2;
+	rbh = left == parent->at ? bh2 : frame->bh;
+	le = ((struct dx_node *)lbh->b_data)->entries;
+	re = ((struct dx_node *)rbh->b_data)->entries;
+	c1 = dx_get_count(le);
+	c2 = dx_get_count(re);
+	if (dx_get_limit(le) != limit || dx_get_limit(re) != limit ||
+	    c1 + c2 > limit)
+		goto out;
+
+	keep = dx_get_block(left);
+	free = dx_get_block(right);
+	keep_bh = lbh;
+	free_bh = rbh;
+	if (keep == last) {
+		swap(keep, free);
+		swap(keep_bh, free_bh);
+	}
+	if (free != last && !ext4_dx_last_movable(dir, &lhinfo))
+		goto out;
+
+	tmp = kmalloc_array(c1 + c2, sizeof(struct dx_entry), GFP_NOFS);
+	if (!tmp) {
+		err = -ENOMEM;
+		goto out;
+	}
+	memcpy(tmp, le, c1 * sizeof(struct dx_entry));
+	memcpy(tmp + c1, re, c2 * sizeof(struct dx_entry));
+	/* the first entry of the right node takes its hash from the parent */
+	dx_set_hash(tmp + c1, dx_get_hash(right));
+
+	BUFFER_TRACE(keep_bh, "get_write_access");
+	err = ext4_journal_get_write_access(handle, sb, keep_bh,
+					    EXT4_JTR_NONE);
+	if (err)
+		goto out_free;
+	BUFFER_TRACE(parent->bh, "get_write_access");
+	err = ext4_journal_get_write_access(handle, sb, parent->bh,
+					    EXT4_JTR_NONE);
+	if (err)
+		goto out_free;
+	ke = ((struct dx_node *)keep_bh->b_data)->entries;
+	memcpy(ke, tmp, (c1 + c2) * sizeof(struct dx_entry));
+	dx_set_limit(ke, limit);
+	dx_set_count(ke, c1 + c2);
+	dx_set_block(left, keep);
+	memmove(right, right + 1, (entries + count - right - 1) *
+				  sizeof(struct dx_entry));
+	dx_set_count(entries, count - 1);
+	err = ext4_handle_dirty_dx_node(handle, dir, keep_bh);
+	if (!err)
+		err = ext4_handle_dirty_dx_node(handle, dir, parent->bh);
+	if (!err)
+		err = ext4_dx_release_block(handle, dir, &lhinfo, free,
+					    free_bh);
+	if (!err)
+		err = 1;
+out_free:
+	kfree(tmp);
+out:
+	brelse(bh2);
+	return err;
+}
+
+/* Drop one index level if the root has a single child that fits in it */
+static int ext4_dx_collapse_root(handle_t *handle, struct inode *dir,
+				 struct dx_hash_info *hinfo)
+{
+	struct dx_hash_info lhinfo = *hinfo;
+	struct buffer_head *root_bh, *child_bh = NULL;
+	struct dx_entry *entries, *centries;
+	struct dx_root *root;
+	unsigned int count, limit;
+	ext4_lblk_t child;
+	int err = 0;
+
+	root_bh = ext4_read_dirblock(dir, 0, INDEX);
+	if (IS_ERR(root_bh))
+		return PTR_ERR(root_bh);
+	root = (struct dx_root *)root_bh->b_data;
+	entries = (struct dx_entry *)(((char *)&root->info) +
+				      root->info.info_length);
+	if (!root->info.indirect_levels || dx_get_count(entries) != 1)
+		goto out;
+	child = dx_get_block(entries);
+	child_bh = ext4_read_dirblock(dir, child, INDEX);
+	if (IS_ERR(child_bh)) {
+		err = PTR_ERR(child_bh);
+		child_bh = NULL;
+		goto out;
+	}
+	centries = ((struct dx_node *)child_bh->b_data)->entries;
+	count = dx_get_count(centries);
+	limit = dx_get_limit(entries);
+	if (count > limit)
+		goto out;
+	if (child != ext4_dir_last_block(dir) &&
+	    !ext4_dx_last_movable(dir, &lhinfo))
+		goto out;
+
+	BUFFER_TRACE(root_bh, "get_write_access");
+	err = ext4_journal_get_write_access(handle, dir->i_sb, root_bh,
+					    EXT4_JTR_NONE);
+	if (err)
+		goto out;
+	memcpy(entries, centries, count * sizeof(struct dx_entry));
+	dx_set_limit(entries, limit);
+	dx_set_count(entries, count);
+	root->info.indirect_levels -= 1;
+	err = ext4_handle_dirty_dx_node(handle, dir, root_bh);
+	if (!err)
+		err = ext4_dx_release_block(handle, dir, &lhinfo, child,
+					    child_bh);
+	if (!err)
+		err = 1;
+out:
+	brelse(child_bh);
+	brelse(root_bh);
+	return err;
+}
+
+/*
+ * Called after @d_name was removed from leaf @bh of @dir, in the same
+ * handle.  Shrinking is best effort: if anything stands in the way, the
+ * directory is left as it is.
+ */
+static void ext4_dx_shrink(handle_t *handle, struct inode *dir,
+			   const struct qstr *d_name, struct buffer_head *bh)
+{
+	struct dx_frame frames[EXT4_HTREE_LEVEL], *frame;
+	struct ext4_dir_entry_2 *de;
+	struct dx_hash_info hinfo;
+	struct buffer_head *leaf;
+	int err;
+
+	if (!test_opt2(dir->i_sb, DIR_SHRINK) || !is_dx(dir) ||
+	    IS_ENCRYPTED(dir) || ext4_has_inline_data(dir))
+		return;
+	if (ext4_check_all_de(dir, bh, bh->b_data, dx_leaf_size(dir)) ||
+	    dx_leaf_used(dir, bh, &de) > dx_leaf_size(dir) / 2)
+		return;
+	if (ext4_journal_extend(handle, EXT4_DX_SHRINK_CREDITS, 0))
+		return;
+
+	err = ext4_dx_name_hash(dir, (const char *)d_name->name, d_name->len,
+				&hinfo);
+	if (err)
+		goto out;
+	frame = dx_probe(NULL, dir, &hinfo, frames);
+	if (IS_ERR(frame)) {
+		err = PTR_ERR(frame);
+		goto out;
+	}
+	/* A name in a hash collision chain may live past the probed leaf */
+	leaf = ext4_read_dirblock(dir, dx_get_block(frame->at), DIRENT_HTREE);
+	if (IS_ERR(leaf)) {
+		err = PTR_ERR(leaf);
+	} else {
+		if (leaf == bh)
+			err = ext4_dx_merge_leaves(handle, dir, frame, bh,
+						   &hinfo);
+		brelse(leaf);
+	}
+	if (!err && frame > frames)
+		err = ext4_dx_merge_nodes(handle, dir, frame, &hinfo);
+	dx_release(frames);
+	if (!err)
+		err = ext4_dx_collapse_root(handle, dir, &hinfo);
+out:
+	if (err < 0 && err != ERR_BAD_DX_DIR)
+		ext4_warning_inode(dir, "error %d shrinking directory", err);
+}
+
+/* Truncate what ext4_dx_shrink() cut off, outside of its handle */
+static void ext4_dx_shrink_tail(struct inode *dir)
+{
+	int err;
+
+	if (!ext4_test_inode_state(dir, EXT4_STATE_DIR_SHRINK))
+		return;
+	ext4_clear_inode_state(dir, EXT4_STATE_DIR_SHRINK);
+	err = ext4_truncate(dir);
+	if (err)
+		ext4_std_error(dir->i_sb, err);
+}
+
 /*
  * Set directory link count to 1 if nlinks > EXT4_LINK_MAX, or if nlinks == 2
  * since this indicates that nlinks count was previously 1 to avoid overflowing
@@ -3194,6 +3990,7 @@ static int ext4_rmdir(struct inode *dir, struct dentry *dentry)
 	retval = ext4_delete_entry(handle, dir, de, bh);
 	if (retval)
 		goto end_rmdir;
+	ext4_dx_shrink(handle, dir, &dentry->d_name, bh);
 	if (!EXT4_DIR_LINK_EMPTY(inode))
 		ext4_warning_inode(inode,
 			     "empty directory '%.*s' has too many links (%u)",
@@ -3229,6 +4026,7 @@ static int ext4_rmdir(struct inode *dir, struct dentry *dentry)
 	brelse(bh);
 	if (handle)
 		ext4_journal_stop(handle);
+	ext4_dx_shrink_tail(dir);
 	return retval;
 }
 
@@ -3279,6 +4077,8 @@ int __ext4_unlink(struct inode *dir, const struct qstr *d_name,
 		retval = ext4_delete_entry(handle, dir, de, bh);
 		if (retval)
 			goto out_handle;
+		if (dentry)
+			ext4_dx_shrink(handle, dir, d_name, bh);
 		inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
 		ext4_update_dx_flag(dir);
 		retval = ext4_mark_inode_dirty(handle, dir);
@@ -3300,6 +4100,7 @@ int __ext4_unlink(struct inode *dir, const struct qstr *d_name,
 		ext4_fc_track_unlink(handle, dentry);
 out_handle:
 	ext4_journal_stop(handle);
+	ext4_dx_shrink_tail(dir);
 out_bh:
 	brelse(bh);
 	return retval;
@@ -3312,6 +4113,10 @@ static int ext4_unlink(struct inode *dir, struct dentry *dentry)
 	if (unlikely(ext4_forced_shutdown(dir->i_sb)))
 		return -EIO;
 
+	/* The snapshot has to be deleted first */
+	if (ext4_snapshot_file(d_inode(dentry)))
+		return -EPERM;
+
 	trace_ext4_unlink_enter(dir, dentry);
 	/*
 	 * Initialize quotas before so that eventual writes go
@@ -3621,6 +4426,7 @@ static int ext4_rename_dir_finish(handle_t *handle, struct ext4_renament *ent,
 		return 0;
 
 	ent->parent_de->inode = cpu_to_le32(dir_ino);
+	ext4_dir_cache_invalidate(ent->inode);
 	BUFFER_TRACE(ent->dir_bh, "call ext4_handle_dirty_metadata");
 	if (!ent->dir_inlined) {
 		if (is_dx(ent->inode)) {
@@ -3655,6 +4461,7 @@ static int ext4_setent(handle_t *handle, struct ext4_renament *ent,
 	if (ext4_has_feature_filetype(ent->dir->i_sb))
 		ent->de->file_type = file_type;
 	inode_inc_iversion(ent->dir);
+	ext4_dir_cache_invalidate(ent->dir);
 	inode_set_mtime_to_ts(ent->dir, inode_set_ctime_current(ent->dir));
 	retval = ext4_mark_inode_dirty(handle, ent->dir);
 	BUFFER_TRACE(ent->bh, "call ext4_handle_dirty_metadata");
@@ -3829,6 +4636,9 @@ static int ext4_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 			EXT4_I(old_dentry->d_inode)->i_projid)))
 		return -EXDEV;
 
+	if (new.inode && ext4_snapshot_file(new.inode))
+		return -EPERM;
+
 	retval = dquot_initialize(old.dir);
 	if (retval)
 		return retval;
@@ -4249,3 +5059,7 @@ const struct inode_operations ext4_special_inode_operations = {
 	.get_inode_acl	= ext4_get_acl,
 	.set_acl	= ext4_set_acl,
 };
+
+#ifdef CONFIG_EXT4_KUNIT_TESTS
+#include "namei-test.c"
+#endif
@@ -4,6 +4,8 @@
 #include <linux/fs.h>
 #include <linux/quotaops.h>
 #include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
 
 #include "ext4.h"
 #include "ext4_jbd2.h"
@@ -360,6 +362,99 @@ static void ext4_process_orphan(struct inode *inode,
 	iput(inode);  /* The delete magic happens here! */
 }
 
+/*
+ * Upper bound on the number of workers processing orphan file blocks during
+ * ext4_orphan_cleanup().
+ */
+#define EXT4_ORPHAN_CLEANUP_MAX_WORKERS	8
+
+struct ext4_orphan_worker {
+	struct work_struct	ow_work;
+	struct super_block	*ow_sb;
+	atomic_t		*ow_next_block;	/* next unclaimed orphan block */
+	int			ow_truncates;
+	int			ow_orphans;
+};
+
+/*
+ * Process the inodes of one orphan file block.  Every slot is owned by
+ * exactly one block, so blocks can be cleaned up independently.
+ */
+static void ext4_process_orphan_block(struct super_block *sb, int blk,
+				      int *nr_truncates, int *nr_orphans)
+{
+	struct ext4_orphan_info *oi = &EXT4_SB(sb)->s_orphan_info;
+	int inodes_per_ob = ext4_inodes_per_orphan_block(sb);
+	__le32 *bdata = (__le32 *)(oi->of_binfo[blk].ob_bh->b_data);
+	struct inode *inode;
+	int j;
+
+	for (j = 0; j < inodes_per_ob; j++) {
+		if (!bdata[j])
+			continue;
+		inode = ext4_orphan_get(sb, le32_to_cpu(bdata[j]));
+		if (IS_ERR(inode))
+			continue;
+		ext4_set_inode_state(inode, EXT4_STATE_ORPHAN_FILE);
+		EXT4_I(inode)->i_orphan_idx = blk * inodes_per_ob + j;
+		ext4_process_orphan(inode, nr_truncates, nr_orphans);
+	}
+}
+
+static void ext4_orphan_cleanup_work(struct work_struct *work)
+{
+	struct ext4_orphan_worker *ow =
+		container_of(work, struct ext4_orphan_worker, ow_work);
+	struct super_block *sb = ow->ow_sb;
+	int blk;
+
+	while ((blk = atomic_inc_return(ow->ow_next_block) - 1) <
+	       EXT4_SB(sb)->s_orphan_info.of_blocks)
+		ext4_process_orphan_block(sb, blk, &ow->ow_truncates,
+					  &ow->ow_orphans);
+}
+
+/*
+ * Orphan file blocks are cleaned up by a bounded number of unbound workers,
+ * each claiming one block at a time.  The inodes are independent of each
+ * other, and since ext4_orphan_file_add() spreads inodes over the blocks,
+ * a crash with many orphans usually leaves many blocks to work on.  Fall
+ * back to doing the work in the calling task if only one worker is useful
+ * or the worker array cannot be allocated.
+ */
+static void ext4_orphan_file_cleanup(struct super_block *sb,
+				     int *nr_truncates, int *nr_orphans)
+{
+	struct ext4_orphan_info *oi = &EXT4_SB(sb)->s_orphan_info;
+	struct ext4_orphan_worker *workers = NULL;
+	atomic_t next_block = ATOMIC_INIT(0);
+	int nr_workers, i;
+
+	nr_workers = min3(oi->of_blocks, (int)num_online_cpus(),
+			  EXT4_ORPHAN_CLEANUP_MAX_WORKERS);
+	if (nr_workers > 1)
+		workers = kcalloc(nr_workers, sizeof(*workers), GFP_KERNEL);
+	if (!workers) {
+		for (i = 0; i < oi->of_blocks; i++)
+			ext4_process_orphan_block(sb, i, nr_truncates,
+						  nr_orphans);
+		return;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		INIT_WORK(&workers[i].ow_work, ext4_orphan_cleanup_work);
+		workers[i].ow_sb = sb;
+		workers[i].ow_next_block = &next_block;
+		queue_work(system_unbound_wq, &workers[i].ow_work);
+	}
+	for (i = 0; i < nr_workers; i++) {
+		flush_work(&workers[i].ow_work);
+		*nr_truncates += workers[i].ow_truncates;
+		*nr_orphans += workers[i].ow_orphans;
+	}
+	kfree(workers);
+}
+
 /* ext4_orphan_cleanup() walks a singly-linked list of inodes (starting at
  * the superblock) which were deleted from all directories, but held open by
  * a process at the time of a crash.  We walk the list and try to delete these
@@ -376,19 +471,19 @@ static void ext4_process_orphan(struct inode *inode,
  * ext4_free_inode().  The only reason we would point at a wrong inode is if
  * e2fsck was run on this filesystem, and it must have already done the orphan
  * inode cleanup for us, so we can safely abort without any further action.
+ *
+ * The superblock list has to be walked in order, but inodes recorded in the
+ * orphan file are cleaned up in parallel, see ext4_orphan_file_cleanup().
  */
 void ext4_orphan_cleanup(struct super_block *sb, struct ext4_super_block *es)
 {
 	unsigned int s_flags = sb->s_flags;
 	int nr_orphans = 0, nr_truncates = 0;
 	struct inode *inode;
-	int i, j;
 #ifdef CONFIG_QUOTA
-	int quota_update = 0;
+	int i, quota_update = 0;
 #endif
-	__le32 *bdata;
 	struct ext4_orphan_info *oi = &EXT4_SB(sb)->s_orphan_info;
-	int inodes_per_ob = ext4_inodes_per_orphan_block(sb);
 
 	if (!es->s_last_orphan && !oi->of_blocks) {
 		ext4_debug("no orphan inodes to clean up\n");
@@ -474,19 +569,8 @@ void ext4_orphan_cleanup(struct super_block *sb, struct ext4_super_block *es)
 		ext4_process_orphan(inode, &nr_truncates, &nr_orphans);
 	}
 
-	for (i = 0; i < oi->of_blocks; i++) {
-		bdata = (__le32 *)(oi->of_binfo[i].ob_bh->b_data);
-		for (j = 0; j < inodes_per_ob; j++) {
-			if (!bdata[j])
-				continue;
-			inode = ext4_orphan_get(sb, le32_to_cpu(bdata[j]));
-			if (IS_ERR(inode))
-				continue;
-			ext4_set_inode_state(inode, EXT4_STATE_ORPHAN_FILE);
-			EXT4_I(inode)->i_orphan_idx = i * inodes_per_ob + j;
-			ext4_process_orphan(inode, &nr_truncates, &nr_orphans);
-		}
-	}
+	if (oi->of_blocks)
+		ext4_orphan_file_cleanup(sb, &nr_truncates, &nr_orphans);
 
 #define PLURAL(x) (x), ((x) == 1) ? "" : "s"
 
@@ -228,6 +228,8 @@ static void ext4_add_complete_io(ext4_io_end_t *io_end)
 	/* Only reserved conversions from writeback should enter here */
 	WARN_ON(!(io_end->flag & EXT4_IO_END_UNWRITTEN));
 	WARN_ON(!io_end->handle && sbi->s_journal);
+	io_end->queued = ktime_get();
+	atomic_inc(&sbi->s_rsv_conv_pending);
 	spin_lock_irqsave(&ei->i_completed_io_lock, flags);
 	wq = sbi->rsv_conversion_wq;
 	if (list_empty(&ei->i_rsv_conversion_list))
@@ -236,6 +238,15 @@ static void ext4_add_complete_io(ext4_io_end_t *io_end)
 	spin_unlock_irqrestore(&ei->i_completed_io_lock, flags);
 }
 
+/* Account a finished conversion queued by ext4_add_complete_io() */
+static void ext4_rsv_conv_done(struct ext4_sb_info *sbi, ktime_t queued)
+{
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), queued)),
+		     &sbi->s_rsv_conv_wait_ns);
+	atomic64_inc(&sbi->s_rsv_conv_done);
+	atomic_dec(&sbi->s_rsv_conv_pending);
+}
+
 static int ext4_do_flush_completed_IO(struct inode *inode,
 				      struct list_head *head)
 {
@@ -243,6 +254,8 @@ static int ext4_do_flush_completed_IO(struct inode *inode,
 	struct list_head unwritten;
 	unsigned long flags;
 	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+	ktime_t queued;
 	int err, ret = 0;
 
 	spin_lock_irqsave(&ei->i_completed_io_lock, flags);
@@ -255,7 +268,9 @@ static int ext4_do_flush_completed_IO(struct inode *inode,
 		BUG_ON(!(io_end->flag & EXT4_IO_END_UNWRITTEN));
 		list_del_init(&io_end->list);
 
+		queued = io_end->queued;
 		err = ext4_end_io_end(io_end);
+		ext4_rsv_conv_done(sbi, queued);
 		if (unlikely(!ret && err))
 			ret = err;
 	}
@@ -385,6 +400,7 @@ void ext4_io_submit_init(struct ext4_io_submit *io,
 	io->io_wbc = wbc;
 	io->io_bio = NULL;
 	io->io_end = NULL;
+	io->io_keep_in_use = false;
 }
 
 static void io_submit_init_bio(struct ext4_io_submit *io,
@@ -469,7 +485,9 @@ int ext4_bio_write_folio(struct ext4_io_submit *io, struct folio *folio,
 			continue;
 		}
 		if (!buffer_dirty(bh) || buffer_delay(bh) ||
-		    !buffer_mapped(bh) || buffer_unwritten(bh)) {
+		    !buffer_mapped(bh) || buffer_unwritten(bh) ||
+		    (io->io_keep_in_use &&
+		     ext4_snapshot_in_use(inode->i_sb, bh->b_blocknr))) {
 			/* A hole? We can safely clear the dirty bit */
 			if (!buffer_mapped(bh))
 				clear_buffer_dirty(bh);
@@ -479,7 +497,8 @@ int ext4_bio_write_folio(struct ext4_io_submit *io, struct folio *folio,
 			 * racing WB_SYNC_ALL writeback does not skip the folio.
 			 * This happens e.g. when doing writeout for
 			 * transaction commit or when journalled data is not
-			 * yet committed.
+			 * yet committed, or for blocks that must be moved to
+			 * the active snapshot before they are overwritten.
 			 */
 			if (buffer_dirty(bh) ||
 			    (buffer_jbd(bh) && buffer_jbddirty(bh))) {
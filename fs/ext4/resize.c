@@ -90,7 +90,15 @@ int ext4_resize_begin(struct super_block *sb)
 
 	if (test_and_set_bit_lock(EXT4_FLAGS_RESIZING,
 				  &sbi->s_ext4_flags))
-		ret = -EBUSY;
+		return -EBUSY;
+
+	/* Snapshot block numbers are bounded by the size at take time */
+	if (ext4_has_feature_has_snapshot(sb) || ext4_snapshot_active(sb) ||
+	    test_bit(EXT4_FLAGS_SNAPSHOT_UPDATE, &sbi->s_ext4_flags)) {
+		clear_bit_unlock(EXT4_FLAGS_RESIZING, &sbi->s_ext4_flags);
+		ext4_msg(sb, KERN_ERR, "Online resizing not supported with a snapshot");
+		ret = -EOPNOTSUPP;
+	}
 
 	return ret;
 }
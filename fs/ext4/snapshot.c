@@ -0,0 +1,1022 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * fs/ext4/snapshot.c
+ *
+ * Ext4 point-in-time snapshots.
+ */
+
+/*
+ * Ext4 Snapshots
+ * --------------
+ *
+ * A snapshot is a read-only regular file (EXT4_SNAPFILE_FL) whose logical
+ * block N holds the contents physical block N had when the snapshot was
+ * taken, so reading it yields an image of the whole file system at that
+ * point in time. Blocks which have not changed since then are holes in the
+ * snapshot file and are read straight from the device. There is at most one
+ * active snapshot, recorded in s_snapshot_inum.
+ *
+ * A block needs to be preserved if it was in use when the snapshot was
+ * taken and the snapshot does not map it yet. That is decided from the
+ * block bitmaps as they were at take time: bitmaps are metadata, so their
+ * old contents are preserved like any other block and can be found either
+ * in the snapshot or, if still unchanged, on disk. This is why no separate
+ * exclude bitmap is needed. Blocks are preserved in three places:
+ *
+ * - Copy-on-write: metadata (and the data of journalled inodes) is copied
+ *   into a newly allocated snapshot block from ext4_journal_get_write_access(),
+ *   in the same transaction as the change itself.
+ *
+ * - Move-on-write: regular file data is written in place, outside of the
+ *   journal. Instead of copying it, ext4_map_blocks() with
+ *   EXT4_GET_BLOCKS_MOVE_ON_WRITE hands the block over to the snapshot and
+ *   maps a new block into the file before it is overwritten.
+ *
+ * - Move-on-free: ext4_free_blocks() hands blocks which need preserving over
+ *   to the snapshot instead of freeing them. Blocks are mapped at their own
+ *   physical offset, so neighbouring blocks merge into one extent.
+ *
+ * Mapping a block into the snapshot allocates blocks and modifies bitmaps,
+ * group descriptors and the snapshot's extent tree, which in turn calls
+ * get_write_access on blocks that may need preserving. s_snapshot_mutex is
+ * held by the task doing copy-on-write (s_snapshot_cow_owner); nested calls
+ * from that task only stash the old contents in s_snapshot_pending, which
+ * is drained before the mutex is released. Nested calls must not look up
+ * the snapshot mapping since i_data_sem of the snapshot may be held, so a
+ * stashed block may turn out to be preserved already; it is then dropped.
+ *
+ * s_snapshot_mutex is only needed to preserve a block. Most journal
+ * accesses are to blocks that were free when the snapshot was taken or are
+ * preserved already; that is found out without the mutex, under
+ * s_snapshot_sem held shared, which keeps the active snapshot and its
+ * cached bitmaps alive.
+ *
+ * A snapshot is taken at a transaction boundary: with updates locked, the
+ * transaction recording it is committed, which writes out the data ordered
+ * by it, and the snapshot is activated before the next handle starts. Data
+ * which is still dirty then, or is dirtied through a mapping that was
+ * writable already, goes through move-on-write in writeback. Transaction
+ * commit cannot map blocks and leaves such buffers dirty: it only writes
+ * out blocks which were free when the snapshot was taken. The bitmaps of
+ * their groups are cached by ext4_snapshot_new_blocks() when they are
+ * allocated, so ext4_snapshot_in_use() can tell without blocking.
+ */
+
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/mount.h>
+#include <linux/quotaops.h>
+#include <linux/uio.h>
+#include <linux/xarray.h>
+
+#include "ext4.h"
+#include "ext4_jbd2.h"
+#include "ext4_extents.h"
+
+void ext4_snapshot_init(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	sbi->s_active_snapshot = NULL;
+	sbi->s_snapshot_cow_owner = NULL;
+	init_rwsem(&sbi->s_snapshot_sem);
+	mutex_init(&sbi->s_snapshot_mutex);
+	xa_init(&sbi->s_snapshot_pending);
+	xa_init(&sbi->s_snapshot_bitmaps);
+}
+
+/* Must be called with s_snapshot_sem held exclusively */
+static void ext4_snapshot_drop_bitmaps(struct ext4_sb_info *sbi)
+{
+	unsigned long group;
+	void *bitmap;
+
+	/* ext4_snapshot_in_use() looks them up under RCU */
+	xa_for_each(&sbi->s_snapshot_bitmaps, group, bitmap)
+		kfree_rcu_mightsleep(bitmap);
+	xa_destroy(&sbi->s_snapshot_bitmaps);
+}
+
+/*
+ * Look up block @block in @snap. Returns the number of blocks starting at
+ * @block which are mapped (and sets *@pblk), 0 for a hole with *@len set to
+ * its length, or a negative error.
+ */
+static int ext4_snapshot_lookup(struct inode *snap, ext4_fsblk_t block,
+				unsigned int *len, ext4_fsblk_t *pblk)
+{
+	struct ext4_map_blocks map;
+	int ret;
+
+	map.m_lblk = block;
+	map.m_len = *len;
+	ret = ext4_map_blocks(NULL, snap, &map, 0);
+	if (ret > 0 && !(map.m_flags & EXT4_MAP_MAPPED))
+		return -EFSCORRUPTED;
+	if (ret >= 0) {
+		*len = map.m_len;
+		if (pblk)
+			*pblk = map.m_pblk;
+	}
+	return ret;
+}
+
+/*
+ * Return the block bitmap of @group as it was when the snapshot was taken.
+ * In a nested call only cached or stashed bitmaps can be used; NULL is
+ * returned if there is none.
+ */
+static void *ext4_snapshot_bitmap(struct super_block *sb, struct inode *snap,
+				  ext4_group_t group, bool nested)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_group_desc *gdp;
+	struct buffer_head *bh;
+	ext4_fsblk_t bitmap_blk, pblk;
+	unsigned int len = 1;
+	void *bitmap;
+	int ret;
+
+	bitmap = xa_load(&sbi->s_snapshot_bitmaps, group);
+	if (bitmap)
+		return bitmap;
+
+	gdp = ext4_get_group_desc(sb, group, NULL);
+	if (!gdp)
+		return ERR_PTR(-EFSCORRUPTED);
+	bitmap_blk = ext4_block_bitmap(sb, gdp);
+
+	/*
+	 * A stashed copy may be newer than the snapshot if the bitmap was
+	 * preserved already. That is still safe to use, as blocks in use
+	 * when the snapshot was taken are never freed while it is active,
+	 * but it is not cached.
+	 */
+	bitmap = xa_load(&sbi->s_snapshot_pending, bitmap_blk);
+	if (bitmap || nested)
+		return bitmap;
+
+	ret = ext4_snapshot_lookup(snap, bitmap_blk, &len, &pblk);
+	if (ret < 0)
+		return ERR_PTR(ret);
+	if (ret > 0) {
+		bh = sb_bread(sb, pblk);
+		if (!bh)
+			return ERR_PTR(-EIO);
+	} else {
+		/* Neither preserved nor stashed, so it has not changed */
+		bh = ext4_read_block_bitmap(sb, group);
+		if (IS_ERR(bh))
+			return ERR_CAST(bh);
+	}
+
+	bitmap = kmemdup(bh->b_data, sb->s_blocksize, GFP_NOFS);
+	brelse(bh);
+	if (!bitmap)
+		return ERR_PTR(-ENOMEM);
+	ret = xa_err(xa_store(&sbi->s_snapshot_bitmaps, group, bitmap,
+			      GFP_NOFS));
+	if (ret) {
+		kfree(bitmap);
+		return ERR_PTR(ret);
+	}
+	return bitmap;
+}
+
+/*
+ * Find out whether @block must be preserved. Returns 1 if so, 0 if not and a
+ * negative error on failure. *@len is trimmed to the number of following
+ * blocks for which the answer is the same.
+ */
+static int ext4_snapshot_need_preserve(struct super_block *sb,
+				       struct inode *snap, ext4_fsblk_t block,
+				       unsigned int *len, bool nested)
+{
+	ext4_group_t group;
+	ext4_grpblk_t offset;
+	unsigned int n, max;
+	void *bitmap;
+	int in_use;
+
+	if (block >= ext4_blocks_count(EXT4_SB(sb)->s_es))
+		return 0;
+
+	ext4_get_group_no_and_offset(sb, block, &group, &offset);
+	max = min_t(unsigned int, *len, EXT4_BLOCKS_PER_GROUP(sb) - offset);
+	max = min_t(unsigned int, max, EXT_INIT_MAX_LEN);
+
+	bitmap = ext4_snapshot_bitmap(sb, snap, group, nested);
+	if (IS_ERR(bitmap))
+		return PTR_ERR(bitmap);
+	if (!bitmap) {
+		/* Nested call and the bitmap is unknown: be conservative */
+		*len = 1;
+		return 1;
+	}
+
+	in_use = ext4_test_bit(offset, bitmap) ? 1 : 0;
+	for (n = 1; n < max; n++)
+		if (!!ext4_test_bit(offset + n, bitmap) != in_use)
+			break;
+	*len = n;
+	if (!in_use || nested)
+		return in_use;
+
+	/* In use when the snapshot was taken, is it preserved already? */
+	in_use = ext4_snapshot_lookup(snap, block, len, NULL);
+	if (in_use < 0)
+		return in_use;
+	return in_use ? 0 : 1;
+}
+
+/*
+ * Check without s_snapshot_mutex whether @block obviously needs no
+ * preserving: it was free when the snapshot was taken, going by a cached
+ * bitmap, or the snapshot maps it already. Both stay true once seen.
+ * Returns false if the caller has to find out under the mutex.
+ */
+static bool ext4_snapshot_preserved(struct super_block *sb,
+				    struct inode *snap, ext4_fsblk_t block)
+{
+	ext4_group_t group;
+	ext4_grpblk_t offset;
+	unsigned int len = 1;
+	void *bitmap;
+
+	if (block >= ext4_blocks_count(EXT4_SB(sb)->s_es))
+		return true;
+
+	ext4_get_group_no_and_offset(sb, block, &group, &offset);
+	/* Only cached bitmaps are known to be from take time */
+	bitmap = xa_load(&EXT4_SB(sb)->s_snapshot_bitmaps, group);
+	if (!bitmap)
+		return false;
+	if (!ext4_test_bit(offset, bitmap))
+		return true;
+	return ext4_snapshot_lookup(snap, block, &len, NULL) > 0;
+}
+
+static int ext4_snapshot_stash(struct ext4_sb_info *sbi, ext4_fsblk_t block,
+			       const void *data, size_t size)
+{
+	void *copy;
+	int err;
+
+	/* The first stashed copy is the oldest one */
+	if (xa_load(&sbi->s_snapshot_pending, block))
+		return 0;
+	copy = kmemdup(data, size, GFP_NOFS);
+	if (!copy)
+		return -ENOMEM;
+	err = xa_err(xa_store(&sbi->s_snapshot_pending, block, copy,
+			      GFP_NOFS));
+	if (err)
+		kfree(copy);
+	return err;
+}
+
+static int ext4_snapshot_extend(handle_t *handle, struct super_block *sb)
+{
+	int needed = EXT4_SNAPSHOT_COW_TRANS_BLOCKS(sb);
+	int err;
+
+	if (jbd2_handle_buffer_credits(handle) >= needed)
+		return 0;
+	err = ext4_journal_extend(handle, needed, 0);
+	if (err > 0) {
+		ext4_warning(sb, "no journal credits left to preserve blocks "
+			     "in snapshot");
+		err = -ENOSPC;
+	}
+	return err;
+}
+
+/* Copy @data into a new block mapped at @block in @snap */
+static int ext4_snapshot_store(handle_t *handle, struct inode *snap,
+			       ext4_fsblk_t block, const void *data)
+{
+	struct super_block *sb = snap->i_sb;
+	struct ext4_map_blocks map;
+	struct buffer_head *bh;
+	int err;
+
+	err = ext4_snapshot_extend(handle, sb);
+	if (err)
+		return err;
+
+	map.m_lblk = block;
+	map.m_len = 1;
+	err = ext4_map_blocks(handle, snap, &map,
+			      EXT4_GET_BLOCKS_CREATE |
+			      EXT4_GET_BLOCKS_METADATA_NOFAIL |
+			      EXT4_GET_BLOCKS_NO_NORMALIZE);
+	if (err < 0)
+		return err;
+	/* Preserved behind our back by a nested call? Keep the older copy. */
+	if (!(map.m_flags & EXT4_MAP_NEW))
+		return 0;
+
+	bh = sb_getblk(sb, map.m_pblk);
+	if (unlikely(!bh))
+		return -ENOMEM;
+	lock_buffer(bh);
+	err = ext4_journal_get_create_access(handle, sb, bh, EXT4_JTR_NONE);
+	if (err) {
+		unlock_buffer(bh);
+		goto out;
+	}
+	memcpy(bh->b_data, data, sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	err = ext4_handle_dirty_metadata(handle, snap, bh);
+out:
+	brelse(bh);
+	return err;
+}
+
+/* Store all stashed blocks; storing one may stash more */
+static int ext4_snapshot_flush_pending(handle_t *handle, struct inode *snap)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(snap->i_sb);
+	unsigned long block = 0;
+	void *data;
+	int err = 0;
+
+	while ((data = xa_find(&sbi->s_snapshot_pending, &block, ULONG_MAX,
+			       XA_PRESENT))) {
+		xa_erase(&sbi->s_snapshot_pending, block);
+		if (!err)
+			err = ext4_snapshot_store(handle, snap, block, data);
+		kfree(data);
+		block = 0;
+	}
+	return err;
+}
+
+static int ext4_snapshot_cow(handle_t *handle, struct inode *snap,
+			     struct buffer_head *bh, bool nested)
+{
+	struct super_block *sb = snap->i_sb;
+	unsigned int len = 1;
+	int ret;
+
+	ret = ext4_snapshot_need_preserve(sb, snap, bh->b_blocknr, &len,
+					  nested);
+	if (ret <= 0)
+		return ret;
+	return ext4_snapshot_stash(EXT4_SB(sb), bh->b_blocknr, bh->b_data,
+				   sb->s_blocksize);
+}
+
+/*
+ * Called before @bh is modified under @handle: copy its current contents to
+ * the active snapshot if the snapshot needs them.
+ */
+int ext4_snapshot_get_write_access(handle_t *handle, struct super_block *sb,
+				   struct buffer_head *bh)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct inode *snap;
+	int err = 0, err2;
+
+	if (sbi->s_snapshot_cow_owner == current)
+		return ext4_snapshot_cow(handle, sbi->s_active_snapshot, bh,
+					 true);
+
+	down_read(&sbi->s_snapshot_sem);
+	snap = sbi->s_active_snapshot;
+	if (snap && !ext4_snapshot_preserved(sb, snap, bh->b_blocknr)) {
+		mutex_lock(&sbi->s_snapshot_mutex);
+		sbi->s_snapshot_cow_owner = current;
+		err = ext4_snapshot_cow(handle, snap, bh, false);
+		err2 = ext4_snapshot_flush_pending(handle, snap);
+		if (!err)
+			err = err2;
+		sbi->s_snapshot_cow_owner = NULL;
+		mutex_unlock(&sbi->s_snapshot_mutex);
+	}
+	up_read(&sbi->s_snapshot_sem);
+	return err;
+}
+
+/*
+ * @map describes mapped blocks of @inode about to be overwritten in place.
+ * Returns 1 if the first blocks must be moved to the active snapshot first,
+ * 0 if not, or a negative error. map->m_len is trimmed to the number of
+ * blocks for which the answer is the same.
+ */
+int ext4_snapshot_move_on_write(handle_t *handle, struct inode *inode,
+				struct ext4_map_blocks *map)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct inode *snap;
+	unsigned int len = map->m_len;
+	int ret = 0;
+
+	if (WARN_ON_ONCE(sbi->s_snapshot_cow_owner == current))
+		return -EDEADLK;
+
+	mutex_lock(&sbi->s_snapshot_mutex);
+	snap = sbi->s_active_snapshot;
+	if (snap) {
+		ret = ext4_snapshot_need_preserve(inode->i_sb, snap,
+						  map->m_pblk, &len, false);
+		if (ret >= 0)
+			map->m_len = len;
+	}
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	return ret;
+}
+
+/*
+ * @map describes blocks newly allocated to @inode which commit may write out
+ * as ordered data. Cache the take time bitmaps of their groups so that
+ * ext4_snapshot_in_use() sees that they were free.
+ */
+int ext4_snapshot_new_blocks(struct inode *inode, struct ext4_map_blocks *map)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_fsblk_t block = map->m_pblk;
+	ext4_fsblk_t end = block + map->m_len;
+	ext4_group_t group;
+	ext4_grpblk_t offset;
+	struct inode *snap;
+	void *bitmap;
+	int ret = 0;
+
+	if (WARN_ON_ONCE(sbi->s_snapshot_cow_owner == current))
+		return -EDEADLK;
+
+	mutex_lock(&sbi->s_snapshot_mutex);
+	snap = sbi->s_active_snapshot;
+	while (snap && block < end) {
+		ext4_get_group_no_and_offset(sb, block, &group, &offset);
+		bitmap = ext4_snapshot_bitmap(sb, snap, group, false);
+		if (IS_ERR(bitmap)) {
+			ret = PTR_ERR(bitmap);
+			break;
+		}
+		block += EXT4_BLOCKS_PER_GROUP(sb) - offset;
+	}
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	return ret;
+}
+
+/*
+ * Called from transaction commit for a dirty buffer of a regular file
+ * mapped at @block. Returns true if the block was in use when the snapshot
+ * was taken, so it has to go through move-on-write in writeback instead of
+ * being written in place. Blocks allocated since were passed to
+ * ext4_snapshot_new_blocks(), so a group without a cached bitmap has none.
+ */
+bool ext4_snapshot_in_use(struct super_block *sb, ext4_fsblk_t block)
+{
+	ext4_group_t group;
+	ext4_grpblk_t offset;
+	void *bitmap;
+	bool in_use;
+
+	if (!ext4_snapshot_active(sb) ||
+	    block >= ext4_blocks_count(EXT4_SB(sb)->s_es))
+		return false;
+
+	ext4_get_group_no_and_offset(sb, block, &group, &offset);
+	rcu_read_lock();
+	bitmap = xa_load(&EXT4_SB(sb)->s_snapshot_bitmaps, group);
+	in_use = !bitmap || ext4_test_bit(offset, bitmap);
+	rcu_read_unlock();
+	return in_use;
+}
+
+/* Hand @len blocks at @block freed by @inode over to @snap */
+static int ext4_snapshot_adopt(handle_t *handle, struct inode *snap,
+			       struct inode *inode, ext4_fsblk_t block,
+			       unsigned int len, int flags)
+{
+	struct ext4_ext_path *path;
+	struct ext4_extent newex;
+	int err;
+
+	err = ext4_snapshot_extend(handle, snap->i_sb);
+	if (err)
+		return err;
+
+	down_write(&EXT4_I(snap)->i_data_sem);
+	path = ext4_find_extent(snap, block, NULL, 0);
+	if (IS_ERR(path)) {
+		err = PTR_ERR(path);
+		goto out;
+	}
+	newex.ee_block = cpu_to_le32(block);
+	ext4_ext_store_pblock(&newex, block);
+	newex.ee_len = cpu_to_le16(len);
+	path = ext4_ext_insert_extent(handle, snap, path, &newex,
+				      EXT4_GET_BLOCKS_METADATA_NOFAIL);
+	if (IS_ERR(path)) {
+		err = PTR_ERR(path);
+		goto out;
+	}
+	ext4_free_ext_path(path);
+	ext4_es_insert_extent(snap, block, len, block, EXTENT_STATUS_WRITTEN,
+			      false);
+out:
+	up_write(&EXT4_I(snap)->i_data_sem);
+	if (err)
+		return err;
+
+	if (!(flags & EXT4_FREE_BLOCKS_NO_QUOT_UPDATE))
+		dquot_free_block(inode, len);
+	/* The snapshot is S_NOQUOTA, this only accounts i_blocks */
+	dquot_alloc_block_nofail(snap, len);
+	return ext4_mark_inode_dirty(handle, snap);
+}
+
+/*
+ * Called from ext4_free_blocks() while a snapshot is active. Blocks the
+ * snapshot needs are moved to it, the rest is freed. Returns false if the
+ * caller should free all blocks itself.
+ */
+bool ext4_snapshot_free_blocks(handle_t *handle, struct inode *inode,
+			       struct buffer_head *bh, ext4_fsblk_t block,
+			       unsigned long count, int flags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	unsigned long total = count;
+	struct inode *snap;
+	unsigned int len;
+	int ret, err = 0;
+
+	/* Blocks freed while mapping blocks into the snapshot are its own */
+	if (ext4_snapshot_file(inode) || sbi->s_snapshot_cow_owner == current)
+		return false;
+
+	mutex_lock(&sbi->s_snapshot_mutex);
+	snap = sbi->s_active_snapshot;
+	if (!snap) {
+		mutex_unlock(&sbi->s_snapshot_mutex);
+		return false;
+	}
+	sbi->s_snapshot_cow_owner = current;
+	flags |= EXT4_FREE_BLOCKS_NO_SNAPSHOT;
+	while (count) {
+		len = min_t(unsigned long, count, UINT_MAX);
+		ret = ext4_snapshot_need_preserve(sb, snap, block, &len,
+						  false);
+		if (ret < 0) {
+			err = ret;
+			break;
+		}
+		if (ret) {
+			/*
+			 * The blocks have not changed since the snapshot was
+			 * taken, so there is nothing to forget or revoke.
+			 */
+			err = ext4_snapshot_adopt(handle, snap, inode, block,
+						  len, flags);
+			if (err)
+				break;
+		} else {
+			ext4_free_blocks(handle, inode,
+					 len == total ? bh : NULL, block, len,
+					 flags);
+		}
+		block += len;
+		count -= len;
+	}
+	ret = ext4_snapshot_flush_pending(handle, snap);
+	if (!err)
+		err = ret;
+	sbi->s_snapshot_cow_owner = NULL;
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	if (err)
+		ext4_std_error(sb, err);
+	return true;
+}
+
+/*
+ * Extra credits for a handle started while a snapshot is active, so that
+ * the first changes to blocks in it can be preserved without extending the
+ * transaction.
+ */
+int ext4_snapshot_trans_blocks(struct super_block *sb, int blocks)
+{
+	journal_t *journal = EXT4_SB(sb)->s_journal;
+	int max = journal->j_max_transaction_buffers / 4;
+
+	if (blocks >= max)
+		return blocks;
+	return min(blocks + 4 * (int)EXT4_SNAPSHOT_COW_TRANS_BLOCKS(sb), max);
+}
+
+static int ext4_snapshot_read_disk(struct super_block *sb, ext4_fsblk_t block,
+				   struct page *page)
+{
+	struct bio *bio;
+	int err;
+
+	bio = bio_alloc(sb->s_bdev, 1, REQ_OP_READ, GFP_NOFS);
+	bio->bi_iter.bi_sector = block << (sb->s_blocksize_bits - SECTOR_SHIFT);
+	__bio_add_page(bio, page, sb->s_blocksize, 0);
+	err = submit_bio_wait(bio);
+	bio_put(bio);
+	return err;
+}
+
+/*
+ * Read block @block of the device. Buffers in the block device cache are
+ * only trusted while the journal holds them: data blocks are written
+ * through the page cache of their file and may be stale there.
+ */
+static int ext4_snapshot_read_dev(struct super_block *sb, ext4_fsblk_t block,
+				  struct page *page)
+{
+	struct buffer_head *bh;
+	bool cached = false;
+
+	bh = sb_find_get_block(sb, block);
+	if (bh) {
+		lock_buffer(bh);
+		if (buffer_uptodate(bh) &&
+		    (buffer_dirty(bh) || buffer_jbd(bh))) {
+			memcpy(page_address(page), bh->b_data, sb->s_blocksize);
+			cached = true;
+		}
+		unlock_buffer(bh);
+		brelse(bh);
+	}
+	if (cached)
+		return 0;
+	return ext4_snapshot_read_disk(sb, block, page);
+}
+
+static int ext4_snapshot_read_block(struct inode *snap, ext4_fsblk_t block,
+				    struct page *page)
+{
+	struct super_block *sb = snap->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_fsblk_t pblk;
+	unsigned int len;
+	int ret;
+
+	do {
+		len = 1;
+		ret = ext4_snapshot_lookup(snap, block, &len, &pblk);
+		if (ret < 0)
+			return ret;
+		if (ret > 0)
+			return ext4_snapshot_read_dev(sb, pblk, page);
+
+		/*
+		 * Unchanged since the snapshot was taken. A change may be
+		 * under way, but it cannot reach the buffer before the block
+		 * is preserved and the disk only after that.
+		 */
+		mutex_lock(&sbi->s_snapshot_mutex);
+		len = 1;
+		ret = ext4_snapshot_lookup(snap, block, &len, &pblk);
+		if (ret == 0)
+			ret = ext4_snapshot_read_dev(sb, block, page);
+		else if (ret > 0)
+			ret = -EAGAIN;
+		mutex_unlock(&sbi->s_snapshot_mutex);
+		if (ret)
+			continue;
+
+		/* Did it get preserved and written over meanwhile? */
+		len = 1;
+		ret = ext4_snapshot_lookup(snap, block, &len, &pblk);
+		if (ret > 0)
+			ret = -EAGAIN;
+	} while (ret == -EAGAIN);
+	return ret;
+}
+
+ssize_t ext4_snapshot_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct super_block *sb = inode->i_sb;
+	loff_t pos = iocb->ki_pos;
+	loff_t size = i_size_read(inode);
+	struct page *page;
+	ssize_t copied = 0;
+	int err = 0;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	while (iov_iter_count(to) && pos < size) {
+		unsigned int offset = pos & (sb->s_blocksize - 1);
+		size_t len, n;
+
+		len = min_t(loff_t, sb->s_blocksize - offset, size - pos);
+		len = min(len, iov_iter_count(to));
+		err = ext4_snapshot_read_block(inode,
+					pos >> sb->s_blocksize_bits, page);
+		if (err)
+			break;
+		n = copy_page_to_iter(page, offset, len, to);
+		copied += n;
+		pos += n;
+		if (n < len) {
+			err = -EFAULT;
+			break;
+		}
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	__free_page(page);
+
+	iocb->ki_pos = pos;
+	file_accessed(iocb->ki_filp);
+	return copied ? copied : err;
+}
+
+static void ext4_snapshot_activate(struct super_block *sb, struct inode *inode)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	/* Preserved blocks are not charged to anyone */
+	inode->i_flags |= S_NOQUOTA;
+	lockdep_set_subclass(&EXT4_I(inode)->i_data_sem, I_DATA_SEM_SNAPSHOT);
+
+	down_write(&sbi->s_snapshot_sem);
+	mutex_lock(&sbi->s_snapshot_mutex);
+	ext4_snapshot_drop_bitmaps(sbi);
+	WRITE_ONCE(sbi->s_active_snapshot, inode);
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	up_write(&sbi->s_snapshot_sem);
+}
+
+/* Returns the deactivated snapshot inode, to be released by the caller */
+static struct inode *ext4_snapshot_deactivate(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct inode *snap;
+
+	down_write(&sbi->s_snapshot_sem);
+	mutex_lock(&sbi->s_snapshot_mutex);
+	snap = sbi->s_active_snapshot;
+	WRITE_ONCE(sbi->s_active_snapshot, NULL);
+	ext4_snapshot_drop_bitmaps(sbi);
+	mutex_unlock(&sbi->s_snapshot_mutex);
+	up_write(&sbi->s_snapshot_sem);
+	return snap;
+}
+
+static int ext4_snapshot_supported(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	if (!sbi->s_journal || !ext4_has_feature_extents(sb) ||
+	    ext4_has_feature_bigalloc(sb) || ext4_has_feature_fast_commit(sb) ||
+	    sbi->s_daxdev) {
+		ext4_msg(sb, KERN_ERR, "snapshots require a journal and extents, "
+			 "and are not supported with bigalloc, fast_commit "
+			 "or DAX");
+		return -EOPNOTSUPP;
+	}
+	/* Snapshot logical block numbers are physical block numbers */
+	if (ext4_blocks_count(sbi->s_es) > EXT_MAX_BLOCKS) {
+		ext4_msg(sb, KERN_ERR, "snapshots are not supported on file "
+			 "systems with more than 2^32 blocks");
+		return -EFBIG;
+	}
+	return 0;
+}
+
+/* Called at mount time, before orphan cleanup may free blocks */
+int ext4_snapshot_load(struct super_block *sb)
+{
+	struct ext4_super_block *es = EXT4_SB(sb)->s_es;
+	unsigned long ino = le32_to_cpu(es->s_snapshot_inum);
+	struct inode *inode;
+	int err;
+
+	if (!ext4_has_feature_has_snapshot(sb) || !ino)
+		return 0;
+
+	err = ext4_snapshot_supported(sb);
+	if (err)
+		return err;
+
+	inode = ext4_iget(sb, ino, EXT4_IGET_NORMAL);
+	if (IS_ERR(inode)) {
+		ext4_msg(sb, KERN_ERR, "can't load snapshot inode %lu", ino);
+		return PTR_ERR(inode);
+	}
+	if (!S_ISREG(inode->i_mode) || !ext4_snapshot_file(inode) ||
+	    !inode->i_nlink) {
+		ext4_msg(sb, KERN_ERR, "inode %lu is not a snapshot", ino);
+		iput(inode);
+		return -EFSCORRUPTED;
+	}
+	ext4_snapshot_activate(sb, inode);
+	return 0;
+}
+
+void ext4_snapshot_release(struct super_block *sb)
+{
+	iput(ext4_snapshot_deactivate(sb));
+}
+
+/*
+ * Update the snapshot superblock fields and the snapshot flag of @inode.
+ * @take selects between taking and deleting the snapshot.
+ */
+static int ext4_snapshot_update(struct inode *inode, bool take)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_super_block *es = sbi->s_es;
+	handle_t *handle;
+	int err, err2;
+
+	handle = ext4_journal_start(inode, EXT4_HT_MISC, 2);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	BUFFER_TRACE(sbi->s_sbh, "get_write_access");
+	err = ext4_journal_get_write_access(handle, sb, sbi->s_sbh,
+					    EXT4_JTR_NONE);
+	if (err)
+		goto out;
+
+	if (take) {
+		ext4_set_inode_flag(inode, EXT4_INODE_SNAPFILE);
+		inode->i_mode = S_IFREG | S_IRUSR;
+		i_size_write(inode, (loff_t)ext4_blocks_count(es) <<
+				    sb->s_blocksize_bits);
+		EXT4_I(inode)->i_disksize = inode->i_size;
+	} else {
+		ext4_clear_inode_flag(inode, EXT4_INODE_SNAPFILE);
+	}
+	inode_set_ctime_current(inode);
+	err = ext4_mark_inode_dirty(handle, inode);
+	if (err)
+		goto out;
+
+	lock_buffer(sbi->s_sbh);
+	if (take) {
+		es->s_snapshot_inum = cpu_to_le32(inode->i_ino);
+		es->s_snapshot_list = cpu_to_le32(inode->i_ino);
+		le32_add_cpu(&es->s_snapshot_id, 1);
+		ext4_set_feature_has_snapshot(sb);
+	} else {
+		es->s_snapshot_inum = 0;
+		es->s_snapshot_list = 0;
+		ext4_clear_feature_has_snapshot(sb);
+	}
+	ext4_superblock_csum_set(sb);
+	unlock_buffer(sbi->s_sbh);
+	err = ext4_handle_dirty_metadata(handle, NULL, sbi->s_sbh);
+out:
+	err2 = ext4_journal_stop(handle);
+	return err ? err : err2;
+}
+
+static int ext4_snapshot_begin(struct super_block *sb)
+{
+	if (test_and_set_bit_lock(EXT4_FLAGS_SNAPSHOT_UPDATE,
+				  &EXT4_SB(sb)->s_ext4_flags))
+		return -EBUSY;
+	if (test_bit(EXT4_FLAGS_RESIZING, &EXT4_SB(sb)->s_ext4_flags)) {
+		clear_bit_unlock(EXT4_FLAGS_SNAPSHOT_UPDATE,
+				 &EXT4_SB(sb)->s_ext4_flags);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+static void ext4_snapshot_end(struct super_block *sb)
+{
+	clear_bit_unlock(EXT4_FLAGS_SNAPSHOT_UPDATE,
+			 &EXT4_SB(sb)->s_ext4_flags);
+}
+
+/*
+ * EXT4_IOC_SNAPSHOT_TAKE: turn the empty regular file @filp into a snapshot
+ * of the file system.
+ */
+int ext4_snapshot_take(struct file *filp)
+{
+	struct inode *inode = file_inode(filp);
+	struct super_block *sb = inode->i_sb;
+	journal_t *journal = EXT4_SB(sb)->s_journal;
+	int alloc_ctx;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	err = ext4_snapshot_supported(sb);
+	if (err)
+		return err;
+
+	if (!S_ISREG(inode->i_mode) ||
+	    !ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS) ||
+	    IS_ENCRYPTED(inode) || IS_VERITY(inode) ||
+	    ext4_has_inline_data(inode))
+		return -EINVAL;
+
+	err = mnt_want_write_file(filp);
+	if (err)
+		return err;
+
+	err = ext4_snapshot_begin(sb);
+	if (err)
+		goto out_drop;
+
+	inode_lock(inode);
+	if (ext4_has_feature_has_snapshot(sb) || ext4_snapshot_active(sb)) {
+		err = -EBUSY;
+		goto out_unlock;
+	}
+	if (i_size_read(inode) || inode->i_blocks || !inode->i_nlink) {
+		err = -EINVAL;
+		goto out_unlock;
+	}
+	/* Writers are refused once the flag is set, there must be none */
+	err = deny_write_access(filp);
+	if (err)
+		goto out_unlock;
+	err = ext4_snapshot_update(inode, true);
+	allow_write_access(filp);
+	if (err)
+		goto out_unlock;
+
+	/*
+	 * Writeback samples whether a snapshot is active once per call, so
+	 * keep it out while the snapshot is activated. Then wait for running
+	 * handles and commit the transaction recording the snapshot, along
+	 * with the data ordered by it. Nothing changes between that commit
+	 * and the activation; writers are held up for this one commit only.
+	 */
+	alloc_ctx = ext4_writepages_down_write(sb);
+	jbd2_journal_lock_updates(journal);
+	err = ext4_force_commit(sb);
+	if (!err) {
+		ihold(inode);
+		ext4_snapshot_activate(sb, inode);
+	}
+	jbd2_journal_unlock_updates(journal);
+	ext4_writepages_up_write(sb, alloc_ctx);
+
+out_unlock:
+	inode_unlock(inode);
+	ext4_snapshot_end(sb);
+out_drop:
+	mnt_drop_write_file(filp);
+	return err;
+}
+
+/*
+ * EXT4_IOC_SNAPSHOT_DELETE: stop preserving blocks in the snapshot @filp.
+ * The file becomes a regular file and can be unlinked to free its blocks.
+ */
+int ext4_snapshot_delete(struct file *filp)
+{
+	struct inode *inode = file_inode(filp);
+	struct super_block *sb = inode->i_sb;
+	struct inode *snap = NULL;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (!ext4_snapshot_file(inode))
+		return -EINVAL;
+
+	err = mnt_want_write_file(filp);
+	if (err)
+		return err;
+
+	err = ext4_snapshot_begin(sb);
+	if (err)
+		goto out_drop;
+
+	inode_lock(inode);
+	if (READ_ONCE(EXT4_SB(sb)->s_active_snapshot) == inode) {
+		/*
+		 * Handles hold s_snapshot_sem shared, let them finish rather
+		 * than have new ones queue up behind the exclusive lock.
+		 */
+		jbd2_journal_lock_updates(EXT4_SB(sb)->s_journal);
+		snap = ext4_snapshot_deactivate(sb);
+		jbd2_journal_unlock_updates(EXT4_SB(sb)->s_journal);
+	}
+	err = ext4_snapshot_update(inode, false);
+	inode_unlock(inode);
+	iput(snap);
+
+	ext4_snapshot_end(sb);
+out_drop:
+	mnt_drop_write_file(filp);
+	return err;
+}
@@ -1233,6 +1233,12 @@ static int ext4_percpu_param_init(struct ext4_sb_info *sbi)
 	if (!err)
 		err = percpu_counter_init(&sbi->s_sra_exceeded_retry_limit, 0,
 					  GFP_KERNEL);
+	if (!err)
+		err = percpu_counter_init(&sbi->s_dir_bloom_hits, 0,
+					  GFP_KERNEL);
+	if (!err)
+		err = percpu_counter_init(&sbi->s_dir_bloom_misses, 0,
+					  GFP_KERNEL);
 	if (!err)
 		err = percpu_init_rwsem(&sbi->s_writepages_rwsem);
 
@@ -1249,6 +1255,8 @@ static void ext4_percpu_param_destroy(struct ext4_sb_info *sbi)
 	percpu_counter_destroy(&sbi->s_dirs_counter);
 	percpu_counter_destroy(&sbi->s_dirtyclusters_counter);
 	percpu_counter_destroy(&sbi->s_sra_exceeded_retry_limit);
+	percpu_counter_destroy(&sbi->s_dir_bloom_hits);
+	percpu_counter_destroy(&sbi->s_dir_bloom_misses);
 	percpu_free_rwsem(&sbi->s_writepages_rwsem);
 }
 
@@ -1304,10 +1312,12 @@ static void ext4_put_super(struct super_block *sb)
 			 &sb->s_uuid);
 
 	ext4_unregister_li_request(sb);
+	ext4_mb_stop_pregen(sb);
 	ext4_quotas_off(sb, EXT4_MAXQUOTAS);
 
 	flush_work(&sbi->s_sb_upd_work);
 	destroy_workqueue(sbi->rsv_conversion_wq);
+	ext4_snapshot_release(sb);
 	ext4_release_orphan_info(sb);
 
 	if (sbi->s_journal) {
@@ -1319,6 +1329,7 @@ static void ext4_put_super(struct super_block *sb)
 		}
 	}
 
+	ext4_dir_cache_unregister_shrinker(sbi);
 	ext4_es_unregister_shrinker(sbi);
 	timer_shutdown_sync(&sbi->s_err_report);
 	ext4_release_system_zone(sb);
@@ -1410,6 +1421,14 @@ static struct inode *ext4_alloc_inode(struct super_block *sb)
 	rwlock_init(&ei->i_prealloc_lock);
 	ext4_es_init_tree(&ei->i_es_tree);
 	rwlock_init(&ei->i_es_lock);
+	seqcount_rwlock_init(&ei->i_es_seq, &ei->i_es_lock);
+	spin_lock_init(&ei->i_ext_cursor_lock);
+	ei->i_ext_cursor = NULL;
+	ei->i_ext_cursor_gen = 0;
+	ei->i_ext_generation = 0;
+	ei->i_dir_cache = NULL;
+	ei->i_dir_bloom = NULL;
+	ei->i_dir_bloom_retry = 0;
 	INIT_LIST_HEAD(&ei->i_es_list);
 	ei->i_es_all_nr = 0;
 	ei->i_es_shk_nr = 0;
@@ -1520,6 +1539,9 @@ void ext4_clear_inode(struct inode *inode)
 	clear_inode(inode);
 	ext4_discard_preallocations(inode);
 	ext4_es_remove_extent(inode, 0, EXT_MAX_BLOCKS);
+	ext4_ext_release_cursor(inode);
+	ext4_dir_cache_invalidate(inode);
+	ext4_dir_bloom_release(inode);
 	dquot_drop(inode);
 	if (EXT4_I(inode)->jinode) {
 		jbd2_journal_release_jbd_inode(EXT4_JOURNAL(inode),
@@ -1672,11 +1694,12 @@ enum {
 	Opt_stripe, Opt_delalloc, Opt_nodelalloc, Opt_warn_on_error,
 	Opt_nowarn_on_error, Opt_mblk_io_submit, Opt_debug_want_extra_isize,
 	Opt_nomblk_io_submit, Opt_block_validity, Opt_noblock_validity,
-	Opt_inode_readahead_blks, Opt_journal_ioprio,
+	Opt_inode_readahead_blks, Opt_journal_ioprio, Opt_journal_revoke_hash,
 	Opt_dioread_nolock, Opt_dioread_lock,
 	Opt_discard, Opt_nodiscard, Opt_init_itable, Opt_noinit_itable,
 	Opt_max_dir_size_kb, Opt_nojournal_checksum, Opt_nombcache,
-	Opt_no_prefetch_block_bitmaps, Opt_mb_optimize_scan,
+	Opt_no_prefetch_block_bitmaps, Opt_mb_optimize_scan, Opt_mb_pregen,
+	Opt_dir_shrink,
 	Opt_errors, Opt_data, Opt_data_err, Opt_jqfmt, Opt_dax_type,
 #ifdef CONFIG_EXT4_DEBUG
 	Opt_fc_debug_max_replay, Opt_fc_debug_force
@@ -1787,6 +1810,8 @@ static const struct fs_parameter_spec ext4_param_specs[] = {
 	fsparam_u32	("inode_readahead_blks",
 						Opt_inode_readahead_blks),
 	fsparam_u32	("journal_ioprio",	Opt_journal_ioprio),
+	fsparam_u32	("journal_revoke_hash",	Opt_journal_revoke_hash),
+	fsparam_u32	("mb_pregen",		Opt_mb_pregen),
 	fsparam_u32	("auto_da_alloc",	Opt_auto_da_alloc),
 	fsparam_flag	("auto_da_alloc",	Opt_auto_da_alloc),
 	fsparam_flag	("noauto_da_alloc",	Opt_noauto_da_alloc),
@@ -1814,6 +1839,7 @@ static const struct fs_parameter_spec ext4_param_specs[] = {
 						Opt_removed),
 	fsparam_flag	("no_prefetch_block_bitmaps",
 						Opt_no_prefetch_block_bitmaps),
+	fsparam_flag	("dir_shrink",		Opt_dir_shrink),
 	fsparam_s32	("mb_optimize_scan",	Opt_mb_optimize_scan),
 	fsparam_string	("check",		Opt_removed),	/* mount option from ext2/3 */
 	fsparam_flag	("nocheck",		Opt_removed),	/* mount option from ext2/3 */
@@ -1884,6 +1910,7 @@ static const struct mount_opts {
 	{Opt_journal_dev, 0, MOPT_NO_EXT2},
 	{Opt_journal_path, 0, MOPT_NO_EXT2},
 	{Opt_journal_ioprio, 0, MOPT_NO_EXT2},
+	{Opt_journal_revoke_hash, 0, MOPT_NO_EXT2},
 	{Opt_data, 0, MOPT_NO_EXT2},
 	{Opt_user_xattr, EXT4_MOUNT_XATTR_USER, MOPT_SET},
 #ifdef CONFIG_EXT4_FS_POSIX_ACL
@@ -1914,6 +1941,7 @@ static const struct mount_opts {
 	 MOPT_SET | MOPT_2 | MOPT_EXT4_ONLY},
 #endif
 	{Opt_abort, EXT4_MOUNT2_ABORT, MOPT_SET | MOPT_2},
+	{Opt_dir_shrink, EXT4_MOUNT2_DIR_SHRINK, MOPT_SET | MOPT_2},
 	{Opt_err, 0, 0}
 };
 
@@ -1959,6 +1987,8 @@ ext4_sb_read_encoding(const struct ext4_super_block *es)
 #define EXT4_SPEC_s_fc_debug_max_replay		(1 << 17)
 #define EXT4_SPEC_s_sb_block			(1 << 18)
 #define EXT4_SPEC_mb_optimize_scan		(1 << 19)
+#define EXT4_SPEC_s_journal_revoke_hash		(1 << 20)
+#define EXT4_SPEC_s_mb_pregen			(1 << 21)
 
 struct ext4_fs_context {
 	char		*s_qf_names[EXT4_MAXQUOTAS];
@@ -1977,6 +2007,8 @@ struct ext4_fs_context {
 	unsigned int	s_want_extra_isize;
 	unsigned int	s_li_wait_mult;
 	unsigned int	s_max_dir_size_kb;
+	unsigned int	s_journal_revoke_hash;
+	unsigned int	s_mb_pregen;
 	unsigned int	journal_ioprio;
 	unsigned int	vals_s_mount_opt;
 	unsigned int	mask_s_mount_opt;
@@ -2267,6 +2299,26 @@ static int ext4_parse_param(struct fs_context *fc, struct fs_parameter *param)
 		ctx->s_max_dir_size_kb = result.uint_32;
 		ctx->spec |= EXT4_SPEC_s_max_dir_size_kb;
 		return 0;
+	case Opt_journal_revoke_hash:
+		if (is_remount) {
+			ext4_msg(NULL, KERN_ERR,
+				 "Cannot change journal_revoke_hash on remount");
+			return -EINVAL;
+		}
+		if (result.uint_32 == 0 ||
+		    result.uint_32 > JOURNAL_REVOKE_MAX_HASH) {
+			ext4_msg(NULL, KERN_ERR,
+				 "journal_revoke_hash must be between 1 and %u",
+				 JOURNAL_REVOKE_MAX_HASH);
+			return -EINVAL;
+		}
+		ctx->s_journal_revoke_hash = result.uint_32;
+		ctx->spec |= EXT4_SPEC_s_journal_revoke_hash;
+		return 0;
+	case Opt_mb_pregen:
+		ctx->s_mb_pregen = result.uint_32;
+		ctx->spec |= EXT4_SPEC_s_mb_pregen;
+		return 0;
 #ifdef CONFIG_EXT4_DEBUG
 	case Opt_fc_debug_max_replay:
 		ctx->s_fc_debug_max_replay = result.uint_32;
@@ -2834,6 +2886,8 @@ static void ext4_apply_options(struct fs_context *fc, struct super_block *sb)
 	APPLY(s_want_extra_isize);
 	APPLY(s_inode_readahead_blks);
 	APPLY(s_max_dir_size_kb);
+	APPLY(s_journal_revoke_hash);
+	APPLY(s_mb_pregen);
 	APPLY(s_li_wait_mult);
 	APPLY(s_resgid);
 	APPLY(s_resuid);
@@ -3008,6 +3062,11 @@ static int _ext4_show_options(struct seq_file *seq, struct super_block *sb,
 		SEQ_OPTS_PRINT("init_itable=%u", sbi->s_li_wait_mult);
 	if (nodefs || sbi->s_max_dir_size_kb)
 		SEQ_OPTS_PRINT("max_dir_size_kb=%u", sbi->s_max_dir_size_kb);
+	if (sbi->s_journal_revoke_hash)
+		SEQ_OPTS_PRINT("journal_revoke_hash=%u",
+			       sbi->s_journal_revoke_hash);
+	if (sbi->s_mb_pregen)
+		SEQ_OPTS_PRINT("mb_pregen=%u", sbi->s_mb_pregen);
 	if (test_opt(sb, DATA_ERR_ABORT))
 		SEQ_OPTS_PUTS("data_err=abort");
 
@@ -3095,6 +3154,9 @@ static int ext4_setup_super(struct super_block *sb, struct ext4_super_block *es,
 		es->s_state &= cpu_to_le16(~EXT4_VALID_FS);
 	if (!(__s16) le16_to_cpu(es->s_max_mnt_count))
 		es->s_max_mnt_count = cpu_to_le16(EXT4_DFL_MAX_MNT_COUNT);
+	/* Trimmed group flags stay trusted as long as we keep them */
+	if (ext4_trimmed_bg_valid(sb))
+		le16_add_cpu(&es->s_trim_mnt_count, 1);
 	le16_add_cpu(&es->s_mnt_count, 1);
 	ext4_update_tstamp(es, s_mtime);
 	if (sbi->s_journal) {
@@ -3259,13 +3321,17 @@ void ext4_group_desc_csum_set(struct super_block *sb, __u32 block_group,
 	gdp->bg_checksum = ext4_group_desc_csum(sb, block_group, gdp);
 }
 
-/* Called at mount-time, super-block is locked */
-static int ext4_check_descriptors(struct super_block *sb,
-				  ext4_fsblk_t sb_block,
-				  ext4_group_t *first_not_zeroed)
+/*
+ * Check the descriptors of groups [start, end).  Called at mount-time,
+ * super-block is locked.
+ */
+static int ext4_check_descriptors_range(struct super_block *sb,
+					ext4_fsblk_t sb_block,
+					ext4_group_t start, ext4_group_t end,
+					ext4_group_t *first_not_zeroed)
 {
 	struct ext4_sb_info *sbi = EXT4_SB(sb);
-	ext4_fsblk_t first_block = le32_to_cpu(sbi->s_es->s_first_data_block);
+	ext4_fsblk_t first_block;
 	ext4_fsblk_t last_block;
 	ext4_fsblk_t last_bg_block = sb_block + ext4_bg_num_gdb(sb, 0);
 	ext4_fsblk_t block_bitmap;
@@ -3277,11 +3343,13 @@ static int ext4_check_descriptors(struct super_block *sb,
 	if (ext4_has_feature_flex_bg(sb))
 		flexbg_flag = 1;
 
-	ext4_debug("Checking group descriptors");
-
-	for (i = 0; i < sbi->s_groups_count; i++) {
+	for (i = start; i < end; i++) {
 		struct ext4_group_desc *gdp = ext4_get_group_desc(sb, i, NULL);
 
+		if (flexbg_flag)
+			first_block = le32_to_cpu(sbi->s_es->s_first_data_block);
+		else
+			first_block = ext4_group_first_block_no(sb, i);
 		if (i == sbi->s_groups_count - 1 || flexbg_flag)
 			last_block = ext4_blocks_count(sbi->s_es) - 1;
 		else
@@ -3371,9 +3439,85 @@ static int ext4_check_descriptors(struct super_block *sb,
 			}
 		}
 		ext4_unlock_group(sb, i);
-		if (!flexbg_flag)
-			first_block += EXT4_BLOCKS_PER_GROUP(sb);
 	}
+	*first_not_zeroed = grp;
+	return 1;
+}
+
+/* Groups checked by each worker of a parallel descriptor check */
+#define EXT4_DESC_CHECK_GROUPS_PER_WORKER	16384
+#define EXT4_DESC_CHECK_MAX_WORKERS		16
+
+struct ext4_desc_check {
+	struct work_struct	dc_work;
+	struct super_block	*dc_sb;
+	ext4_fsblk_t		dc_sb_block;
+	ext4_group_t		dc_start;
+	ext4_group_t		dc_end;
+	ext4_group_t		dc_first_not_zeroed;
+	int			dc_ret;
+};
+
+static void ext4_check_descriptors_work(struct work_struct *work)
+{
+	struct ext4_desc_check *dc =
+		container_of(work, struct ext4_desc_check, dc_work);
+
+	dc->dc_ret = ext4_check_descriptors_range(dc->dc_sb, dc->dc_sb_block,
+						  dc->dc_start, dc->dc_end,
+						  &dc->dc_first_not_zeroed);
+}
+
+/*
+ * Called at mount-time, super-block is locked.  Groups are independent of
+ * each other, so on filesystems with many groups the work is split into
+ * contiguous ranges checked on unbound workers.
+ */
+static int ext4_check_descriptors(struct super_block *sb,
+				  ext4_fsblk_t sb_block,
+				  ext4_group_t *first_not_zeroed)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_group_t ngroups = sbi->s_groups_count;
+	ext4_group_t grp, per_worker;
+	struct ext4_desc_check *dc = NULL;
+	int nr_workers, i, ret = 1;
+
+	ext4_debug("Checking group descriptors");
+
+	nr_workers = min_t(ext4_group_t, num_online_cpus(),
+			   DIV_ROUND_UP(ngroups,
+					EXT4_DESC_CHECK_GROUPS_PER_WORKER));
+	nr_workers = min(nr_workers, EXT4_DESC_CHECK_MAX_WORKERS);
+	if (nr_workers > 1)
+		dc = kcalloc(nr_workers, sizeof(*dc), GFP_KERNEL);
+	if (!dc) {
+		if (!ext4_check_descriptors_range(sb, sb_block, 0, ngroups,
+						  &grp))
+			return 0;
+		goto out;
+	}
+
+	per_worker = DIV_ROUND_UP(ngroups, nr_workers);
+	for (i = 0; i < nr_workers; i++) {
+		INIT_WORK(&dc[i].dc_work, ext4_check_descriptors_work);
+		dc[i].dc_sb = sb;
+		dc[i].dc_sb_block = sb_block;
+		dc[i].dc_start = min(ngroups, i * per_worker);
+		dc[i].dc_end = min(ngroups, dc[i].dc_start + per_worker);
+		queue_work(system_unbound_wq, &dc[i].dc_work);
+	}
+	grp = ngroups;
+	for (i = 0; i < nr_workers; i++) {
+		flush_work(&dc[i].dc_work);
+		if (!dc[i].dc_ret)
+			ret = 0;
+		grp = min(grp, dc[i].dc_first_not_zeroed);
+	}
+	kfree(dc);
+	if (!ret)
+		return 0;
+out:
 	if (NULL != first_not_zeroed)
 		*first_not_zeroed = grp;
 	return 1;
@@ -3674,14 +3818,125 @@ static void print_daily_error_info(struct timer_list *t)
 	mod_timer(&sbi->s_err_report, jiffies + 24*60*60*HZ);  /* Once a day */
 }
 
+/*
+ * Each run of a lazy init request zeroes up to s_li_parallel inode tables,
+ * each in its own work item so that several zeroout requests are in flight.
+ */
+#define EXT4_LI_MAX_PARALLEL	32
+
+struct ext4_li_work {
+	struct work_struct	lw_work;
+	struct super_block	*lw_sb;
+	ext4_group_t		lw_group;
+	int			lw_barrier;
+	int			lw_ret;
+};
+
+static void ext4_li_work_fn(struct work_struct *work)
+{
+	struct ext4_li_work *lw = container_of(work, struct ext4_li_work,
+					       lw_work);
+
+	lw->lw_ret = ext4_init_inode_table(lw->lw_sb, lw->lw_group,
+					   lw->lw_barrier);
+	trace_ext4_lazy_itable_init(lw->lw_sb, lw->lw_group);
+}
+
+/* Find the first group at or after @group whose inode table is not zeroed */
+static ext4_group_t ext4_li_next_group(struct super_block *sb,
+				       ext4_group_t group)
+{
+	ext4_group_t ngroups = EXT4_SB(sb)->s_groups_count;
+	struct ext4_group_desc *gdp;
+
+	for (; group < ngroups; group++) {
+		gdp = ext4_get_group_desc(sb, group, NULL);
+		if (!gdp)
+			return ngroups;
+
+		if (!(gdp->bg_flags & cpu_to_le16(EXT4_BG_INODE_ZEROED)))
+			break;
+	}
+	return group;
+}
+
+/*
+ * Zero the inode tables of up to *@nr groups starting at @group.  Returns
+ * the number of groups processed in *@nr, the group to continue from in
+ * @next and the result of the first failing ext4_init_inode_table(), if any.
+ */
+static int ext4_li_zero_groups(struct super_block *sb, ext4_group_t group,
+			       unsigned int *nr, int barrier,
+			       ext4_group_t *next)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_group_t ngroups = sbi->s_groups_count;
+	struct ext4_li_work *lw = NULL;
+	unsigned int i, queued = 0;
+	int ret = 0;
+
+	if (*nr > 1)
+		lw = kcalloc(*nr, sizeof(*lw), GFP_NOFS);
+	if (!lw) {
+		ret = ext4_init_inode_table(sb, group, barrier);
+		trace_ext4_lazy_itable_init(sb, group);
+		if (!ret)
+			atomic_inc(&sbi->s_li_groups_zeroed);
+		*nr = 1;
+		*next = group + 1;
+		return ret;
+	}
+
+	while (queued < *nr && group < ngroups) {
+		INIT_WORK(&lw[queued].lw_work, ext4_li_work_fn);
+		lw[queued].lw_sb = sb;
+		lw[queued].lw_group = group;
+		/* One cache flush for the whole batch is enough */
+		lw[queued].lw_barrier = 0;
+		queue_work(system_unbound_wq, &lw[queued].lw_work);
+		queued++;
+		group = ext4_li_next_group(sb, group + 1);
+	}
+	for (i = 0; i < queued; i++) {
+		flush_work(&lw[i].lw_work);
+		if (!lw[i].lw_ret)
+			atomic_inc(&sbi->s_li_groups_zeroed);
+		else if (!ret)
+			ret = lw[i].lw_ret;
+	}
+	kfree(lw);
+	if (barrier)
+		blkdev_issue_flush(sb->s_bdev);
+	*nr = queued;
+	*next = group;
+	return ret;
+}
+
+/*
+ * Delay before the next run of @elr so that zeroing stays within
+ * s_li_max_kbps, or 0 if it is already behind the budget.
+ */
+static unsigned long ext4_li_budget_delay(struct ext4_li_request *elr,
+					  unsigned int kbps)
+{
+	u64 due_ms = div_u64(elr->lr_zeroed_kb * MSEC_PER_SEC, kbps);
+	u64 elapsed_ms = div_u64(ktime_get_ns() - elr->lr_start_ns,
+				 NSEC_PER_MSEC);
+
+	if (due_ms <= elapsed_ms)
+		return 0;
+	return msecs_to_jiffies(due_ms - elapsed_ms);
+}
+
 /* Find next suitable group and run ext4_init_inode_table */
 static int ext4_run_li_request(struct ext4_li_request *elr)
 {
-	struct ext4_group_desc *gdp = NULL;
 	struct super_block *sb = elr->lr_super;
-	ext4_group_t ngroups = EXT4_SB(sb)->s_groups_count;
-	ext4_group_t group = elr->lr_next_group;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_group_t ngroups = sbi->s_groups_count;
+	ext4_group_t group = elr->lr_next_group, next;
 	unsigned int prefetch_ios = 0;
+	unsigned int kbps, parallel;
 	int ret = 0;
 	int nr = EXT4_SB(sb)->s_mb_prefetch;
 	u64 start_time;
@@ -3702,31 +3957,38 @@ static int ext4_run_li_request(struct ext4_li_request *elr)
 		return ret;
 	}
 
-	for (; group < ngroups; group++) {
-		gdp = ext4_get_group_desc(sb, group, NULL);
-		if (!gdp) {
-			ret = 1;
-			break;
-		}
-
-		if (!(gdp->bg_flags & cpu_to_le16(EXT4_BG_INODE_ZEROED)))
-			break;
-	}
-
+	group = ext4_li_next_group(sb, group);
+	WRITE_ONCE(sbi->s_li_next_group, group);
 	if (group >= ngroups)
 		ret = 1;
 
 	if (!ret) {
+		parallel = clamp_t(unsigned int, READ_ONCE(sbi->s_li_parallel),
+				   1, EXT4_LI_MAX_PARALLEL);
+		kbps = READ_ONCE(sbi->s_li_max_kbps);
 		start_time = ktime_get_ns();
-		ret = ext4_init_inode_table(sb, group,
-					    elr->lr_timeout ? 0 : 1);
-		trace_ext4_lazy_itable_init(sb, group);
+		/* Start accounting afresh whenever the budget is changed */
+		if (!elr->lr_start_ns || elr->lr_kbps != kbps) {
+			elr->lr_start_ns = start_time;
+			elr->lr_zeroed_kb = 0;
+			elr->lr_kbps = kbps;
+		}
+		ret = ext4_li_zero_groups(sb, group, &parallel,
+					  elr->lr_timeout ? 0 : 1, &next);
 		if (elr->lr_timeout == 0) {
 			elr->lr_timeout = nsecs_to_jiffies((ktime_get_ns() - start_time) *
 				EXT4_SB(elr->lr_super)->s_li_wait_mult);
 		}
-		elr->lr_next_sched = jiffies + elr->lr_timeout;
-		elr->lr_next_group = group + 1;
+		/* An upper bound: tables of partly used groups are shorter */
+		elr->lr_zeroed_kb += ((u64)parallel * sbi->s_itb_per_group) <<
+				     (sb->s_blocksize_bits - 10);
+		if (kbps)
+			elr->lr_next_sched = jiffies +
+				ext4_li_budget_delay(elr, kbps);
+		else
+			elr->lr_next_sched = jiffies + elr->lr_timeout;
+		elr->lr_next_group = next;
+		WRITE_ONCE(sbi->s_li_next_group, next);
 	}
 	return ret;
 }
@@ -4839,6 +5101,7 @@ static int ext4_group_desc_init(struct super_block *sb,
 	struct ext4_sb_info *sbi = EXT4_SB(sb);
 	unsigned int db_count;
 	ext4_fsblk_t block;
+	struct blk_plug plug;
 	int i;
 
 	db_count = (sbi->s_groups_count + EXT4_DESC_PER_BLOCK(sb) - 1) /
@@ -4863,11 +5126,16 @@ static int ext4_group_desc_init(struct super_block *sb,
 
 	bgl_lock_init(sbi->s_blockgroup_lock);
 
-	/* Pre-read the descriptors into the buffer cache */
+	/*
+	 * Pre-read the descriptors into the buffer cache.  Plug so that
+	 * adjacent descriptor blocks are merged into large requests.
+	 */
+	blk_start_plug(&plug);
 	for (i = 0; i < db_count; i++) {
 		block = descriptor_loc(sb, logical_sb_block, i);
 		ext4_sb_breadahead_unmovable(sb, block);
 	}
+	blk_finish_plug(&plug);
 
 	for (i = 0; i < db_count; i++) {
 		struct buffer_head *bh;
@@ -5236,6 +5504,8 @@ static int __ext4_fill_super(struct fs_context *fc, struct super_block *sb)
 	ext4_group_t first_not_zeroed;
 	struct ext4_fs_context *ctx = fc->fs_private;
 	int silent = fc->sb_flags & SB_SILENT;
+	ktime_t mount_start = ktime_get(), t;
+	u64 group_desc_ns = 0, journal_ns = 0, mb_init_ns = 0, orphan_ns = 0;
 
 	/* Set defaults for the variables that will be set during parsing */
 	if (!(ctx->spec & EXT4_SPEC_JOURNAL_IOPRIO))
@@ -5328,14 +5598,22 @@ static int __ext4_fill_super(struct fs_context *fc, struct super_block *sb)
 	spin_lock_init(&sbi->s_error_lock);
 	INIT_WORK(&sbi->s_sb_upd_work, update_super_work);
 
+	t = ktime_get();
 	err = ext4_group_desc_init(sb, es, logical_sb_block, &first_not_zeroed);
 	if (err)
 		goto failed_mount3;
+	group_desc_ns = ktime_to_ns(ktime_sub(ktime_get(), t));
 
 	err = ext4_es_register_shrinker(sbi);
 	if (err)
 		goto failed_mount3;
 
+	err = ext4_dir_cache_register_shrinker(sbi);
+	if (err) {
+		ext4_es_unregister_shrinker(sbi);
+		goto failed_mount3;
+	}
+
 	sbi->s_stripe = ext4_get_stripe_size(sbi);
 	if (ext4_is_stripe_incompatible(sb, sbi->s_stripe)) {
 		ext4_msg(sb, KERN_WARNING,
@@ -5345,6 +5623,9 @@ static int __ext4_fill_super(struct fs_context *fc, struct super_block *sb)
 		sbi->s_stripe = 0;
 	}
 	sbi->s_extent_max_zeroout_kb = 32;
+	sbi->s_dir_cache_max_kb = EXT4_DEF_DIR_CACHE_MAX_KB;
+	sbi->s_trim_parallel = 1;
+	sbi->s_li_parallel = EXT4_DEF_LI_PARALLEL;
 
 	/*
 	 * set up enough so that it can read an inode
@@ -5376,6 +5657,7 @@ static int __ext4_fill_super(struct fs_context *fc, struct super_block *sb)
 
 	ext4_atomic_write_init(sb);
 	ext4_fast_commit_init(sb);
+	ext4_snapshot_init(sb);
 
 	sb->s_root = NULL;
 
@@ -5395,9 +5677,11 @@ static int __ext4_fill_super(struct fs_context *fc, struct super_block *sb)
 	 * root first: it may be modified in the journal!
 	 */
 	if (!test_opt(sb, NOLOAD) && ext4_has_feature_journal(sb)) {
+		t = ktime_get();
 		err = ext4_load_and_init_journal(sb, es, ctx);
 		if (err)
 			goto failed_mount3a;
+		journal_ns = ktime_to_ns(ktime_sub(ktime_get(), t));
 	} else if (test_opt(sb, NOLOAD) && !sb_rdonly(sb) &&
 		   ext4_has_feature_journal_needs_recovery(sb)) {
 		ext4_msg(sb, KERN_ERR, "required journal recovery "
@@ -5478,11 +5762,15 @@ static int __ext4_fill_super(struct fs_context *fc, struct super_block *sb)
 	}
 
 	/*
-	 * The maximum number of concurrent works can be high and
-	 * concurrency isn't really necessary.  Limit it to 1.
+	 * Each inode has a single conversion work item, so conversions of one
+	 * inode stay ordered while different inodes are converted in
+	 * parallel, up to s_rsv_conv_max_active at a time.
 	 */
+	sbi->s_rsv_conv_max_active = clamp_t(unsigned int, num_online_cpus(),
+					     1, EXT4_DEF_RSV_CONV_MAX_ACTIVE);
 	EXT4_SB(sb)->rsv_conversion_wq =
-		alloc_workqueue("ext4-rsv-conversion", WQ_MEM_RECLAIM | WQ_UNBOUND, 1);
+		alloc_workqueue("ext4-rsv-conversion", WQ_MEM_RECLAIM | WQ_UNBOUND,
+				sbi->s_rsv_conv_max_active);
 	if (!EXT4_SB(sb)->rsv_conversion_wq) {
 		printk(KERN_ERR "EXT4-fs: failed to create workqueue\n");
 		err = -ENOMEM;
@@ -5548,12 +5836,14 @@ static int __ext4_fill_super(struct fs_context *fc, struct super_block *sb)
 			clear_opt2(sb, MB_OPTIMIZE_SCAN);
 	}
 
+	t = ktime_get();
 	err = ext4_mb_init(sb);
 	if (err) {
 		ext4_msg(sb, KERN_ERR, "failed to initialize mballoc (%d)",
 			 err);
 		goto failed_mount5;
 	}
+	mb_init_ns = ktime_to_ns(ktime_sub(ktime_get(), t));
 
 	/*
 	 * We can only set up the journal commit callback once
@@ -5583,6 +5873,13 @@ static int __ext4_fill_super(struct fs_context *fc, struct super_block *sb)
 	err = ext4_init_orphan_info(sb);
 	if (err)
 		goto failed_mount7;
+
+	/* Load the snapshot before anything modifies the file system */
+	err = ext4_snapshot_load(sb);
+	if (err)
+		goto failed_mount8;
+	if (!sb_rdonly(sb))
+		ext4_trim_clear_stale(sb);
 #ifdef CONFIG_QUOTA
 	/* Enable quota usage during mount. */
 	if (ext4_has_feature_quota(sb) && !sb_rdonly(sb)) {
@@ -5598,9 +5895,11 @@ static int __ext4_fill_super(struct fs_context *fc, struct super_block *sb)
 	 */
 	errseq_check_and_advance(&sb->s_bdev->bd_mapping->wb_err,
 				 &sbi->s_bdev_wb_err);
+	t = ktime_get();
 	EXT4_SB(sb)->s_mount_state |= EXT4_ORPHAN_FS;
 	ext4_orphan_cleanup(sb, es);
 	EXT4_SB(sb)->s_mount_state &= ~EXT4_ORPHAN_FS;
+	orphan_ns = ktime_to_ns(ktime_sub(ktime_get(), t));
 	/*
 	 * Update the checksum after updating free space/inode counters and
 	 * ext4_orphan_cleanup. Otherwise the superblock can have an incorrect
@@ -5635,11 +5934,16 @@ static int __ext4_fill_super(struct fs_context *fc, struct super_block *sb)
 	if (err)
 		goto failed_mount9;
 
+	ext4_mb_start_pregen(sb);
+	trace_ext4_mount_stats(sb, group_desc_ns, journal_ns, mb_init_ns,
+			       orphan_ns,
+			       ktime_to_ns(ktime_sub(ktime_get(), mount_start)));
 	return 0;
 
 failed_mount9:
 	ext4_quotas_off(sb, EXT4_MAXQUOTAS);
-failed_mount8: __maybe_unused
+failed_mount8:
+	ext4_snapshot_release(sb);
 	ext4_release_orphan_info(sb);
 failed_mount7:
 	ext4_unregister_li_request(sb);
@@ -5671,6 +5975,7 @@ failed_mount8: __maybe_unused
 		sbi->s_journal = NULL;
 	}
 failed_mount3a:
+	ext4_dir_cache_unregister_shrinker(sbi);
 	ext4_es_unregister_shrinker(sbi);
 failed_mount3:
 	/* flush s_sb_upd_work before sbi destroy */
@@ -6051,6 +6356,17 @@ static int ext4_load_journal(struct super_block *sb,
 	if (!(journal->j_flags & JBD2_BARRIER))
 		ext4_msg(sb, KERN_INFO, "barriers disabled");
 
+	/* Must be sized before recovery fills the revoke table */
+	if (EXT4_SB(sb)->s_journal_revoke_hash) {
+		err = jbd2_journal_resize_revoke(journal,
+			roundup_pow_of_two(EXT4_SB(sb)->s_journal_revoke_hash));
+		if (err) {
+			ext4_msg(sb, KERN_ERR,
+				 "can't resize journal revoke table: %d", err);
+			goto err_out;
+		}
+	}
+
 	if (!ext4_has_feature_journal_needs_recovery(sb))
 		err = jbd2_journal_wipe(journal, !really_read_only);
 	if (!err) {
@@ -25,6 +25,12 @@ typedef enum {
 	attr_lifetime_write_kbytes,
 	attr_reserved_clusters,
 	attr_sra_exceeded_retry_limit,
+	attr_discard_pending_bytes,
+	attr_dir_bloom_hits,
+	attr_dir_bloom_misses,
+	attr_rsv_conversion_done,
+	attr_rsv_conversion_avg_wait_us,
+	attr_rsv_conversion_max_active,
 	attr_inode_readahead,
 	attr_trigger_test_error,
 	attr_first_error_time,
@@ -114,6 +120,35 @@ static ssize_t reserved_clusters_store(struct ext4_sb_info *sbi,
 	return count;
 }
 
+static ssize_t rsv_conversion_max_active_store(struct ext4_sb_info *sbi,
+					       const char *buf, size_t count)
+{
+	unsigned int t;
+	int ret;
+
+	ret = kstrtouint(skip_spaces(buf), 0, &t);
+	if (ret)
+		return ret;
+	if (!t || t > WQ_UNBOUND_MAX_ACTIVE)
+		return -EINVAL;
+
+	sbi->s_rsv_conv_max_active = t;
+	workqueue_set_max_active(sbi->rsv_conversion_wq, t);
+	return count;
+}
+
+static ssize_t rsv_conversion_avg_wait_us_show(struct ext4_sb_info *sbi,
+					       char *buf)
+{
+	u64 done = atomic64_read(&sbi->s_rsv_conv_done);
+
+	if (!done)
+		return sysfs_emit(buf, "0\n");
+	return sysfs_emit(buf, "%llu\n",
+		div64_u64(atomic64_read(&sbi->s_rsv_conv_wait_ns),
+			  done * NSEC_PER_USEC));
+}
+
 static ssize_t trigger_test_error(struct ext4_sb_info *sbi,
 				  const char *buf, size_t count)
 {
@@ -210,6 +245,11 @@ EXT4_ATTR_FUNC(session_write_kbytes, 0444);
 EXT4_ATTR_FUNC(lifetime_write_kbytes, 0444);
 EXT4_ATTR_FUNC(reserved_clusters, 0644);
 EXT4_ATTR_FUNC(sra_exceeded_retry_limit, 0444);
+EXT4_ATTR_FUNC(discard_pending_bytes, 0444);
+EXT4_ATTR_FUNC(dir_bloom_hits, 0444);
+EXT4_ATTR_FUNC(dir_bloom_misses, 0444);
+EXT4_ATTR_FUNC(rsv_conversion_done, 0444);
+EXT4_ATTR_FUNC(rsv_conversion_avg_wait_us, 0444);
 
 EXT4_ATTR_OFFSET(inode_readahead_blks, 0644, inode_readahead,
 		 ext4_sb_info, s_inode_readahead_blks);
@@ -225,6 +265,8 @@ EXT4_RW_ATTR_SBI_UI(mb_order2_req, s_mb_order2_reqs);
 EXT4_RW_ATTR_SBI_UI(mb_stream_req, s_mb_stream_request);
 EXT4_RW_ATTR_SBI_UI(mb_max_linear_groups, s_mb_max_linear_groups);
 EXT4_RW_ATTR_SBI_UI(extent_max_zeroout_kb, s_extent_max_zeroout_kb);
+EXT4_RW_ATTR_SBI_UI(dir_cache_max_kb, s_dir_cache_max_kb);
+EXT4_RW_ATTR_SBI_UI(dir_bloom_min_kb, s_dir_bloom_min_kb);
 EXT4_ATTR(trigger_fs_error, 0200, trigger_test_error);
 EXT4_RW_ATTR_SBI_PI(err_ratelimit_interval_ms, s_err_ratelimit_state.interval);
 EXT4_RW_ATTR_SBI_PI(err_ratelimit_burst, s_err_ratelimit_state.burst);
@@ -253,6 +295,22 @@ EXT4_ATTR(last_error_time, 0444, last_error_time);
 EXT4_ATTR(journal_task, 0444, journal_task);
 EXT4_RW_ATTR_SBI_UI(mb_prefetch, s_mb_prefetch);
 EXT4_RW_ATTR_SBI_UI(mb_prefetch_limit, s_mb_prefetch_limit);
+EXT4_RW_ATTR_SBI_UI(mb_parallel_scan, s_mb_parallel_scan);
+EXT4_RW_ATTR_SBI_UI(mb_numa_groups, s_mb_numa_groups);
+EXT4_RW_ATTR_SBI_UI(discard_max_kbps, s_discard_max_kbps);
+EXT4_RW_ATTR_SBI_UI(discard_max_iops, s_discard_max_iops);
+EXT4_RW_ATTR_SBI_UI(discard_min_blocks, s_discard_min_blocks);
+EXT4_RO_ATTR_SBI_ATOMIC(discard_queue_depth, s_discard_queued);
+EXT4_RW_ATTR_SBI_UI(trim_parallel, s_trim_parallel);
+EXT4_RW_ATTR_SBI_UI(trim_max_kbps, s_trim_max_kbps);
+EXT4_ATTR_OFFSET(rsv_conversion_max_active, 0644, rsv_conversion_max_active,
+		 ext4_sb_info, s_rsv_conv_max_active);
+EXT4_RO_ATTR_SBI_ATOMIC(rsv_conversion_pending, s_rsv_conv_pending);
+EXT4_RW_ATTR_SBI_UI(lazyinit_parallel, s_li_parallel);
+EXT4_RW_ATTR_SBI_UI(lazyinit_max_kbps, s_li_max_kbps);
+EXT4_ATTR_OFFSET(lazyinit_next_group, 0444, pointer_ui, ext4_sb_info,
+		 s_li_next_group);
+EXT4_RO_ATTR_SBI_ATOMIC(lazyinit_groups_zeroed, s_li_groups_zeroed);
 EXT4_RW_ATTR_SBI_UL(last_trim_minblks, s_last_trim_minblks);
 
 static unsigned int old_bump_val = 128;
@@ -275,6 +333,10 @@ static struct attribute *ext4_attrs[] = {
 	ATTR_LIST(mb_max_linear_groups),
 	ATTR_LIST(max_writeback_mb_bump),
 	ATTR_LIST(extent_max_zeroout_kb),
+	ATTR_LIST(dir_cache_max_kb),
+	ATTR_LIST(dir_bloom_min_kb),
+	ATTR_LIST(dir_bloom_hits),
+	ATTR_LIST(dir_bloom_misses),
 	ATTR_LIST(trigger_fs_error),
 	ATTR_LIST(err_ratelimit_interval_ms),
 	ATTR_LIST(err_ratelimit_burst),
@@ -304,7 +366,24 @@ static struct attribute *ext4_attrs[] = {
 #endif
 	ATTR_LIST(mb_prefetch),
 	ATTR_LIST(mb_prefetch_limit),
+	ATTR_LIST(mb_parallel_scan),
+	ATTR_LIST(mb_numa_groups),
+	ATTR_LIST(discard_max_kbps),
+	ATTR_LIST(discard_max_iops),
+	ATTR_LIST(discard_min_blocks),
+	ATTR_LIST(discard_queue_depth),
+	ATTR_LIST(discard_pending_bytes),
 	ATTR_LIST(last_trim_minblks),
+	ATTR_LIST(trim_parallel),
+	ATTR_LIST(trim_max_kbps),
+	ATTR_LIST(rsv_conversion_max_active),
+	ATTR_LIST(rsv_conversion_pending),
+	ATTR_LIST(rsv_conversion_done),
+	ATTR_LIST(rsv_conversion_avg_wait_us),
+	ATTR_LIST(lazyinit_parallel),
+	ATTR_LIST(lazyinit_max_kbps),
+	ATTR_LIST(lazyinit_next_group),
+	ATTR_LIST(lazyinit_groups_zeroed),
 	NULL,
 };
 ATTRIBUTE_GROUPS(ext4);
@@ -386,6 +465,7 @@ static ssize_t ext4_generic_attr_show(struct ext4_attr *a,
 	case attr_inode_readahead:
 	case attr_clusters_in_group:
 	case attr_mb_order:
+	case attr_rsv_conversion_max_active:
 	case attr_pointer_pi:
 	case attr_pointer_ui:
 		if (a->attr_ptr == ptr_ext4_super_block_offset)
@@ -431,6 +511,24 @@ static ssize_t ext4_attr_show(struct kobject *kobj,
 		return sysfs_emit(buf, "%llu\n",
 				(unsigned long long)
 			percpu_counter_sum(&sbi->s_sra_exceeded_retry_limit));
+	case attr_dir_bloom_hits:
+		return sysfs_emit(buf, "%llu\n",
+				(unsigned long long)
+			percpu_counter_sum(&sbi->s_dir_bloom_hits));
+	case attr_dir_bloom_misses:
+		return sysfs_emit(buf, "%llu\n",
+				(unsigned long long)
+			percpu_counter_sum(&sbi->s_dir_bloom_misses));
+	case attr_rsv_conversion_done:
+		return sysfs_emit(buf, "%llu\n", (unsigned long long)
+				  atomic64_read(&sbi->s_rsv_conv_done));
+	case attr_rsv_conversion_avg_wait_us:
+		return rsv_conversion_avg_wait_us_show(sbi, buf);
+	case attr_discard_pending_bytes:
+		return sysfs_emit(buf, "%llu\n",
+				(unsigned long long) EXT4_C2B(sbi,
+			atomic64_read(&sbi->s_discard_pending)) <<
+				sbi->s_sb->s_blocksize_bits);
 	case attr_feature:
 		return sysfs_emit(buf, "supported\n");
 	case attr_first_error_time:
@@ -513,6 +611,8 @@ static ssize_t ext4_attr_store(struct kobject *kobj,
 		return reserved_clusters_store(sbi, buf, len);
 	case attr_inode_readahead:
 		return inode_readahead_blks_store(sbi, buf, len);
+	case attr_rsv_conversion_max_active:
+		return rsv_conversion_max_active_store(sbi, buf, len);
 	case attr_trigger_test_error:
 		return trigger_test_error(sbi, buf, len);
 	default:
@@ -339,6 +339,24 @@ static void jbd2_block_tag_csum_set(journal_t *j, journal_block_tag_t *tag,
 	else
 		tag->t_checksum = cpu_to_be16(csum32);
 }
+/*
+ * Account how long the commit record took to reach stable storage, which is
+ * what synchronous waiters pay for each commit.  Used for group commit
+ * batching.
+ */
+static void jbd2_update_flush_time(journal_t *journal, ktime_t start)
+{
+	u64 delta = ktime_to_ns(ktime_sub(ktime_get(), start));
+	unsigned long avg = READ_ONCE(journal->j_flush_time);
+
+	delta = min_t(u64, delta, NSEC_PER_SEC);
+	if (avg)
+		avg = (delta + avg * 3ULL) / 4;
+	else
+		avg = delta;
+	WRITE_ONCE(journal->j_flush_time, max(avg, 1UL));
+}
+
 /*
  * jbd2_journal_commit_transaction
  *
@@ -356,7 +374,7 @@ void jbd2_journal_commit_transaction(journal_t *journal)
 	int escape;
 	int err;
 	unsigned long long blocknr;
-	ktime_t start_time;
+	ktime_t start_time, flush_start;
 	u64 commit_time;
 	char *tagp = NULL;
 	journal_block_tag_t *tag = NULL;
@@ -873,6 +891,7 @@ void jbd2_journal_commit_transaction(journal_t *journal)
 	commit_transaction->t_state = T_COMMIT_JFLUSH;
 	write_unlock(&journal->j_state_lock);
 
+	flush_start = ktime_get();
 	if (!jbd2_has_feature_async_commit(journal)) {
 		err = journal_submit_commit_record(journal, commit_transaction,
 						&cbh, crc32_sum);
@@ -886,6 +905,7 @@ void jbd2_journal_commit_transaction(journal_t *journal)
 	    journal->j_flags & JBD2_BARRIER) {
 		blkdev_issue_flush(journal->j_dev);
 	}
+	jbd2_update_flush_time(journal, flush_start);
 
 	if (err)
 		jbd2_journal_abort(journal, err);
@@ -157,6 +157,82 @@ static void commit_timeout(struct timer_list *t)
  *    known as checkpointing, and this thread is responsible for that job.
  */
 
+/*
+ * Group commit: when a commit is requested on behalf of fsync callers, wait
+ * a little for more of them to join the transaction so that they share a
+ * single cache flush.
+ *
+ * We track the rate at which synchronous waiters arrive and how long the
+ * device takes to write the commit record and flush its cache.  The number
+ * of waiters expected to show up during one flush is the batch we aim for:
+ * committing with fewer means the next flush starts right behind this one
+ * with only the stragglers in it, while waiting for more than that only
+ * adds latency.  A single thread doing a stream of fsyncs never arrives
+ * faster than the flushes complete, so it never waits.  The wait is bounded
+ * by the flush time and by j_max_batch_time, and ends as soon as the target
+ * is reached.
+ */
+#define JBD2_MAX_SYNC_BATCH	1024
+
+void jbd2_note_sync_waiter(journal_t *journal, transaction_t *transaction)
+{
+	u64 now = ktime_get_ns();
+	u64 delta = now - atomic64_xchg(&journal->j_last_sync_arrival, now);
+	unsigned long interval = READ_ONCE(journal->j_sync_interval);
+	unsigned int nr;
+
+	/* An idle period shouldn't keep us from batching for long */
+	delta = min_t(u64, delta, NSEC_PER_SEC);
+	if (interval)
+		interval = (delta + interval * 7ULL) / 8;
+	else
+		interval = delta;
+	WRITE_ONCE(journal->j_sync_interval, max(interval, 1UL));
+
+	nr = atomic_inc_return(&transaction->t_sync_waiters);
+	if (nr >= READ_ONCE(journal->j_batch_target) &&
+	    wq_has_sleeper(&journal->j_wait_batch))
+		wake_up(&journal->j_wait_batch);
+}
+
+static void jbd2_group_commit_wait(journal_t *journal,
+				   transaction_t *transaction)
+{
+	unsigned long flush = READ_ONCE(journal->j_flush_time);
+	unsigned long interval = READ_ONCE(journal->j_sync_interval);
+	unsigned int nr = atomic_read(&transaction->t_sync_waiters);
+	unsigned int target;
+	u64 window, age;
+	ktime_t start;
+
+	if (!nr || !journal->j_max_batch_time || !flush || !interval)
+		return;
+
+	target = min_t(unsigned long, flush / interval, JBD2_MAX_SYNC_BATCH);
+	age = ktime_to_ns(ktime_sub(ktime_get(), transaction->t_start_time));
+	window = min_t(u64, (u64)(target - min(nr, target)) * interval, flush);
+	window = clamp_t(u64, window, 1000ULL * journal->j_min_batch_time,
+			 1000ULL * journal->j_max_batch_time);
+	if (nr >= target || age >= window) {
+		trace_jbd2_group_commit(journal->j_fs_dev->bd_dev,
+					transaction->t_tid, nr, target, 0);
+		return;
+	}
+
+	start = ktime_get();
+	WRITE_ONCE(journal->j_batch_target, target);
+	wait_event_hrtimeout(journal->j_wait_batch,
+			atomic_read(&transaction->t_sync_waiters) >= target ||
+			(READ_ONCE(journal->j_flags) & JBD2_UNMOUNT),
+			ns_to_ktime(window - age));
+	WRITE_ONCE(journal->j_batch_target, UINT_MAX);
+
+	trace_jbd2_group_commit(journal->j_fs_dev->bd_dev, transaction->t_tid,
+				atomic_read(&transaction->t_sync_waiters),
+				target,
+				ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
 static int kjournald2(void *arg)
 {
 	journal_t *journal = arg;
@@ -196,8 +272,18 @@ static int kjournald2(void *arg)
 
 	if (journal->j_commit_sequence != journal->j_commit_request) {
 		jbd2_debug(1, "OK, requests differ\n");
+		transaction = journal->j_running_transaction;
+		if (transaction &&
+		    transaction->t_tid != journal->j_commit_request)
+			transaction = NULL;
 		write_unlock(&journal->j_state_lock);
 		del_timer_sync(&journal->j_commit_timer);
+		/*
+		 * Only we commit the running transaction, so it can't go
+		 * away while we wait for it to gather more waiters.
+		 */
+		if (transaction)
+			jbd2_group_commit_wait(journal, transaction);
 		jbd2_journal_commit_transaction(journal);
 		write_lock(&journal->j_state_lock);
 		goto loop;
@@ -783,6 +869,7 @@ int jbd2_complete_transaction(journal_t *journal, tid_t tid)
 	read_lock(&journal->j_state_lock);
 	if (journal->j_running_transaction &&
 	    journal->j_running_transaction->t_tid == tid) {
+		jbd2_note_sync_waiter(journal, journal->j_running_transaction);
 		if (journal->j_commit_request != tid) {
 			/* transaction not yet started, so request it */
 			read_unlock(&journal->j_state_lock);
@@ -1141,6 +1228,10 @@ static int jbd2_seq_info_show(struct seq_file *seq, void *v)
 	    jiffies_to_msecs(s->stats->run.rs_logging / s->stats->ts_tid));
 	seq_printf(seq, "  %lluus average transaction commit time\n",
 		   div_u64(s->journal->j_average_commit_time, 1000));
+	seq_printf(seq, "  %luus average commit flush time\n",
+		   READ_ONCE(s->journal->j_flush_time) / 1000);
+	seq_printf(seq, "  %luus average interval between sync waiters\n",
+		   READ_ONCE(s->journal->j_sync_interval) / 1000);
 	seq_printf(seq, "  %lu handles per transaction\n",
 	    s->stats->run.rs_handle_count / s->stats->ts_tid);
 	seq_printf(seq, "  %lu blocks per transaction\n",
@@ -1537,12 +1628,12 @@ static journal_t *journal_init_common(struct block_device *bdev,
 	init_waitqueue_head(&journal->j_wait_done_commit);
 	init_waitqueue_head(&journal->j_wait_commit);
 	init_waitqueue_head(&journal->j_wait_updates);
+	init_waitqueue_head(&journal->j_wait_batch);
 	init_waitqueue_head(&journal->j_wait_reserved);
 	init_waitqueue_head(&journal->j_fc_wait);
 	mutex_init(&journal->j_abort_mutex);
 	mutex_init(&journal->j_barrier);
 	mutex_init(&journal->j_checkpoint_mutex);
-	spin_lock_init(&journal->j_revoke_lock);
 	spin_lock_init(&journal->j_list_lock);
 	spin_lock_init(&journal->j_history_lock);
 	rwlock_init(&journal->j_state_lock);
@@ -1550,6 +1641,7 @@ static journal_t *journal_init_common(struct block_device *bdev,
 	journal->j_commit_interval = (HZ * JBD2_DEFAULT_MAX_COMMIT_AGE);
 	journal->j_min_batch_time = 0;
 	journal->j_max_batch_time = 15000; /* 15ms */
+	journal->j_batch_target = UINT_MAX;
 	atomic_set(&journal->j_reserved_credits, 0);
 	lockdep_init_map(&journal->j_trans_commit_map, "jbd2_handle",
 			 &jbd2_trans_commit_key, 0);
@@ -1557,8 +1649,14 @@ static journal_t *journal_init_common(struct block_device *bdev,
 	/* The journal is marked for error until we succeed with recovery! */
 	journal->j_flags = JBD2_ABORT;
 
-	/* Set up a default-sized revoke table for the new mount. */
-	err = jbd2_journal_init_revoke(journal, JOURNAL_REVOKE_DEFAULT_HASH);
+	/*
+	 * Set up a revoke table for the new mount, sized so that a journal
+	 * full of revoke records does not make for long hash chains.
+	 */
+	err = jbd2_journal_init_revoke(journal,
+			clamp_t(unsigned int, roundup_pow_of_two(len / 64 + 1),
+				JOURNAL_REVOKE_DEFAULT_HASH,
+				JOURNAL_REVOKE_MAX_HASH / 16));
 	if (err)
 		goto err_cleanup;
 
@@ -20,8 +20,12 @@
 #include <linux/crc32.h>
 #include <linux/blkdev.h>
 #include <linux/string_choices.h>
+#include <linux/hash.h>
+#include <linux/workqueue.h>
 #endif
 
+struct replay_state;
+
 /*
  * Maintain information about the progress of the recovery job, so that
  * the different passes can carry information between them.
@@ -35,6 +39,9 @@ struct recovery_info
 	int		nr_replays;
 	int		nr_revokes;
 	int		nr_revoke_hits;
+
+	/* Parallel replay state for PASS_REPLAY, NULL to replay inline */
+	struct replay_state *replay;
 };
 
 static int do_one_pass(journal_t *journal,
@@ -44,6 +51,9 @@ static int scan_revoke_records(journal_t *, struct buffer_head *,
 
 #ifdef __KERNEL__
 
+static struct replay_state *replay_state_alloc(journal_t *journal);
+static void replay_state_free(struct replay_state *rs);
+
 /* Release readahead buffers after use */
 static void journal_brelse_array(struct buffer_head *b[], int n)
 {
@@ -60,22 +70,25 @@ static void journal_brelse_array(struct buffer_head *b[], int n)
  * do the IO in reasonably large chunks.
  *
  * This is not so critical that we need to be enormously clever about
- * the readahead size, though.  128K is a purely arbitrary, good-enough
- * fixed value.
+ * the readahead size, though.  1M is a purely arbitrary, good-enough
+ * fixed value; the reads are plugged so that they get merged into large
+ * requests.
  */
 
 #define MAXBUF 8
+#define READAHEAD_SIZE	(1024 * 1024)
 static int do_readahead(journal_t *journal, unsigned int start)
 {
 	int err;
 	unsigned int max, nbufs, next;
 	unsigned long long blocknr;
 	struct buffer_head *bh;
+	struct blk_plug plug;
 
 	struct buffer_head * bufs[MAXBUF];
 
-	/* Do up to 128K of readahead */
-	max = start + (128 * 1024 / journal->j_blocksize);
+	/* Do up to READAHEAD_SIZE of readahead */
+	max = start + (READAHEAD_SIZE / journal->j_blocksize);
 	if (max > journal->j_total_len)
 		max = journal->j_total_len;
 
@@ -83,6 +96,7 @@ static int do_readahead(journal_t *journal, unsigned int start)
 	 * a time to the block device IO layer. */
 
 	nbufs = 0;
+	blk_start_plug(&plug);
 
 	for (next = start; next < max; next++) {
 		err = jbd2_journal_bmap(journal, next, &blocknr);
@@ -115,6 +129,7 @@ static int do_readahead(journal_t *journal, unsigned int start)
 	err = 0;
 
 failed:
+	blk_finish_plug(&plug);
 	if (nbufs)
 		journal_brelse_array(bufs, nbufs);
 	return err;
@@ -282,7 +297,8 @@ static int fc_do_one_pass(journal_t *journal,
  * Recovery is done in three passes.  In the first pass, we look for the
  * end of the log.  In the second, we assemble the list of revoke
  * blocks.  In the third and final pass, we replay any un-revoked blocks
- * in the log.
+ * in the log, spread over several workers when more than one CPU is
+ * available.
  */
 int jbd2_journal_recover(journal_t *journal)
 {
@@ -310,8 +326,16 @@ int jbd2_journal_recover(journal_t *journal)
 	err = do_one_pass(journal, &info, PASS_SCAN);
 	if (!err)
 		err = do_one_pass(journal, &info, PASS_REVOKE);
-	if (!err)
+	if (!err) {
+#ifdef __KERNEL__
+		info.replay = replay_state_alloc(journal);
+#endif
 		err = do_one_pass(journal, &info, PASS_REPLAY);
+#ifdef __KERNEL__
+		replay_state_free(info.replay);
+		info.replay = NULL;
+#endif
+	}
 
 	jbd2_debug(1, "JBD2: recovery, exit status %d, "
 		  "recovered transactions %u to %u\n",
@@ -485,6 +509,283 @@ static int jbd2_block_tag_csum_verify(journal_t *j, journal_block_tag_t *tag,
 		return tag->t_checksum == cpu_to_be16(csum32);
 }
 
+/*
+ * Copy one data block from the log back into its home location, unless it
+ * has been revoked since. Errors other than -ENOMEM leave the block
+ * unrecovered but allow recovery of the others to continue.
+ */
+static int jbd2_replay_block(journal_t *journal, struct recovery_info *info,
+			     unsigned long io_block, unsigned long long blocknr,
+			     journal_block_tag_t *tag,
+			     journal_block_tag3_t *tag3, int flags,
+			     unsigned int sequence)
+{
+	struct buffer_head *obh;
+	struct buffer_head *nbh;
+	int err;
+
+	err = jread(&obh, journal, io_block);
+	if (err) {
+		pr_err("JBD2: IO error %d recovering block %lu in log\n",
+		      err, io_block);
+		return err;
+	}
+
+	/* If the block has been revoked, then we're all done here. */
+	if (jbd2_journal_test_revoke(journal, blocknr, sequence)) {
+		brelse(obh);
+		++info->nr_revoke_hits;
+		return 0;
+	}
+
+	/* Look for block corruption */
+	if (!jbd2_block_tag_csum_verify(journal, tag, tag3, obh->b_data,
+					sequence)) {
+		brelse(obh);
+		pr_err("JBD2: Invalid checksum recovering data block %llu in journal block %lu\n",
+		      blocknr, io_block);
+		return -EFSBADCRC;
+	}
+
+	/* Find a buffer for the new data being restored */
+	nbh = __getblk(journal->j_fs_dev, blocknr, journal->j_blocksize);
+	if (nbh == NULL) {
+		pr_err("JBD2: Out of memory during recovery.\n");
+		brelse(obh);
+		return -ENOMEM;
+	}
+
+	lock_buffer(nbh);
+	memcpy(nbh->b_data, obh->b_data, journal->j_blocksize);
+	if (flags & JBD2_FLAG_ESCAPE) {
+		*((__be32 *)nbh->b_data) =
+		cpu_to_be32(JBD2_MAGIC_NUMBER);
+	}
+
+	BUFFER_TRACE(nbh, "marking dirty");
+	set_buffer_uptodate(nbh);
+	mark_buffer_dirty(nbh);
+	BUFFER_TRACE(nbh, "marking uptodate");
+	++info->nr_replays;
+	unlock_buffer(nbh);
+	brelse(obh);
+	brelse(nbh);
+	return 0;
+}
+
+#ifdef __KERNEL__
+
+/*
+ * Parallel replay.  Once the revoke table is complete, the blocks to
+ * replay are independent of each other except for later copies of a
+ * block overwriting earlier ones.  The tags are collected in log order in
+ * batches of REPLAY_BATCH and replayed by a pool of workers, each handling
+ * the target blocks which hash to it in log order, so copies of the same
+ * block are still applied in sequence.  The log blocks of a batch are
+ * read ahead in one plugged sweep, and writeback of the replayed blocks is
+ * started after each batch so that it overlaps with replaying the next.
+ */
+#define REPLAY_MAX_WORKERS	8
+#define REPLAY_BATCH		4096
+
+struct replay_tag {
+	unsigned long long	blocknr;
+	unsigned long		io_block;
+	unsigned int		sequence;
+	int			flags;
+	union {
+		journal_block_tag_t	tag;
+		journal_block_tag3_t	tag3;
+	};
+};
+
+struct replay_worker {
+	struct work_struct	work;
+	struct replay_state	*rs;
+	unsigned int		index;
+	struct recovery_info	info;
+	int			err;
+};
+
+struct replay_state {
+	journal_t		*journal;
+	struct replay_tag	*tags;
+	unsigned int		nr_tags;
+	unsigned int		nr_workers;
+	struct replay_worker	workers[REPLAY_MAX_WORKERS];
+};
+
+static void replay_work_fn(struct work_struct *work)
+{
+	struct replay_worker *w = container_of(work, struct replay_worker,
+					       work);
+	struct replay_state *rs = w->rs;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < rs->nr_tags; i++) {
+		struct replay_tag *rt = &rs->tags[i];
+
+		if (hash_64(rt->blocknr, 32) % rs->nr_workers != w->index)
+			continue;
+		err = jbd2_replay_block(rs->journal, &w->info, rt->io_block,
+					rt->blocknr, &rt->tag, &rt->tag3,
+					rt->flags, rt->sequence);
+		if (err == -ENOMEM) {
+			w->err = err;
+			break;
+		}
+		if (err && !w->err)
+			w->err = err;
+		cond_resched();
+	}
+}
+
+static struct replay_state *replay_state_alloc(journal_t *journal)
+{
+	unsigned int nr_workers = min_t(unsigned int, num_online_cpus(),
+					 REPLAY_MAX_WORKERS);
+	struct replay_state *rs;
+	unsigned int i;
+
+	if (nr_workers < 2)
+		return NULL;
+
+	rs = kzalloc(sizeof(*rs), GFP_KERNEL);
+	if (!rs)
+		return NULL;
+	rs->tags = kvmalloc_array(REPLAY_BATCH, sizeof(*rs->tags),
+				  GFP_KERNEL);
+	if (!rs->tags) {
+		kfree(rs);
+		return NULL;
+	}
+	rs->journal = journal;
+	rs->nr_workers = nr_workers;
+	for (i = 0; i < nr_workers; i++) {
+		INIT_WORK(&rs->workers[i].work, replay_work_fn);
+		rs->workers[i].rs = rs;
+		rs->workers[i].index = i;
+	}
+	jbd2_debug(1, "JBD2: replaying with %u workers\n", nr_workers);
+	return rs;
+}
+
+static void replay_state_free(struct replay_state *rs)
+{
+	if (!rs)
+		return;
+	kvfree(rs->tags);
+	kfree(rs);
+}
+
+/* Read ahead the log blocks of the batch, which are mostly contiguous */
+static void replay_readahead(struct replay_state *rs)
+{
+	journal_t *journal = rs->journal;
+	struct buffer_head *bufs[MAXBUF];
+	struct buffer_head *bh;
+	unsigned long long blocknr;
+	unsigned int i, nbufs = 0;
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < rs->nr_tags; i++) {
+		if (jbd2_journal_bmap(journal, rs->tags[i].io_block, &blocknr))
+			continue;
+		bh = __getblk(journal->j_dev, blocknr, journal->j_blocksize);
+		if (!bh)
+			break;
+		if (buffer_uptodate(bh) || buffer_locked(bh)) {
+			brelse(bh);
+			continue;
+		}
+		bufs[nbufs++] = bh;
+		if (nbufs == MAXBUF) {
+			bh_readahead_batch(nbufs, bufs, 0);
+			journal_brelse_array(bufs, nbufs);
+			nbufs = 0;
+		}
+	}
+	if (nbufs) {
+		bh_readahead_batch(nbufs, bufs, 0);
+		journal_brelse_array(bufs, nbufs);
+	}
+	blk_finish_plug(&plug);
+}
+
+/* Replay the collected batch of tags and wait for it to complete. */
+static int replay_dispatch(struct replay_state *rs,
+			   struct recovery_info *info)
+{
+	unsigned int i;
+	int err = 0;
+
+	if (!rs->nr_tags)
+		return 0;
+
+	replay_readahead(rs);
+	for (i = 0; i < rs->nr_workers; i++)
+		queue_work(system_unbound_wq, &rs->workers[i].work);
+
+	for (i = 0; i < rs->nr_workers; i++) {
+		struct replay_worker *w = &rs->workers[i];
+
+		flush_work(&w->work);
+		info->nr_replays += w->info.nr_replays;
+		info->nr_revoke_hits += w->info.nr_revoke_hits;
+		w->info.nr_replays = 0;
+		w->info.nr_revoke_hits = 0;
+		if (w->err && (!err || w->err == -ENOMEM))
+			err = w->err;
+		w->err = 0;
+	}
+	rs->nr_tags = 0;
+
+	/* Block device writeback is plugged, so adjacent blocks get merged */
+	filemap_fdatawrite(rs->journal->j_fs_dev->bd_mapping);
+	return err;
+}
+
+static int replay_queue(struct replay_state *rs, struct recovery_info *info,
+			unsigned long io_block, unsigned long long blocknr,
+			char *tagp, int tag_bytes, int flags,
+			unsigned int sequence)
+{
+	struct replay_tag *rt;
+	int err = 0;
+
+	if (rs->nr_tags == REPLAY_BATCH)
+		err = replay_dispatch(rs, info);
+
+	rt = &rs->tags[rs->nr_tags++];
+	rt->blocknr = blocknr;
+	rt->io_block = io_block;
+	rt->sequence = sequence;
+	rt->flags = flags;
+	memset(&rt->tag3, 0, sizeof(rt->tag3));
+	memcpy(&rt->tag3, tagp, min_t(int, tag_bytes, sizeof(rt->tag3)));
+	return err;
+}
+
+#else /* __KERNEL__ */
+
+static int replay_dispatch(struct replay_state *rs,
+			   struct recovery_info *info)
+{
+	return 0;
+}
+
+static int replay_queue(struct replay_state *rs, struct recovery_info *info,
+			unsigned long io_block, unsigned long long blocknr,
+			char *tagp, int tag_bytes, int flags,
+			unsigned int sequence)
+{
+	return 0;
+}
+
+#endif /* __KERNEL__ */
+
 static __always_inline int jbd2_do_replay(journal_t *journal,
 					  struct recovery_info *info,
 					  struct buffer_head *bh,
@@ -498,8 +799,6 @@ static __always_inline int jbd2_do_replay(journal_t *journal,
 	int descr_csum_size = 0;
 	unsigned long io_block;
 	journal_block_tag_t tag;
-	struct buffer_head *obh;
-	struct buffer_head *nbh;
 
 	if (jbd2_journal_has_csum_v2or3(journal))
 		descr_csum_size = sizeof(struct jbd2_journal_block_tail);
@@ -507,71 +806,30 @@ static __always_inline int jbd2_do_replay(journal_t *journal,
 	tagp = &bh->b_data[sizeof(journal_header_t)];
 	while (tagp - bh->b_data + tag_bytes <=
 	       journal->j_blocksize - descr_csum_size) {
+		unsigned long long blocknr;
 		int err;
 
 		memcpy(&tag, tagp, sizeof(tag));
 		flags = be16_to_cpu(tag.t_flags);
+		blocknr = read_tag_block(journal, &tag);
 
 		io_block = (*next_log_block)++;
 		wrap(journal, *next_log_block);
-		err = jread(&obh, journal, io_block);
-		if (err) {
-			/* Recover what we can, but report failure at the end. */
+		if (info->replay)
+			err = replay_queue(info->replay, info, io_block,
+					   blocknr, tagp, tag_bytes, flags,
+					   next_commit_ID);
+		else
+			err = jbd2_replay_block(journal, info, io_block,
+					blocknr, &tag,
+					(journal_block_tag3_t *)tagp, flags,
+					next_commit_ID);
+		if (err == -ENOMEM)
+			return err;
+		/* Recover what we can, but report failure at the end. */
+		if (err)
 			ret = err;
-			pr_err("JBD2: IO error %d recovering block %lu in log\n",
-			      err, io_block);
-		} else {
-			unsigned long long blocknr;
-
-			J_ASSERT(obh != NULL);
-			blocknr = read_tag_block(journal, &tag);
-
-			/* If the block has been revoked, then we're all done here. */
-			if (jbd2_journal_test_revoke(journal, blocknr,
-						     next_commit_ID)) {
-				brelse(obh);
-				++info->nr_revoke_hits;
-				goto skip_write;
-			}
-
-			/* Look for block corruption */
-			if (!jbd2_block_tag_csum_verify(journal, &tag,
-					(journal_block_tag3_t *)tagp,
-					obh->b_data, next_commit_ID)) {
-				brelse(obh);
-				ret = -EFSBADCRC;
-				pr_err("JBD2: Invalid checksum recovering data block %llu in journal block %lu\n",
-				      blocknr, io_block);
-				goto skip_write;
-			}
-
-			/* Find a buffer for the new data being restored */
-			nbh = __getblk(journal->j_fs_dev, blocknr,
-				       journal->j_blocksize);
-			if (nbh == NULL) {
-				pr_err("JBD2: Out of memory during recovery.\n");
-				brelse(obh);
-				return -ENOMEM;
-			}
 
-			lock_buffer(nbh);
-			memcpy(nbh->b_data, obh->b_data, journal->j_blocksize);
-			if (flags & JBD2_FLAG_ESCAPE) {
-				*((__be32 *)nbh->b_data) =
-				cpu_to_be32(JBD2_MAGIC_NUMBER);
-			}
-
-			BUFFER_TRACE(nbh, "marking dirty");
-			set_buffer_uptodate(nbh);
-			mark_buffer_dirty(nbh);
-			BUFFER_TRACE(nbh, "marking uptodate");
-			++info->nr_replays;
-			unlock_buffer(nbh);
-			brelse(obh);
-			brelse(nbh);
-		}
-
-skip_write:
 		tagp += tag_bytes;
 		if (!(flags & JBD2_FLAG_SAME_UUID))
 			tagp += 16;
@@ -883,6 +1141,14 @@ static int do_one_pass(journal_t *journal,
 
  done:
 	brelse(bh);
+	/* Replay what is still queued before fast commits are applied */
+	if (pass == PASS_REPLAY && info->replay) {
+		err = replay_dispatch(info->replay, info);
+		if (err == -ENOMEM)
+			return err;
+		if (err)
+			success = err;
+	}
 	/*
 	 * We broke out of the log scan loop: either we came to the
 	 * known end of the log or we found an unexpected block in the
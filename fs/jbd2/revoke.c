@@ -69,12 +69,16 @@
  *
  * All users operating on the hash table belonging to the running transaction
  * have a handle to the transaction. Therefore they are safe from kjournald
- * switching hash tables under them. For operations on the lists of entries in
- * the hash table j_revoke_lock is used.
+ * switching hash tables under them. Each hash bucket has its own lock which
+ * protects additions to and removals from its list of entries, so that
+ * revokes and cancels of unrelated blocks from many CPUs do not contend.
+ * Lookups walk the lists under RCU without taking the bucket lock, and
+ * records removed while the table is in use are freed after a grace period.
  *
  * Finally, also replay code uses the hash tables but at this moment no one else
- * can touch them (filesystem isn't mounted yet) and hence no locking is
- * needed.
+ * can touch them (filesystem isn't mounted yet).  Records are only added
+ * during the revoke pass, so the replay pass may look them up from several
+ * threads at once.
  */
 
 #ifndef __KERNEL__
@@ -90,6 +94,7 @@
 #include <linux/bio.h>
 #include <linux/log2.h>
 #include <linux/hash.h>
+#include <linux/rculist.h>
 #endif
 
 static struct kmem_cache *jbd2_revoke_record_cache;
@@ -101,12 +106,20 @@ static struct kmem_cache *jbd2_revoke_table_cache;
 
 struct jbd2_revoke_record_s
 {
-	struct list_head  hash;
+	struct hlist_node hash;
 	tid_t		  sequence;	/* Used for recovery only */
 	unsigned long long	  blocknr;
+	struct rcu_head	  rcu;
 };
 
 
+/* A revoke table hash bucket, with the lock protecting its list. */
+struct jbd2_revoke_bucket_s
+{
+	spinlock_t	  lock;
+	struct hlist_head records;
+};
+
 /* The revoke table is just a simple hash table of revoke records. */
 struct jbd2_revoke_table_s
 {
@@ -114,7 +127,7 @@ struct jbd2_revoke_table_s
 	 * for recovery.  Must be a power of two. */
 	int		  hash_size;
 	int		  hash_shift;
-	struct list_head *hash_table;
+	struct jbd2_revoke_bucket_s *hash_table;
 };
 
 
@@ -128,15 +141,18 @@ static void flush_descriptor(journal_t *, struct buffer_head *, int);
 
 /* Utility functions to maintain the revoke table */
 
-static inline int hash(journal_t *journal, unsigned long long block)
+static inline struct jbd2_revoke_bucket_s *
+revoke_bucket(journal_t *journal, unsigned long long block)
 {
-	return hash_64(block, journal->j_revoke->hash_shift);
+	struct jbd2_revoke_table_s *table = journal->j_revoke;
+
+	return &table->hash_table[hash_64(block, table->hash_shift)];
 }
 
 static int insert_revoke_hash(journal_t *journal, unsigned long long blocknr,
 			      tid_t seq)
 {
-	struct list_head *hash_list;
+	struct jbd2_revoke_bucket_s *bucket;
 	struct jbd2_revoke_record_s *record;
 	gfp_t gfp_mask = GFP_NOFS;
 
@@ -148,38 +164,42 @@ static int insert_revoke_hash(journal_t *journal, unsigned long long blocknr,
 
 	record->sequence = seq;
 	record->blocknr = blocknr;
-	hash_list = &journal->j_revoke->hash_table[hash(journal, blocknr)];
-	spin_lock(&journal->j_revoke_lock);
-	list_add(&record->hash, hash_list);
-	spin_unlock(&journal->j_revoke_lock);
+	bucket = revoke_bucket(journal, blocknr);
+	spin_lock(&bucket->lock);
+	hlist_add_head_rcu(&record->hash, &bucket->records);
+	spin_unlock(&bucket->lock);
 	return 0;
 }
 
-/* Find a revoke record in the journal's hash table. */
+/*
+ * Find a revoke record in the journal's hash table.  The caller must hold
+ * rcu_read_lock() or the lock of the record's bucket, or otherwise make
+ * sure the record cannot be removed while it is being used.
+ */
 
 static struct jbd2_revoke_record_s *find_revoke_record(journal_t *journal,
 						      unsigned long long blocknr)
 {
-	struct list_head *hash_list;
+	struct jbd2_revoke_bucket_s *bucket = revoke_bucket(journal, blocknr);
 	struct jbd2_revoke_record_s *record;
 
-	hash_list = &journal->j_revoke->hash_table[hash(journal, blocknr)];
-
-	spin_lock(&journal->j_revoke_lock);
-	record = (struct jbd2_revoke_record_s *) hash_list->next;
-	while (&(record->hash) != hash_list) {
-		if (record->blocknr == blocknr) {
-			spin_unlock(&journal->j_revoke_lock);
+	hlist_for_each_entry_rcu(record, &bucket->records, hash,
+				 lockdep_is_held(&bucket->lock))
+		if (record->blocknr == blocknr)
 			return record;
-		}
-		record = (struct jbd2_revoke_record_s *) record->hash.next;
-	}
-	spin_unlock(&journal->j_revoke_lock);
 	return NULL;
 }
 
+static void revoke_record_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(jbd2_revoke_record_cache,
+			container_of(head, struct jbd2_revoke_record_s, rcu));
+}
+
 void jbd2_journal_destroy_revoke_record_cache(void)
 {
+	/* Wait for records freed by jbd2_journal_cancel_revoke() */
+	rcu_barrier();
 	kmem_cache_destroy(jbd2_revoke_record_cache);
 	jbd2_revoke_record_cache = NULL;
 }
@@ -230,16 +250,18 @@ static struct jbd2_revoke_table_s *jbd2_journal_init_revoke_table(int hash_size)
 
 	table->hash_size = hash_size;
 	table->hash_shift = shift;
-	table->hash_table =
-		kmalloc_array(hash_size, sizeof(struct list_head), GFP_KERNEL);
+	table->hash_table = kvmalloc_array(hash_size,
+				sizeof(struct jbd2_revoke_bucket_s), GFP_KERNEL);
 	if (!table->hash_table) {
 		kmem_cache_free(jbd2_revoke_table_cache, table);
 		table = NULL;
 		goto out;
 	}
 
-	for (tmp = 0; tmp < hash_size; tmp++)
-		INIT_LIST_HEAD(&table->hash_table[tmp]);
+	for (tmp = 0; tmp < hash_size; tmp++) {
+		spin_lock_init(&table->hash_table[tmp].lock);
+		INIT_HLIST_HEAD(&table->hash_table[tmp].records);
+	}
 
 out:
 	return table;
@@ -248,14 +270,11 @@ static struct jbd2_revoke_table_s *jbd2_journal_init_revoke_table(int hash_size)
 static void jbd2_journal_destroy_revoke_table(struct jbd2_revoke_table_s *table)
 {
 	int i;
-	struct list_head *hash_list;
 
-	for (i = 0; i < table->hash_size; i++) {
-		hash_list = &table->hash_table[i];
-		J_ASSERT(list_empty(hash_list));
-	}
+	for (i = 0; i < table->hash_size; i++)
+		J_ASSERT(hlist_empty(&table->hash_table[i].records));
 
-	kfree(table->hash_table);
+	kvfree(table->hash_table);
 	kmem_cache_free(jbd2_revoke_table_cache, table);
 }
 
@@ -275,8 +294,6 @@ int jbd2_journal_init_revoke(journal_t *journal, int hash_size)
 
 	journal->j_revoke = journal->j_revoke_table[1];
 
-	spin_lock_init(&journal->j_revoke_lock);
-
 	return 0;
 
 fail1:
@@ -286,6 +303,38 @@ int jbd2_journal_init_revoke(journal_t *journal, int hash_size)
 	return -ENOMEM;
 }
 
+/*
+ * Replace the revoke tables of a journal with tables of a different size.
+ * Only allowed before the journal is loaded, while the tables are empty.
+ */
+int jbd2_journal_resize_revoke(journal_t *journal, int hash_size)
+{
+	struct jbd2_revoke_table_s *table[2];
+
+	if (!is_power_of_2(hash_size) || hash_size > JOURNAL_REVOKE_MAX_HASH)
+		return -EINVAL;
+	if (WARN_ON_ONCE(journal->j_flags & JBD2_LOADED))
+		return -EBUSY;
+	if (journal->j_revoke->hash_size == hash_size)
+		return 0;
+
+	table[0] = jbd2_journal_init_revoke_table(hash_size);
+	if (!table[0])
+		return -ENOMEM;
+	table[1] = jbd2_journal_init_revoke_table(hash_size);
+	if (!table[1]) {
+		jbd2_journal_destroy_revoke_table(table[0]);
+		return -ENOMEM;
+	}
+
+	jbd2_journal_destroy_revoke(journal);
+	journal->j_revoke_table[0] = table[0];
+	journal->j_revoke_table[1] = table[1];
+	journal->j_revoke = table[1];
+	return 0;
+}
+EXPORT_SYMBOL(jbd2_journal_resize_revoke);
+
 /* Destroy a journal's revoke table.  The table must already be empty! */
 void jbd2_journal_destroy_revoke(journal_t *journal)
 {
@@ -441,22 +490,37 @@ int jbd2_journal_cancel_revoke(handle_t *handle, struct journal_head *jh)
 		clear_buffer_revoked(bh);
 	}
 
+	/*
+	 * Most buffers were never revoked, so check locklessly first and only
+	 * take the bucket lock to remove a record we have found.
+	 */
 	if (need_cancel) {
+		rcu_read_lock();
 		record = find_revoke_record(journal, bh->b_blocknr);
+		rcu_read_unlock();
+	}
+	if (need_cancel && record) {
+		struct jbd2_revoke_bucket_s *bucket;
+
+		bucket = revoke_bucket(journal, bh->b_blocknr);
+		spin_lock(&bucket->lock);
+		record = find_revoke_record(journal, bh->b_blocknr);
+		if (record)
+			hlist_del_rcu(&record->hash);
+		spin_unlock(&bucket->lock);
 		if (record) {
 			jbd2_debug(4, "cancelled existing revoke on "
 				  "blocknr %llu\n", (unsigned long long)bh->b_blocknr);
-			spin_lock(&journal->j_revoke_lock);
-			list_del(&record->hash);
-			spin_unlock(&journal->j_revoke_lock);
-			kmem_cache_free(jbd2_revoke_record_cache, record);
+			call_rcu(&record->rcu, revoke_record_free_rcu);
 			did_revoke = 1;
 		}
 	}
 
 #ifdef JBD2_EXPENSIVE_CHECKING
 	/* There better not be one left behind by now! */
+	rcu_read_lock();
 	record = find_revoke_record(journal, bh->b_blocknr);
+	rcu_read_unlock();
 	J_ASSERT_JH(jh, record == NULL);
 #endif
 
@@ -487,14 +551,12 @@ void jbd2_clear_buffer_revoked_flags(journal_t *journal)
 	int i = 0;
 
 	for (i = 0; i < revoke->hash_size; i++) {
-		struct list_head *hash_list;
-		struct list_head *list_entry;
-		hash_list = &revoke->hash_table[i];
+		struct jbd2_revoke_record_s *record;
 
-		list_for_each(list_entry, hash_list) {
-			struct jbd2_revoke_record_s *record;
+		hlist_for_each_entry(record, &revoke->hash_table[i].records,
+				     hash) {
 			struct buffer_head *bh;
-			record = (struct jbd2_revoke_record_s *)list_entry;
+
 			bh = __find_get_block(journal->j_fs_dev,
 					      record->blocknr,
 					      journal->j_blocksize);
@@ -520,7 +582,7 @@ void jbd2_journal_switch_revoke_table(journal_t *journal)
 		journal->j_revoke = journal->j_revoke_table[0];
 
 	for (i = 0; i < journal->j_revoke->hash_size; i++)
-		INIT_LIST_HEAD(&journal->j_revoke->hash_table[i]);
+		INIT_HLIST_HEAD(&journal->j_revoke->hash_table[i].records);
 }
 
 /*
@@ -534,7 +596,7 @@ void jbd2_journal_write_revoke_records(transaction_t *transaction,
 	struct buffer_head *descriptor;
 	struct jbd2_revoke_record_s *record;
 	struct jbd2_revoke_table_s *revoke;
-	struct list_head *hash_list;
+	struct hlist_node *tmp;
 	int i, offset, count;
 
 	descriptor = NULL;
@@ -545,16 +607,17 @@ void jbd2_journal_write_revoke_records(transaction_t *transaction,
 	revoke = journal->j_revoke == journal->j_revoke_table[0] ?
 		journal->j_revoke_table[1] : journal->j_revoke_table[0];
 
+	/*
+	 * The committing table is no longer reachable from handles, so it
+	 * can be emptied without the bucket locks.
+	 */
 	for (i = 0; i < revoke->hash_size; i++) {
-		hash_list = &revoke->hash_table[i];
-
-		while (!list_empty(hash_list)) {
-			record = (struct jbd2_revoke_record_s *)
-				hash_list->next;
+		hlist_for_each_entry_safe(record, tmp,
+					  &revoke->hash_table[i].records, hash) {
 			write_one_revoke_record(transaction, log_bufs,
 						&descriptor, &offset, record);
 			count++;
-			list_del(&record->hash);
+			hlist_del(&record->hash);
 			kmem_cache_free(jbd2_revoke_record_cache, record);
 		}
 	}
@@ -686,14 +749,17 @@ int jbd2_journal_set_revoke(journal_t *journal,
 {
 	struct jbd2_revoke_record_s *record;
 
+	rcu_read_lock();
 	record = find_revoke_record(journal, blocknr);
 	if (record) {
 		/* If we have multiple occurrences, only record the
 		 * latest sequence number in the hashed record */
 		if (tid_gt(sequence, record->sequence))
-			record->sequence = sequence;
+			WRITE_ONCE(record->sequence, sequence);
+		rcu_read_unlock();
 		return 0;
 	}
+	rcu_read_unlock();
 	return insert_revoke_hash(journal, blocknr, sequence);
 }
 
@@ -709,13 +775,15 @@ int jbd2_journal_test_revoke(journal_t *journal,
 			tid_t sequence)
 {
 	struct jbd2_revoke_record_s *record;
+	int ret = 0;
 
+	/* May be called from several replay threads at once */
+	rcu_read_lock();
 	record = find_revoke_record(journal, blocknr);
-	if (!record)
-		return 0;
-	if (tid_gt(sequence, record->sequence))
-		return 0;
-	return 1;
+	if (record && !tid_gt(sequence, READ_ONCE(record->sequence)))
+		ret = 1;
+	rcu_read_unlock();
+	return ret;
 }
 
 /*
@@ -726,17 +794,16 @@ int jbd2_journal_test_revoke(journal_t *journal,
 void jbd2_journal_clear_revoke(journal_t *journal)
 {
 	int i;
-	struct list_head *hash_list;
+	struct hlist_node *tmp;
 	struct jbd2_revoke_record_s *record;
 	struct jbd2_revoke_table_s *revoke;
 
 	revoke = journal->j_revoke;
 
 	for (i = 0; i < revoke->hash_size; i++) {
-		hash_list = &revoke->hash_table[i];
-		while (!list_empty(hash_list)) {
-			record = (struct jbd2_revoke_record_s*) hash_list->next;
-			list_del(&record->hash);
+		hlist_for_each_entry_safe(record, tmp,
+					  &revoke->hash_table[i].records, hash) {
+			hlist_del(&record->hash);
 			kmem_cache_free(jbd2_revoke_record_cache, record);
 		}
 	}
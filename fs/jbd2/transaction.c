@@ -91,6 +91,7 @@ static void jbd2_get_transaction(journal_t *journal,
 		   atomic_read(&journal->j_reserved_credits));
 	atomic_set(&transaction->t_outstanding_revokes, 0);
 	atomic_set(&transaction->t_handle_count, 0);
+	atomic_set(&transaction->t_sync_waiters, 0);
 	INIT_LIST_HEAD(&transaction->t_inode_list);
 	INIT_LIST_HEAD(&transaction->t_private_list);
 
@@ -1827,7 +1828,6 @@ int jbd2_journal_stop(handle_t *handle)
 	journal_t *journal;
 	int err = 0, wait_for_commit = 0;
 	tid_t tid;
-	pid_t pid;
 
 	if (--handle->h_ref > 0) {
 		jbd2_debug(4, "h_ref %d -> %d\n", handle->h_ref + 1,
@@ -1859,63 +1859,15 @@ int jbd2_journal_stop(handle_t *handle)
 				 handle->h_total_credits));
 
 	/*
-	 * Implement synchronous transaction batching.  If the handle
-	 * was synchronous, don't force a commit immediately.  Let's
-	 * yield and let another thread piggyback onto this
-	 * transaction.  Keep doing that while new threads continue to
-	 * arrive.  It doesn't cost much - we're about to run a commit
-	 * and sleep on IO anyway.  Speeds up many-threaded, many-dir
-	 * operations by 30x or more...
-	 *
-	 * We try and optimize the sleep time against what the
-	 * underlying disk can do, instead of having a static sleep
-	 * time.  This is useful for the case where our storage is so
-	 * fast that it is more optimal to go ahead and force a flush
-	 * and wait for the transaction to be committed than it is to
-	 * wait for an arbitrary amount of time for new writers to
-	 * join the transaction.  We achieve this by measuring how
-	 * long it takes to commit a transaction, and compare it with
-	 * how long this transaction has been running, and if run time
-	 * < commit time then we sleep for the delta and commit.  This
-	 * greatly helps super fast disks that would see slowdowns as
-	 * more threads started doing fsyncs.
-	 *
-	 * But don't do this if this process was the most recent one
-	 * to perform a synchronous write.  We do this to detect the
-	 * case where a single process is doing a stream of sync
-	 * writes.  No point in waiting for joiners in that case.
-	 *
-	 * Setting max_batch_time to 0 disables this completely.
+	 * Synchronous handles don't sleep here waiting for others to join
+	 * the transaction any more: the commit thread batches all waiters
+	 * of the transaction, see jbd2_group_commit_wait().  Just let it
+	 * know another one has arrived.
 	 */
-	pid = current->pid;
-	if (handle->h_sync && journal->j_last_sync_writer != pid &&
-	    journal->j_max_batch_time) {
-		u64 commit_time, trans_time;
-
-		journal->j_last_sync_writer = pid;
-
-		read_lock(&journal->j_state_lock);
-		commit_time = journal->j_average_commit_time;
-		read_unlock(&journal->j_state_lock);
-
-		trans_time = ktime_to_ns(ktime_sub(ktime_get(),
-						   transaction->t_start_time));
-
-		commit_time = max_t(u64, commit_time,
-				    1000*journal->j_min_batch_time);
-		commit_time = min_t(u64, commit_time,
-				    1000*journal->j_max_batch_time);
-
-		if (trans_time < commit_time) {
-			ktime_t expires = ktime_add_ns(ktime_get(),
-						       commit_time);
-			set_current_state(TASK_UNINTERRUPTIBLE);
-			schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
-		}
-	}
-
-	if (handle->h_sync)
+	if (handle->h_sync) {
+		jbd2_note_sync_waiter(journal, transaction);
 		transaction->t_synchronous_commit = 1;
+	}
 
 	/*
 	 * If the handle is marked SYNC, we need to set another commit
@@ -3,6 +3,7 @@
 #include <linux/slab.h>
 #include <linux/list.h>
 #include <linux/list_bl.h>
+#include <linux/rculist_bl.h>
 #include <linux/module.h>
 #include <linux/sched.h>
 #include <linux/workqueue.h>
@@ -23,20 +24,40 @@
  * We provide functions for creation and removal of entries, search by key,
  * and a special "delete entry with given key-value pair" operation. Fixed
  * size hash table is used for fast key lookups.
+ *
+ * Lookups walk the hash chains under RCU and only take a reference with
+ * atomic_inc_not_zero(); the hash chain bit lock is taken only to insert or
+ * remove entries and entries are freed after an RCU grace period. The LRU
+ * is split into shards selected by key and value, so that creating and
+ * reclaiming entries does not serialize on a single list lock even when
+ * many of them share a key (identical xattr blocks). Reclaim is driven by
+ * the number of entries in the whole cache.
  */
 
+/* Upper bound on log2 of the number of LRU shards */
+#define MB_CACHE_LRU_BITS_MAX	6
+
+struct mb_cache_lru {
+	/* Protects l_list */
+	spinlock_t		l_lock;
+	struct list_head	l_list;
+} ____cacheline_aligned_in_smp;
+
 struct mb_cache {
 	/* Hash table of entries */
 	struct hlist_bl_head	*c_hash;
 	/* log2 of hash table size */
 	int			c_bucket_bits;
+	/* log2 of number of LRU shards */
+	int			c_lru_bits;
 	/* Maximum entries in cache to avoid degrading hash too much */
 	unsigned long		c_max_entries;
-	/* Protects c_list, c_entry_count */
-	spinlock_t		c_list_lock;
-	struct list_head	c_list;
 	/* Number of entries in cache */
-	unsigned long		c_entry_count;
+	atomic_long_t		c_entry_count;
+	/* LRU shards, indexed by key and value */
+	struct mb_cache_lru	*c_lru;
+	/* Shard where the next reclaim pass starts */
+	atomic_t		c_lru_next;
 	struct shrinker		*c_shrink;
 	/* Work for shrinking when the cache has too many entries */
 	struct work_struct	c_shrink_work;
@@ -53,6 +74,13 @@ static inline struct hlist_bl_head *mb_cache_entry_head(struct mb_cache *cache,
 	return &cache->c_hash[hash_32(key, cache->c_bucket_bits)];
 }
 
+static inline struct mb_cache_lru *mb_cache_entry_lru(struct mb_cache *cache,
+						      u32 key, u64 value)
+{
+	return &cache->c_lru[hash_64(value ^ ((u64)key << 32),
+				     cache->c_lru_bits)];
+}
+
 /*
  * Number of entries to reclaim synchronously when there are too many entries
  * in cache
@@ -74,15 +102,17 @@ static inline struct hlist_bl_head *mb_cache_entry_head(struct mb_cache *cache,
 int mb_cache_entry_create(struct mb_cache *cache, gfp_t mask, u32 key,
 			  u64 value, bool reusable)
 {
+	struct mb_cache_lru *lru = mb_cache_entry_lru(cache, key, value);
+	unsigned long count = atomic_long_read(&cache->c_entry_count);
 	struct mb_cache_entry *entry, *dup;
 	struct hlist_bl_node *dup_node;
 	struct hlist_bl_head *head;
 
 	/* Schedule background reclaim if there are too many entries */
-	if (cache->c_entry_count >= cache->c_max_entries)
+	if (count >= cache->c_max_entries)
 		schedule_work(&cache->c_shrink_work);
 	/* Do some sync reclaim if background reclaim cannot keep up */
-	if (cache->c_entry_count >= 2*cache->c_max_entries)
+	if (count >= 2*cache->c_max_entries)
 		mb_cache_shrink(cache, SYNC_SHRINK_BATCH);
 
 	entry = kmem_cache_alloc(mb_entry_cache, mask);
@@ -94,7 +124,7 @@ int mb_cache_entry_create(struct mb_cache *cache, gfp_t mask, u32 key,
 	 * We create entry with two references. One reference is kept by the
 	 * hash table, the other reference is used to protect us from
 	 * mb_cache_entry_delete_or_get() until the entry is fully setup. This
-	 * avoids nesting of cache->c_list_lock into hash table bit locks which
+	 * avoids nesting of the LRU shard lock into hash table bit locks which
 	 * is problematic for RT.
 	 */
 	atomic_set(&entry->e_refcnt, 2);
@@ -112,27 +142,34 @@ int mb_cache_entry_create(struct mb_cache *cache, gfp_t mask, u32 key,
 			return -EBUSY;
 		}
 	}
-	hlist_bl_add_head(&entry->e_hash_list, head);
+	hlist_bl_add_head_rcu(&entry->e_hash_list, head);
 	hlist_bl_unlock(head);
-	spin_lock(&cache->c_list_lock);
-	list_add_tail(&entry->e_list, &cache->c_list);
-	cache->c_entry_count++;
-	spin_unlock(&cache->c_list_lock);
+	spin_lock(&lru->l_lock);
+	list_add_tail(&entry->e_list, &lru->l_list);
+	spin_unlock(&lru->l_lock);
+	atomic_long_inc(&cache->c_entry_count);
 	mb_cache_entry_put(cache, entry);
 
 	return 0;
 }
 EXPORT_SYMBOL(mb_cache_entry_create);
 
+static void mb_cache_entry_free_rcu(struct rcu_head *rcu)
+{
+	kmem_cache_free(mb_entry_cache,
+			container_of(rcu, struct mb_cache_entry, e_rcu));
+}
+
 void __mb_cache_entry_free(struct mb_cache *cache, struct mb_cache_entry *entry)
 {
 	struct hlist_bl_head *head;
 
 	head = mb_cache_entry_head(cache, entry->e_key);
 	hlist_bl_lock(head);
-	hlist_bl_del(&entry->e_hash_list);
+	hlist_bl_del_rcu(&entry->e_hash_list);
 	hlist_bl_unlock(head);
-	kmem_cache_free(mb_entry_cache, entry);
+	/* Lockless lookups may still be walking over the entry */
+	call_rcu(&entry->e_rcu, mb_cache_entry_free_rcu);
 }
 EXPORT_SYMBOL(__mb_cache_entry_free);
 
@@ -158,11 +195,11 @@ static struct mb_cache_entry *__entry_find(struct mb_cache *cache,
 	struct hlist_bl_head *head;
 
 	head = mb_cache_entry_head(cache, key);
-	hlist_bl_lock(head);
+	rcu_read_lock();
 	if (entry && !hlist_bl_unhashed(&entry->e_hash_list))
-		node = entry->e_hash_list.next;
+		node = rcu_dereference_raw(entry->e_hash_list.next);
 	else
-		node = hlist_bl_first(head);
+		node = hlist_bl_first_rcu(head);
 	while (node) {
 		entry = hlist_bl_entry(node, struct mb_cache_entry,
 				       e_hash_list);
@@ -170,11 +207,11 @@ static struct mb_cache_entry *__entry_find(struct mb_cache *cache,
 		    test_bit(MBE_REUSABLE_B, &entry->e_flags) &&
 		    atomic_inc_not_zero(&entry->e_refcnt))
 			goto out;
-		node = node->next;
+		node = rcu_dereference_raw(node->next);
 	}
 	entry = NULL;
 out:
-	hlist_bl_unlock(head);
+	rcu_read_unlock();
 	if (old_entry)
 		mb_cache_entry_put(cache, old_entry);
 
@@ -227,15 +264,15 @@ struct mb_cache_entry *mb_cache_entry_get(struct mb_cache *cache, u32 key,
 	struct mb_cache_entry *entry;
 
 	head = mb_cache_entry_head(cache, key);
-	hlist_bl_lock(head);
-	hlist_bl_for_each_entry(entry, node, head, e_hash_list) {
+	rcu_read_lock();
+	hlist_bl_for_each_entry_rcu(entry, node, head, e_hash_list) {
 		if (entry->e_key == key && entry->e_value == value &&
 		    atomic_inc_not_zero(&entry->e_refcnt))
 			goto out;
 	}
 	entry = NULL;
 out:
-	hlist_bl_unlock(head);
+	rcu_read_unlock();
 	return entry;
 }
 EXPORT_SYMBOL(mb_cache_entry_get);
@@ -254,6 +291,7 @@ EXPORT_SYMBOL(mb_cache_entry_get);
 struct mb_cache_entry *mb_cache_entry_delete_or_get(struct mb_cache *cache,
 						    u32 key, u64 value)
 {
+	struct mb_cache_lru *lru = mb_cache_entry_lru(cache, key, value);
 	struct mb_cache_entry *entry;
 
 	entry = mb_cache_entry_get(cache, key, value);
@@ -267,11 +305,11 @@ struct mb_cache_entry *mb_cache_entry_delete_or_get(struct mb_cache *cache,
 	if (atomic_cmpxchg(&entry->e_refcnt, 2, 0) != 2)
 		return entry;
 
-	spin_lock(&cache->c_list_lock);
+	spin_lock(&lru->l_lock);
 	if (!list_empty(&entry->e_list))
 		list_del_init(&entry->e_list);
-	cache->c_entry_count--;
-	spin_unlock(&cache->c_list_lock);
+	spin_unlock(&lru->l_lock);
+	atomic_long_dec(&cache->c_entry_count);
 	__mb_cache_entry_free(cache, entry);
 	return NULL;
 }
@@ -282,11 +320,14 @@ EXPORT_SYMBOL(mb_cache_entry_delete_or_get);
  * @entry - entry that got used
  *
  * Marks entry as used to give hit higher chances of surviving in cache.
+ * Heavily shared entries are touched all the time, so avoid dirtying the
+ * cacheline when the bit is already set.
  */
 void mb_cache_entry_touch(struct mb_cache *cache,
 			  struct mb_cache_entry *entry)
 {
-	set_bit(MBE_REFERENCED_B, &entry->e_flags);
+	if (!test_bit(MBE_REFERENCED_B, &entry->e_flags))
+		set_bit(MBE_REFERENCED_B, &entry->e_flags);
 }
 EXPORT_SYMBOL(mb_cache_entry_touch);
 
@@ -295,36 +336,60 @@ static unsigned long mb_cache_count(struct shrinker *shrink,
 {
 	struct mb_cache *cache = shrink->private_data;
 
-	return cache->c_entry_count;
+	return atomic_long_read(&cache->c_entry_count);
 }
 
-/* Shrink number of entries in cache */
-static unsigned long mb_cache_shrink(struct mb_cache *cache,
-				     unsigned long nr_to_scan)
+/* Shrink number of entries in one LRU shard */
+static unsigned long mb_cache_shrink_lru(struct mb_cache *cache,
+					 struct mb_cache_lru *lru,
+					 unsigned long nr_to_scan)
 {
 	struct mb_cache_entry *entry;
 	unsigned long shrunk = 0;
 
-	spin_lock(&cache->c_list_lock);
-	while (nr_to_scan-- && !list_empty(&cache->c_list)) {
-		entry = list_first_entry(&cache->c_list,
+	spin_lock(&lru->l_lock);
+	while (nr_to_scan-- && !list_empty(&lru->l_list)) {
+		entry = list_first_entry(&lru->l_list,
 					 struct mb_cache_entry, e_list);
 		/* Drop initial hash reference if there is no user */
 		if (test_bit(MBE_REFERENCED_B, &entry->e_flags) ||
 		    atomic_cmpxchg(&entry->e_refcnt, 1, 0) != 1) {
 			clear_bit(MBE_REFERENCED_B, &entry->e_flags);
-			list_move_tail(&entry->e_list, &cache->c_list);
+			list_move_tail(&entry->e_list, &lru->l_list);
 			continue;
 		}
 		list_del_init(&entry->e_list);
-		cache->c_entry_count--;
-		spin_unlock(&cache->c_list_lock);
+		spin_unlock(&lru->l_lock);
+		atomic_long_dec(&cache->c_entry_count);
 		__mb_cache_entry_free(cache, entry);
 		shrunk++;
 		cond_resched();
-		spin_lock(&cache->c_list_lock);
+		spin_lock(&lru->l_lock);
+	}
+	spin_unlock(&lru->l_lock);
+
+	return shrunk;
+}
+
+/*
+ * Shrink number of entries in cache. The scan is spread evenly over the LRU
+ * shards, starting at a different shard on each call.
+ */
+static unsigned long mb_cache_shrink(struct mb_cache *cache,
+				     unsigned long nr_to_scan)
+{
+	unsigned int nr_lru = 1U << cache->c_lru_bits;
+	unsigned long per_lru = DIV_ROUND_UP(nr_to_scan, nr_lru);
+	unsigned int start = atomic_inc_return(&cache->c_lru_next);
+	unsigned long shrunk = 0, nr;
+	unsigned int i;
+
+	for (i = 0; i < nr_lru && nr_to_scan; i++) {
+		nr = min(per_lru, nr_to_scan);
+		shrunk += mb_cache_shrink_lru(cache,
+				&cache->c_lru[(start + i) & (nr_lru - 1)], nr);
+		nr_to_scan -= nr;
 	}
-	spin_unlock(&cache->c_list_lock);
 
 	return shrunk;
 }
@@ -363,8 +428,8 @@ struct mb_cache *mb_cache_create(int bucket_bits)
 		goto err_out;
 	cache->c_bucket_bits = bucket_bits;
 	cache->c_max_entries = bucket_count << 4;
-	INIT_LIST_HEAD(&cache->c_list);
-	spin_lock_init(&cache->c_list_lock);
+	cache->c_lru_bits = min_t(int, order_base_2(num_possible_cpus()),
+				  min(bucket_bits, MB_CACHE_LRU_BITS_MAX));
 	cache->c_hash = kmalloc_array(bucket_count,
 				      sizeof(struct hlist_bl_head),
 				      GFP_KERNEL);
@@ -375,8 +440,21 @@ struct mb_cache *mb_cache_create(int bucket_bits)
 	for (i = 0; i < bucket_count; i++)
 		INIT_HLIST_BL_HEAD(&cache->c_hash[i]);
 
+	cache->c_lru = kcalloc(1UL << cache->c_lru_bits,
+			       sizeof(struct mb_cache_lru), GFP_KERNEL);
+	if (!cache->c_lru) {
+		kfree(cache->c_hash);
+		kfree(cache);
+		goto err_out;
+	}
+	for (i = 0; i < (1UL << cache->c_lru_bits); i++) {
+		spin_lock_init(&cache->c_lru[i].l_lock);
+		INIT_LIST_HEAD(&cache->c_lru[i].l_list);
+	}
+
 	cache->c_shrink = shrinker_alloc(0, "mbcache-shrinker");
 	if (!cache->c_shrink) {
+		kfree(cache->c_lru);
 		kfree(cache->c_hash);
 		kfree(cache);
 		goto err_out;
@@ -407,6 +485,7 @@ EXPORT_SYMBOL(mb_cache_create);
 void mb_cache_destroy(struct mb_cache *cache)
 {
 	struct mb_cache_entry *entry, *next;
+	int i;
 
 	shrinker_free(cache->c_shrink);
 
@@ -414,11 +493,15 @@ void mb_cache_destroy(struct mb_cache *cache)
 	 * We don't bother with any locking. Cache must not be used at this
 	 * point.
 	 */
-	list_for_each_entry_safe(entry, next, &cache->c_list, e_list) {
-		list_del(&entry->e_list);
-		WARN_ON(atomic_read(&entry->e_refcnt) != 1);
-		mb_cache_entry_put(cache, entry);
+	for (i = 0; i < (1 << cache->c_lru_bits); i++) {
+		list_for_each_entry_safe(entry, next, &cache->c_lru[i].l_list,
+					 e_list) {
+			list_del(&entry->e_list);
+			WARN_ON(atomic_read(&entry->e_refcnt) != 1);
+			mb_cache_entry_put(cache, entry);
+		}
 	}
+	kfree(cache->c_lru);
 	kfree(cache->c_hash);
 	kfree(cache);
 }
@@ -434,6 +517,8 @@ static int __init mbcache_init(void)
 
 static void __exit mbcache_exit(void)
 {
+	/* Wait for entries still queued by __mb_cache_entry_free() */
+	rcu_barrier();
 	kmem_cache_destroy(mb_entry_cache);
 }
 
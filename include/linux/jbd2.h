@@ -675,6 +675,12 @@ struct transaction_s
 	 */
 	atomic_t		t_handle_count;
 
+	/*
+	 * How many synchronous handles and fsync callers are waiting for
+	 * this transaction to commit? [none]
+	 */
+	atomic_t		t_sync_waiters;
+
 	/*
 	 * Forward and backward links for the circular list of all transactions
 	 * awaiting checkpoint. [j_list_lock]
@@ -844,6 +850,12 @@ struct journal_s
 	 */
 	wait_queue_head_t	j_wait_updates;
 
+	/**
+	 * @j_wait_batch: Wait queue for the commit thread to wait for
+	 * more synchronous waiters to join a group commit.
+	 */
+	wait_queue_head_t	j_wait_batch;
+
 	/**
 	 * @j_wait_reserved:
 	 *
@@ -1104,16 +1116,12 @@ struct journal_s
 	 */
 	struct timer_list	j_commit_timer;
 
-	/**
-	 * @j_revoke_lock: Protect the revoke table.
-	 */
-	spinlock_t		j_revoke_lock;
-
 	/**
 	 * @j_revoke:
 	 *
 	 * The revoke table - maintains the list of revoked blocks in the
-	 * current transaction.
+	 * current transaction.  Each hash bucket has its own lock; lookups
+	 * are done under RCU.
 	 */
 	struct jbd2_revoke_table_s *j_revoke;
 
@@ -1149,12 +1157,35 @@ struct journal_s
 	int			j_fc_wbufsize;
 
 	/**
-	 * @j_last_sync_writer:
+	 * @j_last_sync_arrival:
+	 *
+	 * When the last synchronous waiter arrived, in nanoseconds.
+	 */
+	atomic64_t		j_last_sync_arrival;
+
+	/**
+	 * @j_sync_interval:
+	 *
+	 * The average interval in nanoseconds between arrivals of
+	 * synchronous waiters. [none]
+	 */
+	unsigned long		j_sync_interval;
+
+	/**
+	 * @j_flush_time:
+	 *
+	 * The average time in nanoseconds it takes to write out the commit
+	 * record and flush the device cache. [none]
+	 */
+	unsigned long		j_flush_time;
+
+	/**
+	 * @j_batch_target:
 	 *
-	 * The pid of the last person to run a synchronous operation
-	 * through the journal.
+	 * Number of synchronous waiters the commit thread is waiting for
+	 * before committing, or UINT_MAX if it is not waiting. [none]
 	 */
-	pid_t			j_last_sync_writer;
+	unsigned int		j_batch_target;
 
 	/**
 	 * @j_average_commit_time:
@@ -1168,7 +1199,8 @@ struct journal_s
 	 * @j_min_batch_time:
 	 *
 	 * Minimum time that we should wait for additional filesystem operations
-	 * to get batched into a synchronous handle in microseconds.
+	 * to get batched into a synchronous commit in microseconds, when
+	 * waiting is worthwhile at all.
 	 */
 	u32			j_min_batch_time;
 
@@ -1176,7 +1208,8 @@ struct journal_s
 	 * @j_max_batch_time:
 	 *
 	 * Maximum time that we should wait for additional filesystem operations
-	 * to get batched into a synchronous handle in microseconds.
+	 * to get batched into a synchronous commit in microseconds.  Setting
+	 * it to 0 disables group commit batching.
 	 */
 	u32			j_max_batch_time;
 
@@ -1622,7 +1655,9 @@ static inline void jbd2_free_inode(struct jbd2_inode *jinode)
 
 /* Primary revoke support */
 #define JOURNAL_REVOKE_DEFAULT_HASH 256
+#define JOURNAL_REVOKE_MAX_HASH	(1 << 16)
 extern int	   jbd2_journal_init_revoke(journal_t *, int);
+extern int	   jbd2_journal_resize_revoke(journal_t *, int);
 extern void	   jbd2_journal_destroy_revoke_record_cache(void);
 extern void	   jbd2_journal_destroy_revoke_table_cache(void);
 extern int __init jbd2_journal_init_revoke_record_cache(void);
@@ -1653,6 +1688,7 @@ int jbd2_journal_start_commit(journal_t *journal, tid_t *tid);
 int jbd2_log_wait_commit(journal_t *journal, tid_t tid);
 int jbd2_transaction_committed(journal_t *journal, tid_t tid);
 int jbd2_complete_transaction(journal_t *journal, tid_t tid);
+void jbd2_note_sync_waiter(journal_t *journal, transaction_t *transaction);
 int jbd2_log_do_checkpoint(journal_t *journal);
 int jbd2_trans_will_send_data_barrier(journal_t *journal, tid_t tid);
 
@@ -17,11 +17,11 @@ enum {
 };
 
 struct mb_cache_entry {
-	/* List of entries in cache - protected by cache->c_list_lock */
+	/* List of entries in cache - protected by the LRU shard lock */
 	struct list_head	e_list;
 	/*
-	 * Hash table list - protected by hash chain bitlock. The entry is
-	 * guaranteed to be hashed while e_refcnt > 0.
+	 * Hash table list - modified under hash chain bitlock, walked under
+	 * RCU. The entry is guaranteed to be hashed while e_refcnt > 0.
 	 */
 	struct hlist_bl_node	e_hash_list;
 	/*
@@ -35,6 +35,8 @@ struct mb_cache_entry {
 	unsigned long		e_flags;
 	/* User provided value - stable during lifetime of the entry */
 	u64			e_value;
+	/* Entries are freed after an RCU grace period */
+	struct rcu_head		e_rcu;
 };
 
 struct mb_cache *mb_cache_create(int bucket_bits);
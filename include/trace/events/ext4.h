@@ -104,6 +104,7 @@ TRACE_DEFINE_ENUM(EXT4_FC_REASON_RENAME_DIR);
 TRACE_DEFINE_ENUM(EXT4_FC_REASON_FALLOC_RANGE);
 TRACE_DEFINE_ENUM(EXT4_FC_REASON_INODE_JOURNAL_DATA);
 TRACE_DEFINE_ENUM(EXT4_FC_REASON_ENCRYPTED_FILENAME);
+TRACE_DEFINE_ENUM(EXT4_FC_REASON_DIR_SHRINK);
 TRACE_DEFINE_ENUM(EXT4_FC_REASON_MAX);
 
 #define show_fc_reason(reason)						\
@@ -117,7 +118,8 @@ TRACE_DEFINE_ENUM(EXT4_FC_REASON_MAX);
 		{ EXT4_FC_REASON_RENAME_DIR,	"RENAME_DIR"},		\
 		{ EXT4_FC_REASON_FALLOC_RANGE,	"FALLOC_RANGE"},	\
 		{ EXT4_FC_REASON_INODE_JOURNAL_DATA,	"INODE_JOURNAL_DATA"}, \
-		{ EXT4_FC_REASON_ENCRYPTED_FILENAME,	"ENCRYPTED_FILENAME"})
+		{ EXT4_FC_REASON_ENCRYPTED_FILENAME,	"ENCRYPTED_FILENAME"}, \
+		{ EXT4_FC_REASON_DIR_SHRINK,	"DIR_SHRINK"})
 
 TRACE_DEFINE_ENUM(CR_POWER2_ALIGNED);
 TRACE_DEFINE_ENUM(CR_GOAL_LEN_FAST);
@@ -2676,6 +2678,40 @@ TRACE_EVENT(ext4_lazy_itable_init,
 		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->group)
 );
 
+TRACE_EVENT(ext4_mount_stats,
+	TP_PROTO(struct super_block *sb, u64 group_desc_ns, u64 journal_ns,
+		 u64 mb_init_ns, u64 orphan_ns, u64 total_ns),
+
+	TP_ARGS(sb, group_desc_ns, journal_ns, mb_init_ns, orphan_ns,
+		total_ns),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,	dev			)
+		__field(	__u32,	groups			)
+		__field(	u64,	group_desc_ns		)
+		__field(	u64,	journal_ns		)
+		__field(	u64,	mb_init_ns		)
+		__field(	u64,	orphan_ns		)
+		__field(	u64,	total_ns		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->groups		= EXT4_SB(sb)->s_groups_count;
+		__entry->group_desc_ns	= group_desc_ns;
+		__entry->journal_ns	= journal_ns;
+		__entry->mb_init_ns	= mb_init_ns;
+		__entry->orphan_ns	= orphan_ns;
+		__entry->total_ns	= total_ns;
+	),
+
+	TP_printk("dev %d,%d groups %u group_desc_ns %llu journal_ns %llu "
+		  "mb_init_ns %llu orphan_ns %llu total_ns %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->groups,
+		  __entry->group_desc_ns, __entry->journal_ns,
+		  __entry->mb_init_ns, __entry->orphan_ns, __entry->total_ns)
+);
+
 TRACE_EVENT(ext4_fc_replay_scan,
 	TP_PROTO(struct super_block *sb, int error, int off),
 
@@ -2808,7 +2844,8 @@ TRACE_EVENT(ext4_fc_stats,
 	),
 
 	TP_printk("dev %d,%d fc ineligible reasons:\n"
-		  "%s:%u, %s:%u, %s:%u, %s:%u, %s:%u, %s:%u, %s:%u, %s:%u, %s:%u, %s:%u"
+		  "%s:%u, %s:%u, %s:%u, %s:%u, %s:%u, %s:%u, %s:%u, %s:%u, %s:%u, %s:%u, "
+		  "%s:%u"
 		  "num_commits:%lu, ineligible: %lu, numblks: %lu",
 		  MAJOR(__entry->dev), MINOR(__entry->dev),
 		  FC_REASON_NAME_STAT(EXT4_FC_REASON_XATTR),
@@ -2821,6 +2858,7 @@ TRACE_EVENT(ext4_fc_stats,
 		  FC_REASON_NAME_STAT(EXT4_FC_REASON_FALLOC_RANGE),
 		  FC_REASON_NAME_STAT(EXT4_FC_REASON_INODE_JOURNAL_DATA),
 		  FC_REASON_NAME_STAT(EXT4_FC_REASON_ENCRYPTED_FILENAME),
+		  FC_REASON_NAME_STAT(EXT4_FC_REASON_DIR_SHRINK),
 		  __entry->fc_commits, __entry->fc_ineligible_commits,
 		  __entry->fc_numblks)
 );
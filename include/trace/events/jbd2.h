@@ -245,6 +245,34 @@ TRACE_EVENT(jbd2_handle_stats,
 		  __entry->dirtied_blocks)
 );
 
+TRACE_EVENT(jbd2_group_commit,
+	TP_PROTO(dev_t dev, tid_t tid, unsigned int waiters,
+		 unsigned int target, u64 waited),
+
+	TP_ARGS(dev, tid, waiters, target, waited),
+
+	TP_STRUCT__entry(
+		__field(		dev_t,	dev		)
+		__field(		tid_t,	tid		)
+		__field(	 unsigned int,	waiters		)
+		__field(	 unsigned int,	target		)
+		__field(		  u64,	waited		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->tid		= tid;
+		__entry->waiters	= waiters;
+		__entry->target		= target;
+		__entry->waited		= waited;
+	),
+
+	TP_printk("dev %d,%d tid %u waiters %u target %u waited %lluus",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->tid,
+		  __entry->waiters, __entry->target,
+		  div_u64(__entry->waited, 1000))
+);
+
 TRACE_EVENT(jbd2_run_stats,
 	TP_PROTO(dev_t dev, tid_t tid,
 		 struct transaction_run_stats_s *stats),
@@ -33,6 +33,8 @@
 #define EXT4_IOC_CHECKPOINT		_IOW('f', 43, __u32)
 #define EXT4_IOC_GETFSUUID		_IOR('f', 44, struct fsuuid)
 #define EXT4_IOC_SETFSUUID		_IOW('f', 44, struct fsuuid)
+#define EXT4_IOC_SNAPSHOT_TAKE		_IO('f', 45)
+#define EXT4_IOC_SNAPSHOT_DELETE	_IO('f', 46)
 
 #define EXT4_IOC_SHUTDOWN _IOR('X', 125, __u32)
 